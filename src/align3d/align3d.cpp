@@ -4,39 +4,50 @@
 #include <stdlib.h>
 #include <iostream>
 #include <algorithm>
+#include <map>
+#include <random>
+#include <set>
 #include "align3d.h"
+#include "correlation.h"
+#include "icp.h"
+#include "local.h"
+#include "WorkQueue.h"
+#include "RasterCache.h"
 
 namespace align3d {
     bool computeRMS(float dx, float dy, long numSamples, long maxSamples, std::vector<double> &xlist,
                     std::vector<double> &ylist, OrthoImage<unsigned short> &referenceDSM,
                     OrthoImage<unsigned short> &targetDSM, float &medianDZ, float &rms, long &ndx,
                     float &completeness) {
-        // Loop on number of samples and compute RMS.
-        // Just in case there aren't many valid points, don't let this loop forever.
-        long count = 0;
-        ndx = 0;
         std::vector<float> differences;
-        while ((count < numSamples) && (ndx < maxSamples)) {
-            // Get the next point for matching.
-            double x = xlist[ndx];
-            double y = ylist[ndx];
-            ndx++;
+        return computeRMS(dx, dy, numSamples, maxSamples, xlist, ylist, referenceDSM, targetDSM, medianDZ, rms, ndx,
+                          completeness, differences);
+    }
 
-            // Map the point into the target.
-            // Skip if this isn't a valid point.
-            long col = long((x - targetDSM.easting + dx) / targetDSM.gsd + 0.5);
-            long row = targetDSM.height - 1 - long((y - targetDSM.northing + dy) / targetDSM.gsd + 0.5);
-            if (col <= 0) continue;
-            if (row <= 0) continue;
-            if (col >= targetDSM.width - 1) continue;
-            if (row >= targetDSM.height - 1) continue;
-            if (targetDSM.data[row][col] == 0) continue;
-            float targetZ = float(targetDSM.data[row][col]) * targetDSM.scale + targetDSM.offset;
+    bool computeRMS(float dx, float dy, long numSamples, long maxSamples, std::vector<double> &xlist,
+                    std::vector<double> &ylist, OrthoImage<unsigned short> &referenceDSM,
+                    OrthoImage<unsigned short> &targetDSM, float &medianDZ, float &rms, long &ndx,
+                    float &completeness, std::vector<float> &differences) {
+        AlignSamples samples;
+        prepareSamples(xlist, ylist, maxSamples, referenceDSM, targetDSM, samples);
+        return computeRMS(dx, dy, numSamples, samples, targetDSM, medianDZ, rms, ndx, completeness, differences);
+    }
+
+    void prepareSamples(std::vector<double> &xlist, std::vector<double> &ylist, long maxSamples,
+                        OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                        AlignSamples &samples) {
+        samples.u.clear();
+        samples.v.clear();
+        samples.z.clear();
+        long size = MIN(maxSamples, (long) xlist.size());
+        for (long k = 0; k < size; k++) {
+            double x = xlist[k];
+            double y = ylist[k];
 
             // Map the point into the reference.
             // Skip if this isn't a valid point.
-            col = long((x - referenceDSM.easting) / referenceDSM.gsd + 0.5);
-            row = referenceDSM.height - 1 - long((y - referenceDSM.northing) / referenceDSM.gsd + 0.5);
+            long col = long((x - referenceDSM.easting) / referenceDSM.gsd + 0.5);
+            long row = referenceDSM.height - 1 - long((y - referenceDSM.northing) / referenceDSM.gsd + 0.5);
             if (col <= 0) continue;
             if (row <= 0) continue;
             if (col >= referenceDSM.width - 1) continue;
@@ -44,119 +55,406 @@ namespace align3d {
             if (referenceDSM.data[row][col] == 0) continue;
             float referenceZ = float(referenceDSM.data[row][col]) * referenceDSM.scale + referenceDSM.offset;
 
-            // Keep going until we have enough points.
-            float difference = referenceZ - targetZ;
-            differences.push_back(difference);
-            count++;
+            samples.u.push_back(x - targetDSM.easting);
+            samples.v.push_back(y - targetDSM.northing);
+            samples.z.push_back(referenceZ);
+        }
+    }
+
+    // Conservative lower bound on the robust RMS of a full sample, from the first count differences.
+    // Samples are drawn independently, so order statistics give confidence intervals for the full sample's median and
+    // 67th percentile absolute deviation. Taking them four standard deviations wide, the RMS is at least the lower
+    // percentile bound less the width of the median interval. The differences may be reordered.
+    static float lowerBoundRMS(std::vector<float> &differences, long count) {
+        const double z = 4.0;
+        double spread = z * sqrt((double) count);
+        long lo = MAX(0L, long(count * 0.5 - spread * 0.5));
+        long hi = MIN(count - 1, long(ceil(count * 0.5 + spread * 0.5)));
+        std::nth_element(differences.begin(), differences.begin() + count / 2, differences.begin() + count);
+        float median = differences[count / 2];
+        std::nth_element(differences.begin(), differences.begin() + lo, differences.begin() + count);
+        float medianLo = differences[lo];
+        std::nth_element(differences.begin(), differences.begin() + hi, differences.begin() + count);
+        float medianHi = differences[hi];
+
+        // Put absolute deviations after the differences and find the lower percentile bound there.
+        long k = long(count * 0.67 - z * sqrt(count * 0.67 * 0.33));
+        if (k < 0) return 0.0;
+        differences.resize(count * 2);
+        for (long i = 0; i < count; i++) differences[count + i] = fabs(differences[i] - median);
+        std::nth_element(differences.begin() + count, differences.begin() + count + k, differences.end());
+        float deviation = differences[count + k];
+        differences.resize(count);
+        return deviation - MAX(median - medianLo, medianHi - median);
+    }
+
+    bool computeRMS(float dx, float dy, long numSamples, const AlignSamples &samples,
+                    OrthoImage<unsigned short> &targetDSM, float &medianDZ, float &rms, long &ndx,
+                    float &completeness, std::vector<float> &differences, float abortRMS, bool *aborted) {
+        // Check a bound on the RMS after 1/16 and 1/4 of the samples if early abort is requested.
+        long checkpoints[2] = {numSamples / 16, numSamples / 4};
+        int nextCheckpoint = (abortRMS < MAX_FLOAT) ? 0 : 2;
+        if (aborted) *aborted = false;
+
+        // Loop on blocks of samples until there are enough valid ones.
+        // Target elevations for a whole block are gathered first, with void or outside pixels read as zero,
+        // then differences are kept in sample order until there are enough points.
+        const long blockSize = 256;
+        unsigned short gathered[blockSize];
+        long size = (long) samples.z.size();
+        long width = targetDSM.width;
+        long height = targetDSM.height;
+        long count = 0;
+        ndx = 0;
+        differences.clear();
+        differences.reserve(numSamples);
+        while ((count < numSamples) && (ndx < size)) {
+            long n = MIN(blockSize, size - ndx);
+            const double *u = &samples.u[ndx];
+            const double *v = &samples.v[ndx];
+            for (long k = 0; k < n; k++) {
+                long col = long((u[k] + dx) / targetDSM.gsd + 0.5);
+                long row = height - 1 - long((v[k] + dy) / targetDSM.gsd + 0.5);
+                bool inside = (col > 0) & (row > 0) & (col < width - 1) & (row < height - 1);
+                gathered[k] = inside ? targetDSM.data[row][col] : (unsigned short) 0;
+            }
+            const float *z = &samples.z[ndx];
+            for (long k = 0; (k < n) && (count < numSamples); k++) {
+                ndx++;
+                if (gathered[k] == 0) continue;
+                float targetZ = float(gathered[k]) * targetDSM.scale + targetDSM.offset;
+                float difference = z[k] - targetZ;
+                differences.push_back(difference);
+                count++;
+                if ((nextCheckpoint < 2) && (count == checkpoints[nextCheckpoint])) {
+                    nextCheckpoint++;
+                    if (lowerBoundRMS(differences, count) > abortRMS) {
+                        if (aborted) *aborted = true;
+                        return false;
+                    }
+                }
+            }
         }
 
         // Skip if not enough sampled points.
         if (count < numSamples) return false;
 
         // Compute median Z offset and a robust estimate of the RMS difference.
+        // Selecting the order statistics gives the same values as sorting without ordering everything else.
+        // Completeness is counted while taking absolute deviations.
         rms = 0.0;
-        sort(differences.begin(), differences.end());
+        std::nth_element(differences.begin(), differences.begin() + count / 2, differences.end());
         medianDZ = differences[count / 2];
+        long good = 0;
         for (long k = 0; k < count; k++) {
             differences[k] = fabs(differences[k] - medianDZ);
-        }
-        sort(differences.begin(), differences.end());
-        rms = differences[(long) (count * 0.67)];
-
-        // Compute the completeness.
-        long good = 0;
-        for (long k = 0; k < count; ++k) {
             if (differences[k] < 1.0) ++good;
         }
+        long rmsIndex = (long) (count * 0.67);
+        std::nth_element(differences.begin(), differences.begin() + rmsIndex, differences.end());
+        rms = differences[rmsIndex];
         completeness = good / (float) numSamples;
 
         return true;
     }
 
+// Average 2x2 blocks of valid pixels into an image with twice the GSD. Blocks with no valid pixels are void.
+// The origin moves so that each output pixel is centered on the block it averages.
+    static void downsampleDSM(OrthoImage<unsigned short> &image, OrthoImage<unsigned short> &half) {
+        half.Allocate(image.width / 2, image.height / 2);
+        half.gsd = image.gsd * 2;
+        half.easting = image.easting + 0.5 * image.gsd;
+        half.northing = image.northing + (image.height - 2.0 * half.height + 0.5) * image.gsd;
+        half.zone = image.zone;
+        half.scale = image.scale;
+        half.offset = image.offset;
+        for (unsigned int j = 0; j < half.height; j++) {
+            for (unsigned int i = 0; i < half.width; i++) {
+                unsigned long sum = 0;
+                unsigned int count = 0;
+                for (unsigned int jj = j * 2; jj <= j * 2 + 1; jj++) {
+                    for (unsigned int ii = i * 2; ii <= i * 2 + 1; ii++) {
+                        unsigned short value = image.data[jj][ii];
+                        if (value == 0) continue;
+                        sum += value;
+                        count++;
+                    }
+                }
+                if (count > 0) half.data[j][i] = (unsigned short) MAX(1, (sum + count / 2) / count);
+            }
+        }
+    }
+
+    // An evaluated translation, indexed on the full resolution search grid.
+    typedef struct {
+        long i;
+        long j;
+        float rms;
+        float dz;
+        float completeness;
+    } AlignCandidate;
+
+    static bool lowerRMS(const AlignCandidate &a, const AlignCandidate &b) {
+        if (a.rms != b.rms) return a.rms < b.rms;
+        return (a.i != b.i) ? (a.i < b.i) : (a.j < b.j);
+    }
+
 // Estimate 3D rigid body transform parameters to align target points with reference.
-    void EstimateRigidBody(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM, float maxt,
-                           AlignBounds &bounds, AlignResult &result) {
+// Translations are searched on a grid of one GSD within maxt. With pyramid levels, every translation is first
+// evaluated on DSMs downsampled by 2^levels, at that spacing. The best beamWidth candidates are then refined within
+// two grid steps at each finer level, down to full resolution. Zero levels evaluates every translation at full
+// resolution. With params.correlate, an FFT cross-correlation of the DSMs replaces the coarse search, and the search
+// descends from its peak at full resolution.
+    void EstimateRigidBody(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                           const AlignParameters &params, AlignBounds &bounds, AlignResult &result) {
+        ScopedTimer timer("EstimateRigidBody");
+        float maxt = params.maxt;
         float step = MIN(referenceDSM.gsd, targetDSM.gsd);
         long numSamples = 10000;
         long maxSamples = numSamples * 10;
-
-        // Allocate RMS array.
         long bins = long(maxt / step * 2) + 1;
-        float **rmsArray = new float *[bins];
-        for (long i = 0; i < bins; i++) rmsArray[i] = new float[bins];
+        unsigned int numThreads = resolveThreadCount(params.numThreads);
+
+        // Seed the search with the cross-correlation peak if requested.
+        bool seeded = false;
+        long seedi = 0;
+        long seedj = 0;
+        if (params.correlate) {
+            float dx = 0.0;
+            float dy = 0.0;
+            float peak = 0.0;
+            if (correlateDSMs(referenceDSM, targetDSM, bounds, maxt, step, numThreads, dx, dy, peak)) {
+                seeded = true;
+                seedi = lround((dx + maxt) / step);
+                seedj = lround((dy + maxt) / step);
+            } else {
+                printf("Cross-correlation found no valid overlap; searching the full window.\n");
+            }
+        }
+
+        // Choose the number of pyramid levels.
+        // By default, coarsen until the full window is at most 32 steps across, keeping at least 64 pixels per side.
+        int levels = params.levels;
+        if (levels < 0) {
+            levels = 0;
+            unsigned int minSize = MIN(MIN(referenceDSM.width, referenceDSM.height),
+                                       MIN(targetDSM.width, targetDSM.height));
+            while (((bins - 1) >> levels > 32) && ((minSize >> (levels + 1)) >= 64)) levels++;
+        }
+        if (seeded) levels = 0;
+        long beamWidth = MAX(1, params.beamWidth);
+
+        // Build the DSM pyramids. Level zero is the full resolution DSM.
+        std::vector<OrthoImage<unsigned short> *> referencePyramid(1, &referenceDSM);
+        std::vector<OrthoImage<unsigned short> *> targetPyramid(1, &targetDSM);
+        for (int level = 1; level <= levels; level++) {
+            referencePyramid.push_back(new OrthoImage<unsigned short>);
+            targetPyramid.push_back(new OrthoImage<unsigned short>);
+            downsampleDSM(*referencePyramid[level - 1], *referencePyramid[level]);
+            downsampleDSM(*targetPyramid[level - 1], *targetPyramid[level]);
+        }
 
         // Get random samples.
-        srand(0);
-        long seed = 0;
-        long count = 0;
+        // Each call has its own generator, so concurrent alignments draw the same samples as a single one.
+        // Its raw output is scaled to [0, 1) here because standard library distributions differ between platforms.
+        std::minstd_rand random(0);
+        auto unit = [](std::minstd_rand &generator) {
+            return (generator() - std::minstd_rand::min()) /
+                   ((double) std::minstd_rand::max() - std::minstd_rand::min() + 1.0);
+        };
         std::vector<double> xlist;
         std::vector<double> ylist;
         for (long i = 0; i < maxSamples; i++) {
             // Get a random point in the overlap area.
-            double x = bounds.xmin + ((rand() / (double) RAND_MAX) * bounds.width);
-            double y = bounds.ymin + ((rand() / (double) RAND_MAX) * bounds.height);
+            double x = bounds.xmin + unit(random) * bounds.width;
+            double y = bounds.ymin + unit(random) * bounds.height;
             xlist.push_back(x);
             ylist.push_back(y);
         }
 
-        // Start with brute force, but sample points to reduce timeline.
-        // Loop on X and Y translation within search distance.
-        float threshold = MAX_FLOAT;
+        // Look up reference elevations once per pyramid level.
+        std::vector<AlignSamples> samples(levels + 1);
+        for (int level = 0; level <= levels; level++) {
+            prepareSamples(xlist, ylist, maxSamples, *referencePyramid[level], *targetPyramid[level], samples[level]);
+        }
+
+        // Evaluate a batch of translations on one pyramid level, skipping any already evaluated there.
+        // Translations are independent, so threads take them one at a time with their own scratch buffers.
+        // Results are merged in batch order, and ties are broken by grid index, so the outcome does not depend on
+        // the thread count. Translations without enough valid samples are not candidates.
+        // With early abort, translations are evaluated in fixed-size chunks. A translation is abandoned once its RMS
+        // is almost surely above the keep-th best RMS from earlier chunks, so the best keep are not affected.
+        std::vector<std::vector<float> > scratch(numThreads);
+        std::vector<std::map<std::pair<long, long>, AlignCandidate> > evaluated(levels + 1);
+        std::vector<std::set<std::pair<long, long> > > abandoned(levels + 1);
+        const long chunkSize = 256;
+        long numEvaluated = 0;
+        long numAbandoned = 0;
+        auto evaluate = [&](int level, const std::vector<std::pair<long, long> > &batch,
+                            std::vector<AlignCandidate> &candidates, long keep) {
+            std::vector<AlignCandidate> pending;
+            for (size_t k = 0; k < batch.size(); k++) {
+                long i = batch[k].first;
+                long j = batch[k].second;
+                if ((i < 0) || (i >= bins) || (j < 0) || (j >= bins)) continue;
+                if (evaluated[level].count(batch[k])) continue;
+                AlignCandidate candidate = {i, j, 0.0, 0.0, 0.0};
+                evaluated[level][batch[k]] = candidate;
+                pending.push_back(candidate);
+            }
+            long chunk = (params.earlyAbort && (keep > 0)) ? chunkSize : MAX(1L, (long) pending.size());
+            for (long first = 0; first < (long) pending.size(); first += chunk) {
+                long count = MIN(chunk, (long) pending.size() - first);
+                float abortRMS = MAX_FLOAT;
+                if (params.earlyAbort && (keep > 0) && ((long) candidates.size() >= keep)) {
+                    std::vector<float> kept;
+                    for (size_t k = 0; k < candidates.size(); k++) kept.push_back(candidates[k].rms);
+                    std::nth_element(kept.begin(), kept.begin() + keep - 1, kept.end());
+                    abortRMS = kept[keep - 1];
+                }
+                std::vector<char> ok(count, 0);
+                std::vector<char> aborted(count, 0);
+                parallelFor(count, numThreads, [&](long k, unsigned int thread) {
+                    AlignCandidate &candidate = pending[first + k];
+                    long numSampled = 0;
+                    bool stopped = false;
+                    ok[k] = computeRMS(-maxt + candidate.i * step, -maxt + candidate.j * step, numSamples,
+                                       samples[level], *targetPyramid[level], candidate.dz, candidate.rms, numSampled,
+                                       candidate.completeness, scratch[thread], abortRMS, &stopped);
+                    aborted[k] = stopped;
+                });
+                numEvaluated += count;
+                for (long k = 0; k < count; k++) {
+                    std::pair<long, long> key(pending[first + k].i, pending[first + k].j);
+                    if (aborted[k]) {
+                        abandoned[level].insert(key);
+                        numAbandoned++;
+                    }
+                    if (!ok[k]) continue;
+                    evaluated[level][key] = pending[first + k];
+                    candidates.push_back(pending[first + k]);
+                }
+            }
+        };
+
+        std::vector<AlignCandidate> candidates;
+        std::vector<std::pair<long, long> > batch;
+        long spacing = 1L << levels;
+        if (seeded) {
+            // Descend from the seed until the best translation is the center of its evaluated neighborhood.
+            long besti = seedi;
+            long bestj = seedj;
+            while (true) {
+                batch.clear();
+                for (long di = -2; di <= 2; di++) {
+                    for (long dj = -2; dj <= 2; dj++) {
+                        batch.push_back(std::make_pair(besti + di, bestj + dj));
+                    }
+                }
+                evaluate(0, batch, candidates, 1);
+                if (candidates.empty()) break;
+                AlignCandidate best = *std::min_element(candidates.begin(), candidates.end(), lowerRMS);
+                if ((best.i == besti) && (best.j == bestj)) break;
+                besti = best.i;
+                bestj = best.j;
+            }
+        } else {
+            // Evaluate the full window at the coarsest level.
+            for (long i = 0; i < bins; i += spacing) {
+                for (long j = 0; j < bins; j += spacing) {
+                    batch.push_back(std::make_pair(i, j));
+                }
+            }
+            evaluate(levels, batch, candidates, (levels > 0) ? beamWidth : 1);
+        }
+
+        // Refine the best candidates at each finer level.
+        for (int level = levels - 1; level >= 0; level--) {
+            std::sort(candidates.begin(), candidates.end(), lowerRMS);
+            if ((long) candidates.size() > beamWidth) candidates.resize(beamWidth);
+            spacing = 1L << level;
+            batch.clear();
+            for (size_t k = 0; k < candidates.size(); k++) {
+                for (long di = -2; di <= 2; di++) {
+                    for (long dj = -2; dj <= 2; dj++) {
+                        batch.push_back(std::make_pair(candidates[k].i + di * spacing, candidates[k].j + dj * spacing));
+                    }
+                }
+            }
+            std::vector<AlignCandidate> refined;
+            evaluate(level, batch, refined, (level > 0) ? beamWidth : 1);
+            candidates.swap(refined);
+        }
+
+        // Make sure the neighbors of the best translation are evaluated exactly for interpolation.
+        // A neighbor may turn out better than the best, so repeat until the best translation is stable.
         float bestDX = 0.0;
         float bestDY = 0.0;
         float bestDZ = 0.0;
-        long besti = 0;
-        long bestj = 0;
         float bestRMS = MAX_FLOAT;
-        float medianDZ = 0.0;
-        bestRMS = threshold;
         float bestCompleteness = 0.0;
-        long numSampled = 0;
-        for (long i = 0; i < bins; i++) {
-            float dx = -maxt + i * step;
-            for (long j = 0; j < bins; j++) {
-                float dy = -maxt + j * step;
-                rmsArray[i][j] = 0.0;
-                float rms = 0.0;
-                float completeness = 0.0;
-                bool ok = computeRMS(dx, dy, numSamples, maxSamples, xlist, ylist, referenceDSM, targetDSM, medianDZ,
-                                     rms, numSampled, completeness);
-                if (!ok) continue;
-                rmsArray[i][j] = rms;
-                if (rms < bestRMS) {
-                    bestCompleteness = completeness;
-
-                    bestRMS = rms;
-                    bestDX = dx;
-                    bestDY = dy;
-                    bestDZ = medianDZ;
-                    besti = i;
-                    bestj = j;
+        if (!candidates.empty()) {
+            AlignCandidate best = *std::min_element(candidates.begin(), candidates.end(), lowerRMS);
+            while (true) {
+                batch.clear();
+                for (long di = -1; di <= 1; di++) {
+                    for (long dj = -1; dj <= 1; dj++) {
+                        std::pair<long, long> key(best.i + di, best.j + dj);
+                        if (abandoned[0].erase(key)) evaluated[0].erase(key);
+                        batch.push_back(key);
+                    }
                 }
+                evaluate(0, batch, candidates, 0);
+                AlignCandidate next = *std::min_element(candidates.begin(), candidates.end(), lowerRMS);
+                if ((next.i == best.i) && (next.j == best.j)) break;
+                best = next;
             }
-        }
+            bestRMS = best.rms;
+            bestDX = -maxt + best.i * step;
+            bestDY = -maxt + best.j * step;
+            bestDZ = best.dz;
+            bestCompleteness = best.completeness;
 
-        // Apply quadratic interpolation to localize the peak.
-        if ((besti > 0) && (besti < bins - 1) && (bestj > 0) && (bestj < bins - 1)) {
-            float dx = (rmsArray[besti + 1][bestj] - rmsArray[besti - 1][bestj]) / 2.f;
-            float dy = (rmsArray[besti][bestj + 1] - rmsArray[besti][bestj - 1]) / 2.f;
-            float dxx = (rmsArray[besti + 1][bestj] + rmsArray[besti - 1][bestj] - 2 * rmsArray[besti][bestj]);
-            float dyy = (rmsArray[besti][bestj + 1] + rmsArray[besti][bestj - 1] - 2 * rmsArray[besti][bestj]);
-            float dxy =
-                    (rmsArray[besti + 1][bestj + 1] - rmsArray[besti + 1][bestj - 1] - rmsArray[besti - 1][bestj + 1] +
-                     rmsArray[besti - 1][bestj - 1]) / 4.f;
-            float det = dxx * dyy - dxy * dxy;
-            if (det != 0.0) {
-                float ix = besti - (dyy * dx - dxy * dy) / det;
-                float iy = bestj - (dxx * dy - dxy * dx) / det;
-                bestDX = -maxt + ix * step;
-                bestDY = -maxt + iy * step;
+            // Apply quadratic interpolation to localize the peak.
+            // Translations without enough valid samples count as zero, as in the exhaustive search.
+            // If any neighbor was never evaluated, keep the best translation without interpolation.
+            long besti = best.i;
+            long bestj = best.j;
+            float neighbors[3][3];
+            bool complete = (besti > 0) && (besti < bins - 1) && (bestj > 0) && (bestj < bins - 1);
+            for (long di = -1; complete && (di <= 1); di++) {
+                for (long dj = -1; complete && (dj <= 1); dj++) {
+                    auto it = evaluated[0].find(std::make_pair(besti + di, bestj + dj));
+                    if (it == evaluated[0].end()) complete = false;
+                    else neighbors[di + 1][dj + 1] = it->second.rms;
+                }
+            }
+            auto rmsAt = [&](long i, long j) { return neighbors[i - besti + 1][j - bestj + 1]; };
+            if (complete) {
+                float dx = (rmsAt(besti + 1, bestj) - rmsAt(besti - 1, bestj)) / 2.f;
+                float dy = (rmsAt(besti, bestj + 1) - rmsAt(besti, bestj - 1)) / 2.f;
+                float dxx = (rmsAt(besti + 1, bestj) + rmsAt(besti - 1, bestj) - 2 * rmsAt(besti, bestj));
+                float dyy = (rmsAt(besti, bestj + 1) + rmsAt(besti, bestj - 1) - 2 * rmsAt(besti, bestj));
+                float dxy = (rmsAt(besti + 1, bestj + 1) - rmsAt(besti + 1, bestj - 1) -
+                             rmsAt(besti - 1, bestj + 1) + rmsAt(besti - 1, bestj - 1)) / 4.f;
+                float det = dxx * dyy - dxy * dxy;
+                if (det != 0.0) {
+                    float ix = besti - (dyy * dx - dxy * dy) / det;
+                    float iy = bestj - (dxx * dy - dxy * dx) / det;
+                    bestDX = -maxt + ix * step;
+                    bestDY = -maxt + iy * step;
+                }
             }
         }
+        printf("Evaluated %ld of %ld translations with %d pyramid levels on %u threads\n", numEvaluated, bins * bins,
+               levels, numThreads);
+        if (params.earlyAbort) printf("Abandoned %ld translations early\n", numAbandoned);
 
-        // Deallocate RMS array.
-        for (long i = 0; i < bins; i++) delete[]rmsArray[i];
-        delete[]rmsArray;
+        // Deallocate the pyramids.
+        for (int level = 1; level <= levels; level++) {
+            delete referencePyramid[level];
+            delete targetPyramid[level];
+        }
 
         // Update the result and return.
         result.rms = bestRMS;
@@ -171,35 +469,88 @@ namespace align3d {
         printf("Z RMS    = %f m\n", result.rms);
     }
 
-// Align target file to match reference file.
-    bool AlignTarget2Reference(char *referenceFileName, char *targetFileName, AlignParameters params) {
-        // Read the reference LAS file as a DSM.
+    void filterDSM(OrthoImage<unsigned short> &dsm, const AlignParameters &params) {
+        dsm.fillVoidsPyramid(true, 2);
+        dsm.edgeFilter((long) (params.maxdz / dsm.scale));
+    }
+
+    bool prepareDSM(char *fileName, const AlignParameters &params, OrthoImage<unsigned short> &dsm) {
+        ScopedTimer timer("prepareDSM");
+
+        // A prepared DSM depends only on the file contents, GSD, and MAXDZ.
+        RasterCache cache;
+        if (params.cacheDirectory) cache.directory = params.cacheDirectory;
+        std::string description;
+        unsigned long long hash;
+        if (cache.enabled() && RasterCache::hashFile(fileName, hash)) {
+            char text[256];
+            sprintf(text, "align3d-v1;input=%016llx;gsd=%.9g;maxdz=%.9g", hash, params.gsd, params.maxdz);
+            description = text;
+            if (cache.load(description, "dsm", dsm)) {
+                printf("Using cached DSM for %s\n", fileName);
+                return true;
+            }
+        }
+
+        // Read the LAS file as a DSM.
         // Fill small voids.
         // Remove points along edges which are difficult to match.
-        printf("Reading reference point cloud: %s\n", referenceFileName);
-        OrthoImage<unsigned short> referenceDSM;
-        bool ok = referenceDSM.readFromPointCloud(referenceFileName, params.gsd, MAX_VALUE);
+        bool ok = dsm.readFromPointCloud(fileName, params.gsd, MAX_VALUE);
         if (!ok) {
-            printf("Failed to read %s\n", referenceFileName);
+            printf("Failed to read %s\n", fileName);
             return false;
         }
-        referenceDSM.fillVoidsPyramid(true, 2);
-        printf("Filtering reference point cloud.\n");
-        referenceDSM.edgeFilter((long) (params.maxdz / referenceDSM.scale));
+        printf("Filtering point cloud: %s\n", fileName);
+        filterDSM(dsm, params);
+        if (!description.empty()) cache.store(description, "dsm", dsm);
+        return true;
+    }
 
-        // Read the target LAS file as a DSM.
-        // Fill small voids.
-        // Remove points along edges which are difficult to match.
+    bool AlignTarget2Reference(char *referenceFileName, char *targetFileName, AlignParameters params) {
+        ScopedTimer timer("AlignTarget2Reference");
+        printf("Reading reference point cloud: %s\n", referenceFileName);
+        OrthoImage<unsigned short> referenceDSM;
+        if (!prepareDSM(referenceFileName, params, referenceDSM)) return false;
+        return AlignTarget2Reference(referenceDSM, targetFileName, params);
+    }
+
+    bool AlignTargets2Reference(char *referenceFileName, const std::vector<std::string> &targetFileNames,
+                                AlignParameters params, std::vector<char> &status) {
+        ScopedTimer timer("AlignTargets2Reference");
+        long numTargets = (long) targetFileNames.size();
+        status.assign(numTargets, 0);
+        printf("Reading reference point cloud: %s\n", referenceFileName);
+        OrthoImage<unsigned short> referenceDSM;
+        if (!prepareDSM(referenceFileName, params, referenceDSM)) return false;
+        if (numTargets == 0) return true;
+
+        // Every target shares the reference DSM read-only. Run as many targets at once as there are threads,
+        // and give each target's search an equal share of the threads.
+        unsigned int numThreads = resolveThreadCount(params.numThreads);
+        unsigned int numJobs = (unsigned int) MIN((long) numThreads, numTargets);
+        AlignParameters targetParams = params;
+        targetParams.numThreads = MAX(1u, numThreads / numJobs);
+        parallelFor(numTargets, numJobs, [&](long k, unsigned int) {
+            std::vector<char> targetFileName(targetFileNames[k].begin(), targetFileNames[k].end());
+            targetFileName.push_back(0);
+            try {
+                status[k] = AlignTarget2Reference(referenceDSM, &targetFileName[0], targetParams) ? 1 : 0;
+            } catch (std::exception &e) {
+                printf("Error aligning %s: %s\n", targetFileNames[k].c_str(), e.what());
+            } catch (char const *err) {
+                printf("Error aligning %s: %s\n", targetFileNames[k].c_str(), err);
+            }
+        });
+        return std::find(status.begin(), status.end(), 0) == status.end();
+    }
+
+    bool AlignTarget2Reference(OrthoImage<unsigned short> &referenceDSM, char *targetFileName,
+                               AlignParameters params) {
+        ScopedTimer timer("AlignTarget");
         printf("Reading target point cloud: %s\n", targetFileName);
         OrthoImage<unsigned short> targetDSM;
-        ok = targetDSM.readFromPointCloud(targetFileName, params.gsd, MAX_VALUE);
-        if (!ok) {
-            printf("Failed to read %s\n", targetFileName);
-            return false;
-        }
-        targetDSM.fillVoidsPyramid(true, 2);
-        printf("Filtering target point cloud.\n");
-        targetDSM.edgeFilter((long) (params.maxdz / targetDSM.scale));
+        if (!prepareDSM(targetFileName, params, targetDSM)) return false;
+        bool ok;
 
         // Get overlapping bounds.
         AlignBounds bounds;
@@ -218,7 +569,25 @@ namespace align3d {
         // Estimate rigid body transform to align target points to reference.
         AlignResult result;
         printf("Estimating rigid body transformation.\n");
-        EstimateRigidBody(referenceDSM, targetDSM, params.maxt, bounds, result);
+        EstimateRigidBody(referenceDSM, targetDSM, params, bounds, result);
+
+        // Optionally estimate a local correction field to capture drift across the overlap.
+        OrthoImage<float> corrections;
+        bool local = false;
+        if (params.tileSize > 0) {
+            printf("Estimating local corrections.\n");
+            local = EstimateLocalCorrections(referenceDSM, targetDSM, params, bounds, result, corrections);
+            if (!local) printf("Local alignment failed; keeping the global estimate.\n");
+        }
+
+        // Optionally refine the translation to a full rigid transform.
+        AlignTransform transform;
+        bool refined = false;
+        if (params.icp && !local) {
+            printf("Refining with point-to-plane ICP.\n");
+            refined = RefineICP(referenceDSM, targetDSM, params, bounds, result, transform);
+            if (!refined) printf("ICP failed; keeping the translation estimate.\n");
+        }
 
         // Write offsets text file.
         printf("Writing offsets text file.\n");
@@ -230,19 +599,52 @@ namespace align3d {
         if (fptr) {
             fprintf(fptr, "X Offset  Y Offset  Z Offset  Z RMS\n");
             fprintf(fptr, "%08.3f  %08.3f  %08.3f  %08.3f\n", result.tx, result.ty, result.tz, result.rms);
+            if (refined) {
+                fprintf(fptr, "ICP Transform (row-major 4x4)  Scale  RMS\n");
+                for (int i = 0; i < 4; i++) {
+                    fprintf(fptr, "%.12f %.12f %.12f %.6f\n", transform.matrix[i * 4], transform.matrix[i * 4 + 1],
+                            transform.matrix[i * 4 + 2], transform.matrix[i * 4 + 3]);
+                }
+                fprintf(fptr, "%.9f  %08.3f\n", transform.scale, transform.rms);
+            }
+            if (local) {
+                fprintf(fptr, "Local Corrections  Tiles  Tile Size\n");
+                fprintf(fptr, "_corrections.tif  %u x %u  %.3f\n", corrections.width, corrections.height,
+                        corrections.gsd);
+            }
             fclose(fptr);
         } else {
             printf("Failed to write %s\n", outFileName);
             return false;
         }
 
+        // Write the correction field as a GeoTIFF with X, Y, and Z bands.
+        if (local) {
+            printf("Writing local corrections TIF file.\n");
+            sprintf(&outFileName[len - 4], "_corrections.tif");
+            if (!corrections.write(outFileName)) {
+                printf("Failed to write %s\n", outFileName);
+                return false;
+            }
+        }
+
         // Write aligned TIF file.
         printf("Writing aligned TIF file.\n");
         sprintf(&outFileName[len - 4], "_aligned.tif");
-        targetDSM.offset += result.tz;
-        targetDSM.easting += result.tx;
-        targetDSM.northing += result.ty;
-        ok = targetDSM.write(outFileName, true);
+        if (local) {
+            OrthoImage<unsigned short> alignedDSM;
+            CorrectDSM(targetDSM, corrections, alignedDSM);
+            ok = alignedDSM.write(outFileName, true);
+        } else if (refined) {
+            OrthoImage<unsigned short> alignedDSM;
+            TransformDSM(targetDSM, transform, alignedDSM);
+            ok = alignedDSM.write(outFileName, true);
+        } else {
+            targetDSM.offset += result.tz;
+            targetDSM.easting += result.tx;
+            targetDSM.northing += result.ty;
+            ok = targetDSM.write(outFileName, true);
+        }
         if (!ok) {
             printf("Failed to write %s\n", outFileName);
             return false;
@@ -252,10 +654,13 @@ namespace align3d {
         // For now, this requires an extra read of the point cloud file.
         printf("Writing aligned LAS file.\n");
         sprintf(&outFileName[len - 4], "_aligned.las");
-        ok = PointCloud::TransformPointCloud(targetFileName, outFileName, result.tx, result.ty, result.tz);
+        if (local) ok = CorrectPointCloud(corrections, targetFileName, outFileName);
+        else if (refined) ok = PointCloud::TransformPointCloud(targetFileName, outFileName, transform.matrix);
+        else ok = PointCloud::TransformPointCloud(targetFileName, outFileName, result.tx, result.ty, result.tz);
         if (!ok) {
             printf("Failed to write %s\n", outFileName);
             return false;
         }
+        return true;
     }
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #ifndef PUBGEO_ALIGN3D_H
 #define PUBGEO_ALIGN3D_H
 
+#include <string>
 #include <vector>
 #include "orthoimage.h"
 #include "Image.h"
@@ -23,6 +24,15 @@ namespace align3d {
         float gsd;
         float maxdz;
         float maxt;
+        int levels;         // Coarse-to-fine pyramid levels; zero searches exhaustively, negative chooses automatically
+        int beamWidth;      // Candidates refined at each finer pyramid level
+        unsigned int numThreads;    // Threads for the translation search; zero uses all cores
+        bool correlate;     // Seed the search with an FFT cross-correlation of the DSMs
+        bool icp;           // Refine the translation to a full rigid transform with point-to-plane ICP
+        bool icpScale;      // Also estimate uniform scale in ICP
+        bool earlyAbort;    // Abandon translations once their RMS is almost surely worse than those kept
+        const char *cacheDirectory; // Directory for caching prepared DSMs; null disables caching
+        float tileSize;     // Tile size (meters) for a local correction field; zero aligns globally only
     }
             AlignParameters;
 
@@ -36,16 +46,58 @@ namespace align3d {
     }
             AlignBounds;
 
+    // Random samples with valid reference elevations, stored as parallel arrays in their original order.
+    typedef struct {
+        std::vector<double> u;  // Easting relative to the target DSM origin
+        std::vector<double> v;  // Northing relative to the target DSM origin
+        std::vector<float> z;   // Reference elevation
+    }
+            AlignSamples;
+
     bool computeRMS(float dx, float dy, long numSamples, long maxSamples, std::vector<double> &xlist,
                     std::vector<double> &ylist, OrthoImage<unsigned short> &referenceDSM,
                     OrthoImage<unsigned short> &targetDSM, float &medianDZ, float &rms, long &ndx, float &completeness);
 
+    // Same as above, reusing the caller's buffer for the sampled differences.
+    bool computeRMS(float dx, float dy, long numSamples, long maxSamples, std::vector<double> &xlist,
+                    std::vector<double> &ylist, OrthoImage<unsigned short> &referenceDSM,
+                    OrthoImage<unsigned short> &targetDSM, float &medianDZ, float &rms, long &ndx, float &completeness,
+                    std::vector<float> &differences);
+
+    // Keep the first maxSamples points that fall on valid reference pixels and look up their elevations.
+    void prepareSamples(std::vector<double> &xlist, std::vector<double> &ylist, long maxSamples,
+                        OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                        AlignSamples &samples);
+
+    // Compute RMS for prepared samples, so only the target is sampled for each translation.
+    // Here ndx counts prepared samples examined.
+    // If abortRMS is given, evaluation stops early and sets aborted once the RMS is almost surely above it.
+    bool computeRMS(float dx, float dy, long numSamples, const AlignSamples &samples,
+                    OrthoImage<unsigned short> &targetDSM, float &medianDZ, float &rms, long &ndx, float &completeness,
+                    std::vector<float> &differences, float abortRMS = MAX_FLOAT, bool *aborted = nullptr);
+
     // Estimate 3D rigid body transform parameters to align target points with reference.
-    void EstimateRigidBody(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM, float maxt,
-                           AlignBounds &bounds, AlignResult &result);
+    // Translations within params.maxt are searched coarse-to-fine on DSM pyramids as configured by params.
+    void EstimateRigidBody(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                           const AlignParameters &params, AlignBounds &bounds, AlignResult &result);
+
+    // Fill small voids in a DSM and remove points along edges, which are difficult to match.
+    void filterDSM(OrthoImage<unsigned short> &dsm, const AlignParameters &params);
+
+    // Read a point cloud file as a filtered DSM, using the cache in params.cacheDirectory if given.
+    bool prepareDSM(char *fileName, const AlignParameters &params, OrthoImage<unsigned short> &dsm);
+
+    // Align target file to match a prepared reference DSM, which is not modified.
+    bool AlignTarget2Reference(OrthoImage<unsigned short> &referenceDSM, char *targetFileName, AlignParameters params);
 
     // Align target file to match reference file.
     bool AlignTarget2Reference(char *referenceFileName, char *targetFileName, AlignParameters params);
+
+    // Align each target file to match one reference file, which is read and prepared once.
+    // Targets are aligned concurrently, dividing params.numThreads between them. Status is one per target.
+    // Returns false if the reference cannot be read or any target fails.
+    bool AlignTargets2Reference(char *referenceFileName, const std::vector<std::string> &targetFileNames,
+                                AlignParameters params, std::vector<char> &status);
 }
 
 #endif // PUBGEO_ALIGN3D_H
\ No newline at end of file
@@ -0,0 +1,295 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+#include <complex>
+#include <cmath>
+#include "correlation.h"
+#include "WorkQueue.h"
+
+namespace align3d {
+    typedef std::complex<double> Complex;
+
+    // Correlation sums accumulated for every shift, following Padfield's masked normalized cross-correlation.
+    // A is the reference, B the shifted target, and M their masks of valid pixels.
+    enum {
+        SUM_AB, SUM_AMB, SUM_MAB, SUM_AAMB, SUM_MABB, SUM_MAMB, NUM_SUMS
+    };
+
+//
+// Radix-2 FFT of n points, where n is a power of two, with precomputed twiddle factors and bit reversal.
+//
+    class FFTPlan {
+    public:
+        explicit FFTPlan(long n) : n(n), twiddles(n / 2), reversed(n, 0) {
+            const double pi = 3.14159265358979323846;
+            for (long k = 0; k < n / 2; k++) {
+                twiddles[k] = Complex(cos(2.0 * pi * k / n), -sin(2.0 * pi * k / n));
+            }
+            for (long i = 1; i < n; i++) {
+                reversed[i] = (reversed[i >> 1] >> 1) | ((i & 1) ? n >> 1 : 0);
+            }
+        }
+
+        // Transform n points in place. The inverse is not scaled.
+        void transform(Complex *x, bool inverse) const {
+            for (long i = 0; i < n; i++) {
+                if (i < reversed[i]) std::swap(x[i], x[reversed[i]]);
+            }
+            for (long len = 2; len <= n; len <<= 1) {
+                long half = len / 2;
+                long stride = n / len;
+                for (long i = 0; i < n; i += len) {
+                    for (long k = 0; k < half; k++) {
+                        Complex w = inverse ? std::conj(twiddles[k * stride]) : twiddles[k * stride];
+                        Complex u = x[i + k];
+                        Complex v = x[i + k + half] * w;
+                        x[i + k] = u + v;
+                        x[i + k + half] = u - v;
+                    }
+                }
+            }
+        }
+
+        // Transform an n x n row-major image in place, copying columns through a buffer.
+        void transform2D(std::vector<Complex> &image, std::vector<Complex> &column, bool inverse) const {
+            for (long row = 0; row < n; row++) transform(&image[row * n], inverse);
+            column.resize(n);
+            for (long col = 0; col < n; col++) {
+                for (long row = 0; row < n; row++) column[row] = image[row * n + col];
+                transform(&column[0], inverse);
+                for (long row = 0; row < n; row++) image[row * n + col] = column[row];
+            }
+        }
+
+        long n;
+
+    private:
+        std::vector<Complex> twiddles;
+        std::vector<long> reversed;
+    };
+
+    // Look up the elevation nearest a map coordinate. Returns false if it is void or outside the DSM.
+    static bool sampleDSM(OrthoImage<unsigned short> &dsm, double x, double y, float &z) {
+        long col = long(floor((x - dsm.easting) / dsm.gsd + 0.5));
+        long row = (long) dsm.height - 1 - long(floor((y - dsm.northing) / dsm.gsd + 0.5));
+        if ((col < 0) || (row < 0) || (col >= (long) dsm.width) || (row >= (long) dsm.height)) return false;
+        if (dsm.data[row][col] == 0) return false;
+        z = float(dsm.data[row][col]) * dsm.scale + dsm.offset;
+        return true;
+    }
+
+    // Correlate one tile of the overlap grid with the target window around it, adding NUM_SUMS planes of
+    // (2 * radius + 1)^2 shifts to sums. The reference tile is placed radius cells in from the corner of the FFT
+    // image, and the target window fills it from the corner, so no shift within radius wraps around.
+    // Pairs of real images share each forward transform, and pairs of real correlations share each inverse.
+    static void correlateTile(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                              AlignBounds &bounds, float step, long col0, long row0, long cols, long rows,
+                              long radius, float meanA, float meanB, const FFTPlan &plan, std::vector<Complex> *images,
+                              std::vector<Complex> &column, std::vector<double> &sums) {
+        long n = plan.n;
+        long shifts = 2 * radius + 1;
+        sums.assign(NUM_SUMS * shifts * shifts, 0.0);
+        std::vector<Complex> &z1 = images[0];     // A + i MA
+        std::vector<Complex> &z2 = images[1];     // B + i MB
+        std::vector<Complex> &z3 = images[2];     // A^2 + i B^2
+        z1.assign(n * n, Complex(0.0, 0.0));
+        z2.assign(n * n, Complex(0.0, 0.0));
+        z3.assign(n * n, Complex(0.0, 0.0));
+
+        // Fill the reference tile. Skip the tile if it has no valid pixels.
+        long valid = 0;
+        for (long row = 0; row < rows; row++) {
+            double y = bounds.ymax - (row0 + row + 0.5) * step;
+            for (long col = 0; col < cols; col++) {
+                double x = bounds.xmin + (col0 + col + 0.5) * step;
+                float z;
+                if (!sampleDSM(referenceDSM, x, y, z)) continue;
+                double a = z - meanA;
+                long q = (row + radius) * n + (col + radius);
+                z1[q] = Complex(a, 1.0);
+                z3[q] = Complex(a * a, 0.0);
+                valid++;
+            }
+        }
+        if (valid == 0) return;
+
+        // Fill the target window, which extends radius cells beyond the tile on every side.
+        for (long row = 0; row < rows + 2 * radius; row++) {
+            double y = bounds.ymax - (row0 - radius + row + 0.5) * step;
+            for (long col = 0; col < cols + 2 * radius; col++) {
+                double x = bounds.xmin + (col0 - radius + col + 0.5) * step;
+                float z;
+                if (!sampleDSM(targetDSM, x, y, z)) continue;
+                double b = z - meanB;
+                long q = row * n + col;
+                z2[q] = Complex(b, 1.0);
+                z3[q] = Complex(z3[q].real(), b * b);
+            }
+        }
+
+        plan.transform2D(z1, column, false);
+        plan.transform2D(z2, column, false);
+        plan.transform2D(z3, column, false);
+
+        // Separate each packed spectrum into its two real parts and form the correlation spectra conj(X) * Y.
+        // The spectra at k and -k are conjugates, so both are written from one pass over each pair.
+        const Complex half(0.5, 0.0);
+        const Complex halfI(0.0, -0.5);
+        const Complex i(0.0, 1.0);
+        for (long ky = 0; ky < n; ky++) {
+            for (long kx = 0; kx < n; kx++) {
+                long k = ky * n + kx;
+                long kk = ((n - ky) % n) * n + ((n - kx) % n);
+                if (kk < k) continue;
+                Complex y1 = std::conj(z1[kk]);
+                Complex y2 = std::conj(z2[kk]);
+                Complex y3 = std::conj(z3[kk]);
+                Complex fa = (z1[k] + y1) * half;
+                Complex fma = (z1[k] - y1) * halfI;
+                Complex fb = (z2[k] + y2) * half;
+                Complex fmb = (z2[k] - y2) * halfI;
+                Complex faa = (z3[k] + y3) * half;
+                Complex fbb = (z3[k] - y3) * halfI;
+                Complex ab = std::conj(fa) * fb;
+                Complex amb = std::conj(fa) * fmb;
+                Complex mab = std::conj(fma) * fb;
+                Complex aamb = std::conj(faa) * fmb;
+                Complex mabb = std::conj(fma) * fbb;
+                Complex mamb = std::conj(fma) * fmb;
+                z1[kk] = std::conj(ab) + i * std::conj(amb);
+                z2[kk] = std::conj(mab) + i * std::conj(aamb);
+                z3[kk] = std::conj(mabb) + i * std::conj(mamb);
+                z1[k] = ab + i * amb;
+                z2[k] = mab + i * aamb;
+                z3[k] = mabb + i * mamb;
+            }
+        }
+
+        plan.transform2D(z1, column, true);
+        plan.transform2D(z2, column, true);
+        plan.transform2D(z3, column, true);
+
+        // Collect the shifts within radius.
+        double scale = 1.0 / (double(n) * double(n));
+        long planeSize = shifts * shifts;
+        for (long ty = -radius; ty <= radius; ty++) {
+            for (long tx = -radius; tx <= radius; tx++) {
+                long q = ((ty + n) % n) * n + ((tx + n) % n);
+                long s = (ty + radius) * shifts + (tx + radius);
+                sums[SUM_AB * planeSize + s] = z1[q].real() * scale;
+                sums[SUM_AMB * planeSize + s] = z1[q].imag() * scale;
+                sums[SUM_MAB * planeSize + s] = z2[q].real() * scale;
+                sums[SUM_AAMB * planeSize + s] = z2[q].imag() * scale;
+                sums[SUM_MABB * planeSize + s] = z3[q].real() * scale;
+                sums[SUM_MAMB * planeSize + s] = z3[q].imag() * scale;
+            }
+        }
+    }
+
+    bool correlateDSMs(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                       AlignBounds &bounds, float maxt, float step, unsigned int numThreads, float &dx, float &dy,
+                       float &peak) {
+        ScopedTimer timer("correlateDSMs");
+        long radius = long(maxt / step);
+        long shifts = 2 * radius + 1;
+        long planeSize = shifts * shifts;
+        long width = long(bounds.width / step);
+        long height = long(bounds.height / step);
+        if ((width <= 0) || (height <= 0)) return false;
+
+        // Size the FFT so each tile is at least 256 cells or twice the search radius across.
+        long n = 1;
+        while (n < MAX(256L, 2 * radius) + 2 * radius) n <<= 1;
+        long tileSize = n - 2 * radius;
+        FFTPlan plan(n);
+
+        // Find the mean elevations over the overlap so both DSMs can be correlated with zero mean.
+        double sumA = 0.0;
+        double sumB = 0.0;
+        long countA = 0;
+        long countB = 0;
+        for (long row = 0; row < height; row++) {
+            double y = bounds.ymax - (row + 0.5) * step;
+            for (long col = 0; col < width; col++) {
+                double x = bounds.xmin + (col + 0.5) * step;
+                float z;
+                if (sampleDSM(referenceDSM, x, y, z)) {
+                    sumA += z;
+                    countA++;
+                }
+                if (sampleDSM(targetDSM, x, y, z)) {
+                    sumB += z;
+                    countB++;
+                }
+            }
+        }
+        if ((countA == 0) || (countB == 0)) return false;
+        float meanA = float(sumA / countA);
+        float meanB = float(sumB / countB);
+
+        // Correlate tiles in waves of one per thread, adding each wave in tile order so the sums do not depend on
+        // the thread count.
+        long tilesX = (width + tileSize - 1) / tileSize;
+        long tilesY = (height + tileSize - 1) / tileSize;
+        long numTiles = tilesX * tilesY;
+        numThreads = resolveThreadCount(numThreads);
+        std::vector<std::vector<Complex> > images(numThreads * 3);
+        std::vector<std::vector<Complex> > columns(numThreads);
+        std::vector<std::vector<double> > tileSums(numThreads);
+        std::vector<double> sums(NUM_SUMS * planeSize, 0.0);
+        for (long first = 0; first < numTiles; first += numThreads) {
+            long count = MIN((long) numThreads, numTiles - first);
+            parallelFor(count, numThreads, [&](long k, unsigned int thread) {
+                long tile = first + k;
+                long col0 = (tile % tilesX) * tileSize;
+                long row0 = (tile / tilesX) * tileSize;
+                correlateTile(referenceDSM, targetDSM, bounds, step, col0, row0, MIN(tileSize, width - col0),
+                              MIN(tileSize, height - row0), radius, meanA, meanB, plan, &images[thread * 3],
+                              columns[thread], tileSums[k]);
+            });
+            for (long k = 0; k < count; k++) {
+                for (size_t s = 0; s < sums.size(); s++) sums[s] += tileSums[k][s];
+            }
+        }
+
+        // Only consider shifts that overlap at least half as many valid pixels as the best-covered shift.
+        double maxOverlap = 0.0;
+        for (long s = 0; s < planeSize; s++) maxOverlap = MAX(maxOverlap, sums[SUM_MAMB * planeSize + s]);
+        double minOverlap = MAX(0.5 * maxOverlap, 100.0);
+
+        // Find the peak normalized cross-correlation.
+        bool found = false;
+        double best = 0.0;
+        long bestX = 0;
+        long bestY = 0;
+        for (long ty = -radius; ty <= radius; ty++) {
+            for (long tx = -radius; tx <= radius; tx++) {
+                long s = (ty + radius) * shifts + (tx + radius);
+                double overlap = sums[SUM_MAMB * planeSize + s];
+                if (overlap < minOverlap) continue;
+                double sa = sums[SUM_AMB * planeSize + s];
+                double sb = sums[SUM_MAB * planeSize + s];
+                double numerator = sums[SUM_AB * planeSize + s] - sa * sb / overlap;
+                double varianceA = sums[SUM_AAMB * planeSize + s] - sa * sa / overlap;
+                double varianceB = sums[SUM_MABB * planeSize + s] - sb * sb / overlap;
+                if ((varianceA <= 0.0) || (varianceB <= 0.0)) continue;
+                double ncc = numerator / sqrt(varianceA * varianceB);
+                if (!found || (ncc > best)) {
+                    found = true;
+                    best = ncc;
+                    bestX = tx;
+                    bestY = ty;
+                }
+            }
+        }
+        if (!found) return false;
+
+        // Rows run south, so a positive row shift is a negative northing offset.
+        dx = bestX * step;
+        dy = -bestY * step;
+        peak = (float) best;
+        printf("Cross-correlation peak = %f at dx = %f m, dy = %f m (%ld tiles of %ld pixels)\n", peak, dx, dy,
+               numTiles, tileSize);
+        return true;
+    }
+}
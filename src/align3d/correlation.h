@@ -0,0 +1,24 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// correlation.h
+//
+
+#ifndef PUBGEO_ALIGN3D_CORRELATION_H
+#define PUBGEO_ALIGN3D_CORRELATION_H
+
+#include "align3d.h"
+
+namespace align3d {
+    // Estimate the XY translation of the target DSM relative to the reference by void-masked, zero-mean normalized
+    // cross-correlation over the overlap, resampled with the given step. Only shifts within maxt are considered, and
+    // only where at least half as many pixels overlap as at the best-covered shift.
+    // The sign convention matches computeRMS: the target is sampled at (x + dx, y + dy).
+    // The overlap is correlated in tiles on numThreads threads, with a built-in radix-2 FFT.
+    // Returns false if no shift has enough valid overlap.
+    bool correlateDSMs(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                       AlignBounds &bounds, float maxt, float step, unsigned int numThreads, float &dx, float &dy,
+                       float &peak);
+}
+
+#endif // PUBGEO_ALIGN3D_CORRELATION_H
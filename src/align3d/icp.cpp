@@ -0,0 +1,344 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+#include <cmath>
+#include <cstring>
+#include "icp.h"
+#include "KDTree.h"
+#include "WorkQueue.h"
+
+namespace align3d {
+    // Normal equations for up to seven parameters: rotation, translation, and scale.
+    static const int MAX_PARAMS = 7;
+
+    typedef struct {
+        double A[MAX_PARAMS * MAX_PARAMS];
+        double b[MAX_PARAMS];
+        double sumSquares;
+        long count;
+    } NormalEquations;
+
+    // Solve A x = b by Gaussian elimination with partial pivoting. A and b are overwritten.
+    static bool solve(double *A, double *b, int n, double *x) {
+        for (int col = 0; col < n; col++) {
+            int pivot = col;
+            for (int row = col + 1; row < n; row++) {
+                if (fabs(A[row * n + col]) > fabs(A[pivot * n + col])) pivot = row;
+            }
+            if (A[pivot * n + col] == 0.0) return false;
+            if (pivot != col) {
+                for (int k = 0; k < n; k++) std::swap(A[col * n + k], A[pivot * n + k]);
+                std::swap(b[col], b[pivot]);
+            }
+            for (int row = col + 1; row < n; row++) {
+                double f = A[row * n + col] / A[col * n + col];
+                for (int k = col; k < n; k++) A[row * n + k] -= f * A[col * n + k];
+                b[row] -= f * b[col];
+            }
+        }
+        for (int row = n - 1; row >= 0; row--) {
+            double sum = b[row];
+            for (int k = row + 1; k < n; k++) sum -= A[row * n + k] * x[k];
+            x[row] = sum / A[row * n + row];
+        }
+        return true;
+    }
+
+    // Rotation matrix for a rotation vector, by Rodrigues' formula.
+    static void rotation(const double *omega, double *R) {
+        double theta = sqrt(omega[0] * omega[0] + omega[1] * omega[1] + omega[2] * omega[2]);
+        double K[9] = {0, -omega[2], omega[1], omega[2], 0, -omega[0], -omega[1], omega[0], 0};
+        double a = 1.0;
+        double b = 0.5;
+        if (theta > 1e-12) {
+            a = sin(theta) / theta;
+            b = (1.0 - cos(theta)) / (theta * theta);
+        }
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                double KK = 0.0;
+                for (int k = 0; k < 3; k++) KK += K[i * 3 + k] * K[k * 3 + j];
+                R[i * 3 + j] = ((i == j) ? 1.0 : 0.0) + a * K[i * 3 + j] + b * KK;
+            }
+        }
+    }
+
+    bool RefineICP(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                   const AlignParameters &params, AlignBounds &bounds, const AlignResult &initial,
+                   AlignTransform &transform) {
+        ScopedTimer timer("RefineICP");
+        const long maxReferencePoints = 2000000;
+        const long maxTargetPoints = 50000;
+        const int maxIterations = 30;
+        const long blockSize = 1024;
+        int numParams = params.icpScale ? 7 : 6;
+        unsigned int numThreads = resolveThreadCount(params.numThreads);
+
+        // Without a MAXDZ, allow twice the GSD as the CLI does, or three times the coarse RMS if that is larger, so
+        // correspondences are not all rejected.
+        float gsd = MAX(referenceDSM.gsd, targetDSM.gsd);
+        float maxdz = params.maxdz;
+        if (maxdz <= 0.0) {
+            maxdz = 2.0f * gsd;
+            if (initial.rms < MAX_FLOAT) maxdz = MAX(maxdz, 3.0f * initial.rms);
+        }
+        float maxDistance = MAX(2.0f * gsd, maxdz);
+
+        // Work relative to the center of the overlap so coordinates fit in floats.
+        double originX = bounds.xmin + bounds.width / 2.0;
+        double originY = bounds.ymin + bounds.height / 2.0;
+
+        // Find the reference pixels in the overlap, expanded to cover the target after translation.
+        double margin = params.maxt + maxDistance;
+        long col0 = MAX(1L, long((bounds.xmin - margin - referenceDSM.easting) / referenceDSM.gsd));
+        long col1 = MIN((long) referenceDSM.width - 2, long((bounds.xmax + margin - referenceDSM.easting) /
+                                                            referenceDSM.gsd));
+        long row0 = MAX(1L, (long) referenceDSM.height - 1 -
+                            long((bounds.ymax + margin - referenceDSM.northing) / referenceDSM.gsd));
+        long row1 = MIN((long) referenceDSM.height - 2, (long) referenceDSM.height - 1 -
+                                                        long((bounds.ymin - margin - referenceDSM.northing) /
+                                                             referenceDSM.gsd));
+        long numValid = 0;
+        for (long row = row0; row <= row1; row++) {
+            for (long col = col0; col <= col1; col++) {
+                if (referenceDSM.data[row][col] != 0) numValid++;
+            }
+        }
+        long stride = MAX(1L, (long) ceil(sqrt(numValid / (double) maxReferencePoints)));
+
+        // Subsample reference points with all four neighbors valid and within maxdz, and take normals from the DSM
+        // gradient. Points next to discontinuities such as building walls would otherwise get steep normals that
+        // belong to neither surface.
+        long maxStep = long(maxdz / referenceDSM.scale);
+        std::vector<double> referenceZ;
+        std::vector<float> referenceXY;
+        std::vector<float> normals;
+        double sumZ = 0.0;
+        for (long row = row0; row <= row1; row += stride) {
+            for (long col = col0; col <= col1; col += stride) {
+                unsigned short **data = referenceDSM.data;
+                if ((data[row][col] == 0) || (data[row][col - 1] == 0) || (data[row][col + 1] == 0) ||
+                    (data[row - 1][col] == 0) || (data[row + 1][col] == 0))
+                    continue;
+                long center = data[row][col];
+                if ((labs(data[row][col - 1] - center) > maxStep) || (labs(data[row][col + 1] - center) > maxStep) ||
+                    (labs(data[row - 1][col] - center) > maxStep) || (labs(data[row + 1][col] - center) > maxStep))
+                    continue;
+                double z = double(data[row][col]) * referenceDSM.scale + referenceDSM.offset;
+                double dzdx = (double(data[row][col + 1]) - double(data[row][col - 1])) * referenceDSM.scale /
+                              (2.0 * referenceDSM.gsd);
+                double dzdy = (double(data[row - 1][col]) - double(data[row + 1][col])) * referenceDSM.scale /
+                              (2.0 * referenceDSM.gsd);
+                double length = sqrt(dzdx * dzdx + dzdy * dzdy + 1.0);
+                referenceXY.push_back((float) (referenceDSM.easting + col * referenceDSM.gsd - originX));
+                referenceXY.push_back((float) (referenceDSM.northing + (referenceDSM.height - 1 - row) *
+                                                                       referenceDSM.gsd - originY));
+                referenceZ.push_back(z);
+                normals.push_back((float) (-dzdx / length));
+                normals.push_back((float) (-dzdy / length));
+                normals.push_back((float) (1.0 / length));
+                sumZ += z;
+            }
+        }
+        long numReference = (long) referenceZ.size();
+        if (numReference < 100) {
+            printf("Too few reference points for ICP.\n");
+            return false;
+        }
+        double originZ = sumZ / numReference;
+
+        // Build the k-d tree, keeping reference coordinates by index for the residuals.
+        std::vector<float> referenceXYZ(numReference * 3);
+        std::vector<KDTree::Point> treePoints(numReference);
+        for (long i = 0; i < numReference; i++) {
+            referenceXYZ[i * 3] = referenceXY[i * 2];
+            referenceXYZ[i * 3 + 1] = referenceXY[i * 2 + 1];
+            referenceXYZ[i * 3 + 2] = (float) (referenceZ[i] - originZ);
+            for (int k = 0; k < 3; k++) treePoints[i].xyz[k] = referenceXYZ[i * 3 + k];
+            treePoints[i].id = (unsigned int) i;
+        }
+        KDTree tree;
+        tree.build(treePoints);
+
+        // Subsample valid target pixels in the overlap.
+        long tcol0 = MAX(0L, long((bounds.xmin - targetDSM.easting) / targetDSM.gsd));
+        long tcol1 = MIN((long) targetDSM.width - 1, long((bounds.xmax - targetDSM.easting) / targetDSM.gsd));
+        long trow0 = MAX(0L, (long) targetDSM.height - 1 - long((bounds.ymax - targetDSM.northing) / targetDSM.gsd));
+        long trow1 = MIN((long) targetDSM.height - 1,
+                         (long) targetDSM.height - 1 - long((bounds.ymin - targetDSM.northing) / targetDSM.gsd));
+        numValid = 0;
+        for (long row = trow0; row <= trow1; row++) {
+            for (long col = tcol0; col <= tcol1; col++) {
+                if (targetDSM.data[row][col] != 0) numValid++;
+            }
+        }
+        stride = MAX(1L, (long) ceil(sqrt(numValid / (double) maxTargetPoints)));
+        std::vector<double> targetXYZ;
+        for (long row = trow0; row <= trow1; row += stride) {
+            for (long col = tcol0; col <= tcol1; col += stride) {
+                if (targetDSM.data[row][col] == 0) continue;
+                targetXYZ.push_back(targetDSM.easting + col * targetDSM.gsd - originX);
+                targetXYZ.push_back(targetDSM.northing + (targetDSM.height - 1 - row) * targetDSM.gsd - originY);
+                targetXYZ.push_back(double(targetDSM.data[row][col]) * targetDSM.scale + targetDSM.offset - originZ);
+            }
+        }
+        long numTarget = (long) targetXYZ.size() / 3;
+        printf("ICP with %ld reference points and %ld target points\n", numReference, numTarget);
+
+        // Start from the translation estimate. The current transform is p' = S p + t in local coordinates.
+        double S[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+        double t[3] = {initial.tx, initial.ty, initial.tz};
+        long numBlocks = (numTarget + blockSize - 1) / blockSize;
+        std::vector<NormalEquations> blocks(numBlocks);
+        NormalEquations total;
+        bool converged = false;
+        int iteration = 0;
+        for (iteration = 0;; iteration++) {
+            // Match points and accumulate the linearized point-to-plane residuals for a small rotation omega,
+            // translation dt, and scale sigma applied after the current transform:
+            // r + (p x n) . omega + n . dt + (p . n) sigma.
+            parallelFor(numBlocks, numThreads, [&](long block, unsigned int) {
+                NormalEquations &sums = blocks[block];
+                memset(&sums, 0, sizeof(NormalEquations));
+                long end = MIN(numTarget, (block + 1) * blockSize);
+                for (long k = block * blockSize; k < end; k++) {
+                    const double *p0 = &targetXYZ[k * 3];
+                    double p[3];
+                    for (int i = 0; i < 3; i++) {
+                        p[i] = S[i * 3] * p0[0] + S[i * 3 + 1] * p0[1] + S[i * 3 + 2] * p0[2] + t[i];
+                    }
+                    float query[3] = {(float) p[0], (float) p[1], (float) p[2]};
+                    unsigned int id;
+                    float distanceSquared;
+                    if (!tree.nearest(query, maxDistance, id, distanceSquared)) continue;
+                    const float *q = &referenceXYZ[id * 3];
+                    const float *n = &normals[id * 3];
+                    double r = (p[0] - q[0]) * n[0] + (p[1] - q[1]) * n[1] + (p[2] - q[2]) * n[2];
+                    if (fabs(r) > maxdz) continue;
+                    double J[MAX_PARAMS] = {p[1] * n[2] - p[2] * n[1], p[2] * n[0] - p[0] * n[2],
+                                            p[0] * n[1] - p[1] * n[0], n[0], n[1], n[2],
+                                            p[0] * n[0] + p[1] * n[1] + p[2] * n[2]};
+                    for (int i = 0; i < numParams; i++) {
+                        for (int j = 0; j < numParams; j++) sums.A[i * numParams + j] += J[i] * J[j];
+                        sums.b[i] -= J[i] * r;
+                    }
+                    sums.sumSquares += r * r;
+                    sums.count++;
+                }
+            });
+
+            // Add the blocks in order so the result does not depend on the thread count.
+            memset(&total, 0, sizeof(NormalEquations));
+            for (long block = 0; block < numBlocks; block++) {
+                for (int i = 0; i < numParams * numParams; i++) total.A[i] += blocks[block].A[i];
+                for (int i = 0; i < numParams; i++) total.b[i] += blocks[block].b[i];
+                total.sumSquares += blocks[block].sumSquares;
+                total.count += blocks[block].count;
+            }
+            if (total.count < 10 * numParams) {
+                printf("Too few ICP matches (%ld).\n", total.count);
+                return false;
+            }
+            if (converged || (iteration == maxIterations)) break;
+
+            // Damp the system slightly so directions the surface does not constrain, such as horizontal shifts
+            // over flat ground, stay put.
+            double maxDiagonal = 0.0;
+            for (int i = 0; i < numParams; i++) maxDiagonal = MAX(maxDiagonal, total.A[i * numParams + i]);
+            for (int i = 0; i < numParams; i++) total.A[i * numParams + i] += 1e-6 * total.A[i * numParams + i] +
+                                                                              1e-12 * maxDiagonal;
+            double x[MAX_PARAMS] = {0, 0, 0, 0, 0, 0, 0};
+            if (!solve(total.A, total.b, numParams, x)) {
+                printf("ICP normal equations are singular.\n");
+                return false;
+            }
+
+            // Apply the update: S = (1 + sigma) R(omega) S, t = (1 + sigma) R(omega) t + dt.
+            double R[9];
+            rotation(x, R);
+            double factor = 1.0 + ((numParams == 7) ? x[6] : 0.0);
+            double newS[9];
+            double newT[3];
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    newS[i * 3 + j] = 0.0;
+                    for (int k = 0; k < 3; k++) newS[i * 3 + j] += factor * R[i * 3 + k] * S[k * 3 + j];
+                }
+                newT[i] = x[3 + i];
+                for (int k = 0; k < 3; k++) newT[i] += factor * R[i * 3 + k] * t[k];
+            }
+            memcpy(S, newS, sizeof(S));
+            memcpy(t, newT, sizeof(t));
+            double rotationStep = sqrt(x[0] * x[0] + x[1] * x[1] + x[2] * x[2]);
+            double translationStep = sqrt(x[3] * x[3] + x[4] * x[4] + x[5] * x[5]);
+            converged = (rotationStep < 1e-7) && (translationStep < 1e-4) && (fabs(factor - 1.0) < 1e-7);
+        }
+
+        // Express the transform in map coordinates: x' = S x + (o + t - S o).
+        double origin[3] = {originX, originY, originZ};
+        for (int i = 0; i < 3; i++) {
+            double offset = origin[i] + t[i];
+            for (int j = 0; j < 3; j++) {
+                transform.matrix[i * 4 + j] = S[i * 3 + j];
+                offset -= S[i * 3 + j] * origin[j];
+            }
+            transform.matrix[i * 4 + 3] = offset;
+        }
+        transform.matrix[12] = transform.matrix[13] = transform.matrix[14] = 0.0;
+        transform.matrix[15] = 1.0;
+        double det = S[0] * (S[4] * S[8] - S[5] * S[7]) - S[1] * (S[3] * S[8] - S[5] * S[6]) +
+                     S[2] * (S[3] * S[7] - S[4] * S[6]);
+        transform.scale = (float) cbrt(det);
+        transform.rms = (float) sqrt(total.sumSquares / total.count);
+        transform.numMatched = total.count;
+
+        // Report rotation angles about the X, Y, and Z axes.
+        double s = transform.scale;
+        const double degrees = 180.0 / 3.14159265358979323846;
+        printf("ICP %s after %d iterations with %ld matched points\n", converged ? "converged" : "stopped", iteration,
+               total.count);
+        printf("Rotation X, Y, Z = %f, %f, %f degrees\n", atan2(S[7] / s, S[8] / s) * degrees,
+               -asin(MAX(-1.0, MIN(1.0, S[6] / s))) * degrees, atan2(S[3] / s, S[0] / s) * degrees);
+        printf("Translation at overlap center = %f, %f, %f m\n", t[0], t[1], t[2]);
+        printf("Scale = %f\n", transform.scale);
+        printf("Point-to-plane RMS = %f m\n", transform.rms);
+        return true;
+    }
+
+    void TransformDSM(OrthoImage<unsigned short> &dsm, const AlignTransform &transform,
+                      OrthoImage<unsigned short> &aligned) {
+        const double *M = transform.matrix;
+
+        // Move the grid with the center of the DSM.
+        double cx = dsm.easting + dsm.width * dsm.gsd / 2.0;
+        double cy = dsm.northing + dsm.height * dsm.gsd / 2.0;
+        double cz = dsm.offset + dsm.scale * 32768.0;
+        aligned.Allocate(dsm.width, dsm.height);
+        aligned.gsd = dsm.gsd;
+        aligned.zone = dsm.zone;
+        aligned.scale = dsm.scale;
+        aligned.easting = dsm.easting + (M[0] * cx + M[1] * cy + M[2] * cz + M[3] - cx);
+        aligned.northing = dsm.northing + (M[4] * cx + M[5] * cy + M[6] * cz + M[7] - cy);
+        aligned.offset = (float) (dsm.offset + (M[8] * cx + M[9] * cy + M[10] * cz + M[11] - cz));
+
+        for (unsigned int row = 0; row < dsm.height; row++) {
+            double y = dsm.northing + (dsm.height - 1 - row) * dsm.gsd;
+            for (unsigned int col = 0; col < dsm.width; col++) {
+                if (dsm.data[row][col] == 0) continue;
+                double x = dsm.easting + col * dsm.gsd;
+                double z = double(dsm.data[row][col]) * dsm.scale + dsm.offset;
+                double x2 = M[0] * x + M[1] * y + M[2] * z + M[3];
+                double y2 = M[4] * x + M[5] * y + M[6] * z + M[7];
+                double z2 = M[8] * x + M[9] * y + M[10] * z + M[11];
+                long col2 = long(floor((x2 - aligned.easting) / aligned.gsd + 0.5));
+                long row2 = (long) aligned.height - 1 - long(floor((y2 - aligned.northing) / aligned.gsd + 0.5));
+                if ((col2 < 0) || (row2 < 0) || (col2 >= (long) aligned.width) || (row2 >= (long) aligned.height))
+                    continue;
+                double value = (z2 - aligned.offset) / aligned.scale + 0.5;
+                unsigned short quantized = (unsigned short) MAX(1.0, MIN(65535.0, value));
+                aligned.data[row2][col2] = MAX(aligned.data[row2][col2], quantized);
+            }
+        }
+        aligned.fillVoidsPyramid(true, 2);
+    }
+}
@@ -0,0 +1,37 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// icp.h
+//
+
+#ifndef PUBGEO_ALIGN3D_ICP_H
+#define PUBGEO_ALIGN3D_ICP_H
+
+#include "align3d.h"
+
+namespace align3d {
+    typedef struct {
+        double matrix[16];  // Row-major 4x4 transform from target to reference map coordinates
+        float rms;          // RMS point-to-plane distance of the matched points
+        float scale;        // Uniform scale, which is one unless estimated
+        long numMatched;
+    }
+            AlignTransform;
+
+    // Refine an initial translation with point-to-plane ICP between the DSM surfaces, estimating rotation and
+    // translation, and also uniform scale if params.icpScale is set.
+    // Valid reference pixels in the overlap are subsampled into a k-d tree, with normals from the DSM gradient.
+    // A subsample of target pixels is matched to their nearest reference points within max(2 GSD, maxdz), and pairs
+    // farther than maxdz from the reference plane are ignored. If params.maxdz is zero, it defaults to twice the GSD
+    // or three times the RMS of the initial translation, whichever is larger. Returns false if too few points match.
+    bool RefineICP(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                   const AlignParameters &params, AlignBounds &bounds, const AlignResult &initial,
+                   AlignTransform &transform);
+
+    // Resample a DSM through a transform onto a grid of the same size, moved with the DSM center.
+    // Each pixel keeps the highest point mapped into it, and small gaps from rotation or scale are filled.
+    void TransformDSM(OrthoImage<unsigned short> &dsm, const AlignTransform &transform,
+                      OrthoImage<unsigned short> &aligned);
+}
+
+#endif // PUBGEO_ALIGN3D_ICP_H
@@ -0,0 +1,347 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <random>
+#include "local.h"
+#include "WorkQueue.h"
+
+namespace align3d {
+    typedef struct {
+        bool valid;
+        float tx;
+        float ty;
+        float tz;
+        float rms;
+    } TileResult;
+
+    typedef struct {
+        bool ok;
+        float rms;
+        float dz;
+    } TileEvaluation;
+
+    // Zero marks voids in the corrections image, so exact zeros are stored as the smallest positive float.
+    static float nonzero(double value) {
+        return (value == 0.0) ? std::numeric_limits<float>::min() : (float) value;
+    }
+
+    // Median of a list of values, which is reordered.
+    static float median(std::vector<float> &values) {
+        std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+        return values[values.size() / 2];
+    }
+
+    // Search translations for one tile, starting from the global translation. The search descends until the best
+    // translation is the center of its evaluated 5x5 neighborhood, then fits a quadratic to localize the minimum.
+    // Samples are drawn from a generator seeded per tile, so results do not depend on the thread schedule.
+    static void searchTile(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                           const AlignParameters &params, const AlignBounds &tile, unsigned int seed,
+                           const AlignResult &global, TileResult &result) {
+        result.valid = false;
+        float step = MIN(referenceDSM.gsd, targetDSM.gsd);
+        long radius = long(params.maxt / step);
+        float startDX = -global.tx;
+        float startDY = -global.ty;
+
+        // Small tiles use fewer samples, up to the number used for the global search.
+        double pixels = tile.width * tile.height / (step * step);
+        long numSamples = MIN(10000L, MAX(100L, long(pixels / 4)));
+        long maxSamples = numSamples * 10;
+        std::minstd_rand random(seed);
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        std::vector<double> xlist(maxSamples);
+        std::vector<double> ylist(maxSamples);
+        for (long k = 0; k < maxSamples; k++) {
+            xlist[k] = tile.xmin + unit(random) * tile.width;
+            ylist[k] = tile.ymin + unit(random) * tile.height;
+        }
+        AlignSamples samples;
+        prepareSamples(xlist, ylist, maxSamples, referenceDSM, targetDSM, samples);
+        if ((long) samples.z.size() < numSamples) return;
+
+        std::map<std::pair<long, long>, TileEvaluation> evaluated;
+        std::vector<float> differences;
+        auto evaluate = [&](long i, long j) -> const TileEvaluation & {
+            std::pair<long, long> key(i, j);
+            std::map<std::pair<long, long>, TileEvaluation>::iterator found = evaluated.find(key);
+            if (found != evaluated.end()) return found->second;
+            TileEvaluation &evaluation = evaluated[key];
+            long ndx = 0;
+            float completeness = 0.0;
+            evaluation.ok = (labs(i) <= radius) && (labs(j) <= radius) &&
+                            computeRMS(startDX + i * step, startDY + j * step, numSamples, samples, targetDSM,
+                                       evaluation.dz, evaluation.rms, ndx, completeness, differences);
+            return evaluation;
+        };
+
+        // Move only to strictly lower RMS, so the descent cannot cycle.
+        long besti = 0;
+        long bestj = 0;
+        while (true) {
+            const TileEvaluation &center = evaluate(besti, bestj);
+            float bestRMS = center.ok ? center.rms : MAX_FLOAT;
+            long nexti = besti;
+            long nextj = bestj;
+            for (long di = -2; di <= 2; di++) {
+                for (long dj = -2; dj <= 2; dj++) {
+                    const TileEvaluation &neighbor = evaluate(besti + di, bestj + dj);
+                    if (neighbor.ok && (neighbor.rms < bestRMS)) {
+                        bestRMS = neighbor.rms;
+                        nexti = besti + di;
+                        nextj = bestj + dj;
+                    }
+                }
+            }
+            if (bestRMS == MAX_FLOAT) return;
+            if ((nexti == besti) && (nextj == bestj)) break;
+            besti = nexti;
+            bestj = nextj;
+        }
+
+        // Apply quadratic interpolation to localize the minimum if all of its neighbors are valid.
+        const TileEvaluation &best = evaluate(besti, bestj);
+        float ix = (float) besti;
+        float iy = (float) bestj;
+        bool complete = true;
+        float rms[3][3];
+        for (long di = -1; di <= 1; di++) {
+            for (long dj = -1; dj <= 1; dj++) {
+                const TileEvaluation &neighbor = evaluate(besti + di, bestj + dj);
+                complete = complete && neighbor.ok;
+                rms[di + 1][dj + 1] = neighbor.rms;
+            }
+        }
+        if (complete) {
+            float dx = (rms[2][1] - rms[0][1]) / 2.f;
+            float dy = (rms[1][2] - rms[1][0]) / 2.f;
+            float dxx = rms[2][1] + rms[0][1] - 2 * rms[1][1];
+            float dyy = rms[1][2] + rms[1][0] - 2 * rms[1][1];
+            float dxy = (rms[2][2] - rms[2][0] - rms[0][2] + rms[0][0]) / 4.f;
+            float det = dxx * dyy - dxy * dxy;
+            if (det > 0.0) {
+                float offsetX = (dyy * dx - dxy * dy) / det;
+                float offsetY = (dxx * dy - dxy * dx) / det;
+                if ((fabs(offsetX) <= 1.0) && (fabs(offsetY) <= 1.0)) {
+                    ix -= offsetX;
+                    iy -= offsetY;
+                }
+            }
+        }
+        result.valid = true;
+        result.tx = -(startDX + ix * step);
+        result.ty = -(startDY + iy * step);
+        result.tz = best.dz;
+        result.rms = best.rms;
+    }
+
+    bool EstimateLocalCorrections(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                                  const AlignParameters &params, AlignBounds &bounds, const AlignResult &global,
+                                  OrthoImage<float> &corrections) {
+        ScopedTimer timer("EstimateLocalCorrections");
+        float tileSize = params.tileSize;
+        long nx = MAX(1L, long(ceil(bounds.width / tileSize)));
+        long ny = MAX(1L, long(ceil(bounds.height / tileSize)));
+        long numTiles = nx * ny;
+        unsigned int numThreads = resolveThreadCount(params.numThreads);
+
+        // Search each tile on its own thread. Tile j counts rows from the south, like the DSM northing.
+        std::vector<TileResult> tiles(numTiles);
+        parallelFor(numTiles, numThreads, [&](long k, unsigned int) {
+            AlignBounds tile;
+            tile.xmin = bounds.xmin + (k % nx) * tileSize;
+            tile.ymin = bounds.ymin + (k / nx) * tileSize;
+            tile.xmax = MIN(tile.xmin + tileSize, bounds.xmax);
+            tile.ymax = MIN(tile.ymin + tileSize, bounds.ymax);
+            tile.width = tile.xmax - tile.xmin;
+            tile.height = tile.ymax - tile.ymin;
+            searchTile(referenceDSM, targetDSM, params, tile, (unsigned int) k + 1, global, tiles[k]);
+        });
+
+        // Reject tiles with poor matches, which are usually water, change, or too little overlap.
+        std::vector<float> values;
+        for (long k = 0; k < numTiles; k++) {
+            if (tiles[k].valid) values.push_back(tiles[k].rms);
+        }
+        if (values.empty()) {
+            printf("No tiles aligned.\n");
+            return false;
+        }
+        float maxRMS = MAX(3.f * median(values), 0.5f * referenceDSM.gsd);
+        long numAligned = (long) values.size();
+        std::vector<char> valid(numTiles, 0);
+        for (long k = 0; k < numTiles; k++) valid[k] = tiles[k].valid && (tiles[k].rms <= maxRMS);
+
+        // Reject tiles whose offsets disagree with the median of their valid neighbors by more than three robust
+        // standard deviations of all such disagreements. Isolated tiles are compared with the median of all tiles.
+        std::vector<float> field(numTiles * 3, 0.0);
+        for (long k = 0; k < numTiles; k++) {
+            field[k * 3] = tiles[k].tx;
+            field[k * 3 + 1] = tiles[k].ty;
+            field[k * 3 + 2] = tiles[k].tz;
+        }
+        std::vector<float> residuals(numTiles * 3, 0.0);
+        for (int c = 0; c < 3; c++) {
+            std::vector<float> all;
+            for (long k = 0; k < numTiles; k++) {
+                if (valid[k]) all.push_back(field[k * 3 + c]);
+            }
+            float medianAll = median(all);
+            std::vector<float> deviations;
+            for (long k = 0; k < numTiles; k++) {
+                if (!valid[k]) continue;
+                long i = k % nx;
+                long j = k / nx;
+                std::vector<float> neighbors;
+                for (long j2 = MAX(0L, j - 1); j2 <= MIN(ny - 1, j + 1); j2++) {
+                    for (long i2 = MAX(0L, i - 1); i2 <= MIN(nx - 1, i + 1); i2++) {
+                        long k2 = j2 * nx + i2;
+                        if ((k2 != k) && valid[k2]) neighbors.push_back(field[k2 * 3 + c]);
+                    }
+                }
+                float reference = neighbors.empty() ? medianAll : median(neighbors);
+                residuals[k * 3 + c] = fabs(field[k * 3 + c] - reference);
+                deviations.push_back(residuals[k * 3 + c]);
+            }
+            float threshold = MAX(3.f * 1.4826f * median(deviations), 0.5f * referenceDSM.gsd);
+            for (long k = 0; k < numTiles; k++) {
+                if (residuals[k * 3 + c] > threshold) residuals[k * 3 + c] = -1.0;
+            }
+        }
+        long numRejected = numAligned;
+        for (long k = 0; k < numTiles; k++) {
+            if ((residuals[k * 3] < 0) || (residuals[k * 3 + 1] < 0) || (residuals[k * 3 + 2] < 0)) valid[k] = 0;
+            if (valid[k]) numRejected--;
+        }
+        if (numRejected == numAligned) {
+            printf("No tiles are consistent with their neighbors.\n");
+            return false;
+        }
+
+        // Fill rejected tiles from their filled neighbors, growing inward from the valid tiles.
+        std::vector<char> filled(valid);
+        while (std::find(filled.begin(), filled.end(), 0) != filled.end()) {
+            std::vector<float> next(field);
+            std::vector<char> nextFilled(filled);
+            for (long k = 0; k < numTiles; k++) {
+                if (filled[k]) continue;
+                long i = k % nx;
+                long j = k / nx;
+                float sum[3] = {0.0, 0.0, 0.0};
+                long count = 0;
+                for (long j2 = MAX(0L, j - 1); j2 <= MIN(ny - 1, j + 1); j2++) {
+                    for (long i2 = MAX(0L, i - 1); i2 <= MIN(nx - 1, i + 1); i2++) {
+                        long k2 = j2 * nx + i2;
+                        if (!filled[k2]) continue;
+                        for (int c = 0; c < 3; c++) sum[c] += field[k2 * 3 + c];
+                        count++;
+                    }
+                }
+                if (count == 0) continue;
+                for (int c = 0; c < 3; c++) next[k * 3 + c] = sum[c] / count;
+                nextFilled[k] = 1;
+            }
+            field.swap(next);
+            filled.swap(nextFilled);
+        }
+
+        // Smooth with a 3x3 binomial filter, renormalized at the edges.
+        corrections.Allocate((unsigned int) nx, (unsigned int) ny, 3);
+        corrections.easting = bounds.xmin + tileSize / 2.0;
+        corrections.northing = bounds.ymin + tileSize / 2.0;
+        corrections.gsd = tileSize;
+        corrections.zone = targetDSM.zone;
+        corrections.scale = 1.0;
+        corrections.offset = 0.0;
+        for (long j = 0; j < ny; j++) {
+            for (long i = 0; i < nx; i++) {
+                double sum[3] = {0.0, 0.0, 0.0};
+                double weights = 0.0;
+                for (long j2 = MAX(0L, j - 1); j2 <= MIN(ny - 1, j + 1); j2++) {
+                    for (long i2 = MAX(0L, i - 1); i2 <= MIN(nx - 1, i + 1); i2++) {
+                        double weight = ((j2 == j) ? 2.0 : 1.0) * ((i2 == i) ? 2.0 : 1.0);
+                        for (int c = 0; c < 3; c++) sum[c] += weight * field[(j2 * nx + i2) * 3 + c];
+                        weights += weight;
+                    }
+                }
+                for (int c = 0; c < 3; c++) corrections.data[ny - 1 - j][i * 3 + c] = nonzero(sum[c] / weights);
+            }
+        }
+
+        printf("Aligned %ld of %ld tiles of %.1f m; rejected %ld outliers\n", numAligned, numTiles, tileSize,
+               numRejected);
+        return true;
+    }
+
+    void interpolateCorrection(OrthoImage<float> &corrections, double x, double y, double &tx, double &ty,
+                               double &tz) {
+        double fx = (x - corrections.easting) / corrections.gsd;
+        double fy = (y - corrections.northing) / corrections.gsd;
+        fx = MAX(0.0, MIN((double) (corrections.width - 1), fx));
+        fy = MAX(0.0, MIN((double) (corrections.height - 1), fy));
+        long i0 = long(fx);
+        long j0 = long(fy);
+        long i1 = MIN(i0 + 1, (long) corrections.width - 1);
+        long j1 = MIN(j0 + 1, (long) corrections.height - 1);
+        double wx = fx - i0;
+        double wy = fy - j0;
+        const float *south = corrections.data[corrections.height - 1 - j0];
+        const float *north = corrections.data[corrections.height - 1 - j1];
+        double t[3];
+        for (int c = 0; c < 3; c++) {
+            double s = south[i0 * 3 + c] * (1.0 - wx) + south[i1 * 3 + c] * wx;
+            double n = north[i0 * 3 + c] * (1.0 - wx) + north[i1 * 3 + c] * wx;
+            t[c] = s * (1.0 - wy) + n * wy;
+        }
+        tx = t[0];
+        ty = t[1];
+        tz = t[2];
+    }
+
+    void CorrectDSM(OrthoImage<unsigned short> &dsm, OrthoImage<float> &corrections,
+                    OrthoImage<unsigned short> &aligned) {
+        // Move the grid with the center of the DSM.
+        double cx = dsm.easting + dsm.width * dsm.gsd / 2.0;
+        double cy = dsm.northing + dsm.height * dsm.gsd / 2.0;
+        double tx, ty, tz;
+        interpolateCorrection(corrections, cx, cy, tx, ty, tz);
+        aligned.Allocate(dsm.width, dsm.height);
+        aligned.gsd = dsm.gsd;
+        aligned.zone = dsm.zone;
+        aligned.scale = dsm.scale;
+        aligned.easting = dsm.easting + tx;
+        aligned.northing = dsm.northing + ty;
+        aligned.offset = (float) (dsm.offset + tz);
+
+        for (unsigned int row = 0; row < dsm.height; row++) {
+            double y = dsm.northing + (dsm.height - 1 - row) * dsm.gsd;
+            for (unsigned int col = 0; col < dsm.width; col++) {
+                if (dsm.data[row][col] == 0) continue;
+                double x = dsm.easting + col * dsm.gsd;
+                double z = double(dsm.data[row][col]) * dsm.scale + dsm.offset;
+                interpolateCorrection(corrections, x, y, tx, ty, tz);
+                long col2 = long(floor((x + tx - aligned.easting) / aligned.gsd + 0.5));
+                long row2 = (long) aligned.height - 1 - long(floor((y + ty - aligned.northing) / aligned.gsd + 0.5));
+                if ((col2 < 0) || (row2 < 0) || (col2 >= (long) aligned.width) || (row2 >= (long) aligned.height))
+                    continue;
+                double value = (z + tz - aligned.offset) / aligned.scale + 0.5;
+                unsigned short quantized = (unsigned short) MAX(1.0, MIN(65535.0, value));
+                aligned.data[row2][col2] = MAX(aligned.data[row2][col2], quantized);
+            }
+        }
+        aligned.fillVoidsPyramid(true, 2);
+    }
+
+    bool CorrectPointCloud(OrthoImage<float> &corrections, const char *inputFileName, const char *outputFileName) {
+        return PointCloud::TransformPointCloud(inputFileName, outputFileName, [&](double &x, double &y, double &z) {
+            double tx, ty, tz;
+            interpolateCorrection(corrections, x, y, tx, ty, tz);
+            x += tx;
+            y += ty;
+            z += tz;
+        });
+    }
+}
@@ -0,0 +1,36 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// local.h
+//
+
+#ifndef PUBGEO_ALIGN3D_LOCAL_H
+#define PUBGEO_ALIGN3D_LOCAL_H
+
+#include "align3d.h"
+
+namespace align3d {
+    // Estimate a smooth field of XYZ corrections from the target to the reference, for drift that one translation
+    // cannot capture. The overlap is split into tiles of params.tileSize, and each tile searches translations in
+    // parallel, descending from the global result within params.maxt of it. Tiles whose RMS or offsets disagree with
+    // their neighbors are rejected and filled from them, and the field is smoothed.
+    // The corrections image has one pixel per tile, centered on the tile, with bands for X, Y, and Z translations to
+    // add to target points. Returns false if no tile aligns.
+    bool EstimateLocalCorrections(OrthoImage<unsigned short> &referenceDSM, OrthoImage<unsigned short> &targetDSM,
+                                  const AlignParameters &params, AlignBounds &bounds, const AlignResult &global,
+                                  OrthoImage<float> &corrections);
+
+    // Bilinearly interpolate the correction at a point, holding the edge values outside the grid.
+    void interpolateCorrection(OrthoImage<float> &corrections, double x, double y, double &tx, double &ty,
+                               double &tz);
+
+    // Resample a DSM through a correction field onto a grid of the same size, moved with the DSM center.
+    // Each pixel keeps the highest point mapped into it, and small gaps are filled.
+    void CorrectDSM(OrthoImage<unsigned short> &dsm, OrthoImage<float> &corrections,
+                    OrthoImage<unsigned short> &aligned);
+
+    // Write a copy of a point cloud file with the correction field applied, streaming the points.
+    bool CorrectPointCloud(OrthoImage<float> &corrections, const char *inputFileName, const char *outputFileName);
+}
+
+#endif // PUBGEO_ALIGN3D_LOCAL_H
@@ -1,7 +1,9 @@
 // Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
 // Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
 
+#include <chrono>
 #include "align3d.h"
+#include "FileList.h"
 
 void printArguments();
 
@@ -19,17 +21,41 @@ int main(int argc, char **argv) {
 
     // Parse command line parameters.
     char referenceFileName[1024];
-    char targetFileName[1024];
     sprintf(referenceFileName, argv[1]);
-    sprintf(targetFileName, argv[2]);
+    std::vector<std::string> targetFileNames;
+    pubgeo::expandInputs(argv[2], targetFileNames);
+    if (targetFileNames.empty()) {
+        printf("Error: No target files found for %s.\n", argv[2]);
+        return -1;
+    }
     align3d::AlignParameters params;
     params.gsd = 1.0;
     params.maxt = 10.0;
     params.maxdz = 0.0;
+    params.levels = -1;
+    params.beamWidth = 4;
+    params.numThreads = 0;
+    params.correlate = false;
+    params.icp = false;
+    params.icpScale = false;
+    params.earlyAbort = false;
+    params.cacheDirectory = nullptr;
+    params.tileSize = 0.0;
+    const char *profileFileName = nullptr;
     for (int i = 2; i < argc; i++) {
         if (strstr(argv[i], "maxdz=")) { params.maxdz = (float) atof(&(argv[i][6])); }
         if (strstr(argv[i], "gsd=")) { params.gsd = (float) atof(&(argv[i][4])); }
         if (strstr(argv[i], "maxt=")) { params.maxt = (float) atof(&(argv[i][5])); }
+        if (strstr(argv[i], "levels=")) { params.levels = atoi(&(argv[i][7])); }
+        if (strstr(argv[i], "beam=")) { params.beamWidth = atoi(&(argv[i][5])); }
+        if (strstr(argv[i], "threads=")) { params.numThreads = (unsigned int) atoi(&(argv[i][8])); }
+        if (strstr(argv[i], "correlate=")) { params.correlate = (atoi(&(argv[i][10])) != 0); }
+        if (strstr(argv[i], "icp=")) { params.icp = (atoi(&(argv[i][4])) != 0); }
+        if (strstr(argv[i], "scale=")) { params.icpScale = (atoi(&(argv[i][6])) != 0); }
+        if (strstr(argv[i], "abort=")) { params.earlyAbort = (atoi(&(argv[i][6])) != 0); }
+        if (strstr(argv[i], "tile=")) { params.tileSize = (float) atof(&(argv[i][5])); }
+        if (strstr(argv[i], "cache=")) { params.cacheDirectory = &(argv[i][6]); }
+        if (strstr(argv[i], "profile=")) { profileFileName = &(argv[i][8]); }
     }
 
     // Default MAXDZ = GSD x 2 to ensure reliable performance on steep slopes.
@@ -37,25 +63,55 @@ int main(int argc, char **argv) {
 
     printf("Selected Parameters:\n");
     printf("  ref   = %s\n", referenceFileName);
-    printf("  tgt   = %s\n", targetFileName);
+    printf("  tgt   = %s (%ld files)\n", argv[2], (long) targetFileNames.size());
     printf("  gsd   = %f\n", params.gsd);
     printf("  maxdz = %f\n", params.maxdz);
     printf("  maxt  = %f\n", params.maxt);
+    printf("  levels = %d\n", params.levels);
+    printf("  beam  = %d\n", params.beamWidth);
+    printf("  threads = %u\n", params.numThreads);
+    printf("  correlate = %d\n", params.correlate ? 1 : 0);
+    printf("  icp   = %d\n", params.icp ? 1 : 0);
+    printf("  scale = %d\n", params.icpScale ? 1 : 0);
+    printf("  abort = %d\n", params.earlyAbort ? 1 : 0);
+    printf("  tile  = %f\n", params.tileSize);
+    printf("  cache = %s\n", params.cacheDirectory ? params.cacheDirectory : "");
 
-    // Initialize the timer.
-    time_t t0;
-    time(&t0);
+    // Initialize the timer and, if requested, the profiler.
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    if (profileFileName) {
+        pubgeo::Profiler::enable();
+        pubgeo::Profiler::begin("align3d");
+    }
 
+    // Align the target point clouds to the reference, which is prepared once and shared.
+    std::vector<char> status;
     try {
-        // Align the target point cloud to the reference.
-        AlignTarget2Reference(referenceFileName, targetFileName, params);
+        AlignTargets2Reference(referenceFileName, targetFileNames, params, status);
     } catch (char const *err) {
         std::cerr << "Reporting error: " << err << std::endl;
     }
-    // Report total elapsed time.
-    time_t t1;
-    time(&t1);
-    printf("Total time elapsed = %f seconds\n", double(t1 - t0));
+
+    // Report the status of each target.
+    long numTargets = (long) targetFileNames.size();
+    if ((numTargets > 1) && ((long) status.size() == numTargets)) {
+        long numFailed = 0;
+        printf("Batch status:\n");
+        for (long k = 0; k < numTargets; k++) {
+            if (!status[k]) numFailed++;
+            printf("  %-6s %s\n", status[k] ? "OK" : "FAILED", targetFileNames[k].c_str());
+        }
+        printf("Aligned %ld targets, %ld failed.\n", numTargets, numFailed);
+    }
+    // Report total elapsed time and, if requested, the time and memory used by each stage.
+    if (profileFileName) pubgeo::Profiler::end();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    printf("Total time elapsed = %f seconds\n", seconds);
+    if (profileFileName) {
+        pubgeo::Profiler::printSummary();
+        if (pubgeo::Profiler::writeJSON(profileFileName)) printf("Wrote profile %s\n", profileFileName);
+        else printf("Error: Failed to write %s\n", profileFileName);
+    }
 
     return 0;
 }
@@ -63,10 +119,23 @@ int main(int argc, char **argv) {
 // Print command line arguments.
 void printArguments() {
     printf("Command Line: align-3d <reference> <target> <parameters>\n");
+    printf("  The target may also be a glob pattern in quotes or a .txt file listing one target per line.\n");
+    printf("  Targets are aligned concurrently against one shared reference DSM.\n");
     printf("Parameters:\n");
     printf("  maxdz= Max local Z difference (meters) for matching\n");
     printf("  gsd=   Ground Sample Distance (GSD) for gridding (meters)\n");
     printf("  maxt=	 Maximum XYZ translation in search (meters); default = 10.0\n");
+    printf("  levels= Pyramid levels for coarse-to-fine search; 0 = exhaustive; default = automatic\n");
+    printf("  beam=  Candidates refined at each pyramid level; default = 4\n");
+    printf("  threads= Threads for the translation search; default = 0 = all cores\n");
+    printf("  correlate= 1 to seed the search with an FFT cross-correlation; default = 0\n");
+    printf("  icp=   1 to refine to a full rigid transform with point-to-plane ICP; default = 0\n");
+    printf("  scale= 1 to also estimate uniform scale in ICP; default = 0\n");
+    printf("  abort= 1 to abandon translations early once they are almost surely worse; default = 0\n");
+    printf("  tile=  Tile size (meters) for a local XYZ correction field; default = 0 = global only\n");
+    printf("  cache= Directory for caching prepared DSMs across runs; default = none\n");
+    printf("  profile= Write stage timing and memory use to this JSON file\n");
     printf("Examples:\n");
-    printf("  align-3d ref.las tgt.las maxt=10.0 gsd=0.5 maxdz=0.5 \n\n");
+    printf("  align-3d ref.las tgt.las maxt=10.0 gsd=0.5 maxdz=0.5 \n");
+    printf("  align-3d ref.las \"tiles/*.las\" maxt=10.0 gsd=0.5 threads=8 cache=cache\n\n");
 }
\ No newline at end of file
@@ -24,8 +24,12 @@
 // FOSS4G, 2017.
 
 #include <algorithm>
+#include <iomanip>
+#include <sstream>
 
 #include "align3d.h"
+#include "icp.h"
+#include "local.h"
 #include "orthoimage.h"
 #include "plugin.hpp"
 
@@ -50,6 +54,22 @@ void Align3dFilter::addArgs(ProgramArgs& args)
     args.add("gsd", "Ground Sample Distance (GSD) for gridding", m_gsd, 1.0);
     args.add("maxt", "Maximum XYZ translation in search", m_maxt, 10.0);
     args.add("maxdz", "Max local Z difference for matching", m_maxdz, 0.0);
+    args.add("levels", "Pyramid levels for coarse-to-fine search (0 = exhaustive, -1 = automatic)", m_levels, -1);
+    args.add("beam", "Candidates refined at each pyramid level", m_beamWidth, 4);
+    args.add("threads", "Threads for the translation search (0 = all cores)", m_threads, 0u);
+    args.add("correlate", "Seed the search with an FFT cross-correlation", m_correlate, false);
+    args.add("icp", "Refine to a full rigid transform with point-to-plane ICP", m_icp, false);
+    args.add("icp_scale", "Also estimate uniform scale in ICP", m_icpScale, false);
+    args.add("early_abort", "Abandon translations once they are almost surely worse", m_earlyAbort, false);
+    args.add("tile_size", "Tile size for a local correction field (0 = global only)", m_tileSize, 0.0);
+}
+
+void Align3dFilter::ready(PointTableRef table)
+{
+    // The first view of each execution is the reference, so forget the
+    // reference from any previous execution.
+    m_fixed.reset();
+    m_referenceDSM.reset();
 }
 
 PointViewSet Align3dFilter::run(PointViewPtr view)
@@ -69,18 +89,37 @@ PointViewSet Align3dFilter::run(PointViewPtr view)
     if (m_maxdz == 0.0)
         m_maxdz = m_gsd * 2.0;
 
+    align3d::AlignParameters params;
+    params.gsd = (float) m_gsd;
+    params.maxdz = (float) m_maxdz;
+    params.maxt = (float) m_maxt;
+    params.levels = m_levels;
+    params.beamWidth = m_beamWidth;
+    params.numThreads = m_threads;
+    params.correlate = m_correlate;
+    params.icp = m_icp;
+    params.icpScale = m_icpScale;
+    params.earlyAbort = m_earlyAbort;
+    params.cacheDirectory = nullptr;
+    params.tileSize = (float) m_tileSize;
+
     // Align the target point cloud to the reference.
-    // AlignTarget2Reference(referenceFileName, targetFileName, params);
-    // Read the reference LAS file as a DSM.
+    // Read the reference point cloud as a DSM once, then share it read-only
+    // with every later target view.
     // Fill small voids.
     // Remove points along edges which are difficult to match.
-    log()->get(LogLevel::Debug) << "Reading reference point cloud\n";
-    pubgeo::OrthoImage<unsigned short> referenceDSM;
-    if (!referenceDSM.readFromPointView(m_fixed, m_gsd, pubgeo::MAX_VALUE))
-        throw pdal_error("Error reading reference PointView\n");
-    referenceDSM.fillVoidsPyramid(true, 2);
-    log()->get(LogLevel::Debug) << "Filtering reference point cloud.\n";
-    referenceDSM.edgeFilter((long)(m_maxdz / referenceDSM.scale));
+    if (!m_referenceDSM)
+    {
+        log()->get(LogLevel::Debug) << "Reading reference point cloud\n";
+        std::shared_ptr<pubgeo::OrthoImage<unsigned short>> dsm(
+            new pubgeo::OrthoImage<unsigned short>());
+        if (!dsm->readFromPointView(m_fixed, m_gsd, pubgeo::MAX_VALUE))
+            throw pdal_error("Error reading reference PointView\n");
+        log()->get(LogLevel::Debug) << "Filtering reference point cloud.\n";
+        align3d::filterDSM(*dsm, params);
+        m_referenceDSM = dsm;
+    }
+    pubgeo::OrthoImage<unsigned short>& referenceDSM = *m_referenceDSM;
 
     // Read the target LAS file as a DSM.
     // Fill small voids.
@@ -89,9 +128,8 @@ PointViewSet Align3dFilter::run(PointViewPtr view)
     pubgeo::OrthoImage<unsigned short> targetDSM;
     if (!targetDSM.readFromPointView(view, m_gsd, pubgeo::MAX_VALUE))
         throw pdal_error("Error reading target PointView\n");
-    targetDSM.fillVoidsPyramid(true, 2);
     log()->get(LogLevel::Debug) << "Filtering target point cloud.\n";
-    targetDSM.edgeFilter((long)(m_maxdz / targetDSM.scale));
+    align3d::filterDSM(targetDSM, params);
 
     // Get overlapping bounds.
     align3d::AlignBounds bounds;
@@ -115,16 +153,58 @@ PointViewSet Align3dFilter::run(PointViewPtr view)
     // Estimate rigid body transform to align target points to reference.
     align3d::AlignResult result;
     log()->get(LogLevel::Debug) << "Estimating rigid body transformation.\n";
-    EstimateRigidBody(referenceDSM, targetDSM, m_maxt, bounds, result);
+    EstimateRigidBody(referenceDSM, targetDSM, params, bounds, result);
+
+    // Optionally estimate a local correction field.
+    pubgeo::OrthoImage<float> corrections;
+    bool local = false;
+    if (m_tileSize > 0)
+    {
+        log()->get(LogLevel::Debug) << "Estimating local corrections.\n";
+        local = align3d::EstimateLocalCorrections(referenceDSM, targetDSM, params,
+                                                  bounds, result, corrections);
+        if (!local)
+            log()->get(LogLevel::Warning)
+                << "Local alignment failed; keeping the global estimate.\n";
+    }
+
+    // Optionally refine the translation to a full rigid transform.
+    align3d::AlignTransform transform;
+    double matrix[16] = {1, 0, 0, result.tx, 0, 1, 0, result.ty,
+                         0, 0, 1, result.tz, 0, 0, 0, 1};
+    bool refined = false;
+    if (m_icp && !local)
+    {
+        log()->get(LogLevel::Debug) << "Refining with point-to-plane ICP.\n";
+        refined = align3d::RefineICP(referenceDSM, targetDSM, params, bounds,
+                                     result, transform);
+        if (refined)
+            std::copy(transform.matrix, transform.matrix + 16, matrix);
+        else
+            log()->get(LogLevel::Warning)
+                << "ICP failed; keeping the translation estimate.\n";
+    }
 
     for (PointId i = 0; i < view->size(); ++i)
     {
         double x = view->getFieldAs<double>(Dimension::Id::X, i);
         double y = view->getFieldAs<double>(Dimension::Id::Y, i);
         double z = view->getFieldAs<double>(Dimension::Id::Z, i);
-        view->setField(Dimension::Id::X, i, x + result.tx);
-        view->setField(Dimension::Id::Y, i, y + result.ty);
-        view->setField(Dimension::Id::Z, i, z + result.tz);
+        if (local)
+        {
+            double tx, ty, tz;
+            align3d::interpolateCorrection(corrections, x, y, tx, ty, tz);
+            view->setField(Dimension::Id::X, i, x + tx);
+            view->setField(Dimension::Id::Y, i, y + ty);
+            view->setField(Dimension::Id::Z, i, z + tz);
+            continue;
+        }
+        view->setField(Dimension::Id::X, i,
+                       matrix[0] * x + matrix[1] * y + matrix[2] * z + matrix[3]);
+        view->setField(Dimension::Id::Y, i,
+                       matrix[4] * x + matrix[5] * y + matrix[6] * z + matrix[7]);
+        view->setField(Dimension::Id::Z, i,
+                       matrix[8] * x + matrix[9] * y + matrix[10] * z + matrix[11]);
     }
     viewSet.insert(view);
 
@@ -133,6 +213,22 @@ PointViewSet Align3dFilter::run(PointViewPtr view)
     root.add("y_offset", result.ty);
     root.add("z_offset", result.tz);
     root.add("z_rms", result.rms);
+    if (refined)
+    {
+        std::ostringstream text;
+        text << std::setprecision(17);
+        for (int i = 0; i < 16; i++)
+            text << matrix[i] << ((i < 15) ? " " : "");
+        root.add("transform", text.str());
+        root.add("scale", transform.scale);
+        root.add("icp_rms", transform.rms);
+    }
+    if (local)
+    {
+        root.add("tile_size", m_tileSize);
+        root.add("tiles_x", corrections.width);
+        root.add("tiles_y", corrections.height);
+    }
 
     return viewSet;
 }
@@ -26,12 +26,18 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <string>
 
 #include <pdal/Filter.hpp>
 #include <pdal/pdal_export.hpp>
 #include <pdal/util/ProgramArgs.hpp>
 
+namespace pubgeo
+{
+template <class TYPE> class OrthoImage;
+}
+
 namespace pdal
 {
 
@@ -48,12 +54,23 @@ public:
 
 private:
     virtual void addArgs(ProgramArgs& args);
+    virtual void ready(PointTableRef table);
     virtual PointViewSet run(PointViewPtr view);
 
     double m_gsd;
     double m_maxt;
     double m_maxdz;
+    int m_levels;
+    int m_beamWidth;
+    unsigned int m_threads;
+    bool m_correlate;
+    bool m_icp;
+    bool m_icpScale;
+    bool m_earlyAbort;
+    double m_tileSize;
     PointViewPtr m_fixed;
+    // Prepared once from the first view and shared by every later view.
+    std::shared_ptr<pubgeo::OrthoImage<unsigned short>> m_referenceDSM;
 
     Align3dFilter& operator=(const Align3dFilter&) = delete;
     Align3dFilter(const Align3dFilter&) = delete;
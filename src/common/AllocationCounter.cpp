@@ -0,0 +1,48 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// AllocationCounter.cpp
+//
+// Replace the global operator new to count heap allocations for the Profiler.
+// This is linked into executables only. Shared libraries such as the PDAL plugins should not replace operator new.
+//
+
+#include <stdlib.h>
+#include <new>
+#include "Profiler.h"
+
+void *operator new(size_t size) {
+    pubgeo::Profiler::countAllocation(size);
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    pubgeo::Profiler::countAllocation(size);
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    free(p);
+}
@@ -0,0 +1,119 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// BitImage.h
+//
+
+#ifndef PUBGEO_BIT_IMAGE_H
+#define PUBGEO_BIT_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace pubgeo {
+//
+// Binary image with each row packed 64 pixels to a word.
+// Morphology operates on whole words with shifts and ANDs/ORs of neighboring rows.
+//
+    class BitImage {
+
+    public:
+
+        unsigned int width;
+        unsigned int height;
+        unsigned int words;    // Words per row.
+        std::vector<uint64_t> bits;
+
+        BitImage() : width(0), height(0), words(0) {}
+
+        // Allocate memory with all pixels cleared.
+        void Allocate(unsigned int numColumns, unsigned int numRows) {
+            width = numColumns;
+            height = numRows;
+            words = (width + 63) / 64;
+            bits.assign((size_t) words * height, 0);
+        }
+
+        uint64_t *row(unsigned int j) {
+            return &bits[(size_t) j * words];
+        }
+
+        bool get(unsigned int i, unsigned int j) const {
+            return ((bits[(size_t) j * words + i / 64] >> (i % 64)) & 1) != 0;
+        }
+
+        void set(unsigned int i, unsigned int j) {
+            bits[(size_t) j * words + i / 64] |= (uint64_t) 1 << (i % 64);
+        }
+
+        // Erode with a square structuring element of size (2 * rad + 1).
+        // Pixels outside the image are treated as set, so the image border does not erode.
+        void erode(unsigned int rad) {
+            morph(rad, true);
+        }
+
+        // Dilate with a square structuring element of size (2 * rad + 1).
+        void dilate(unsigned int rad) {
+            morph(rad, false);
+        }
+
+    private:
+
+        // Get the word of a row shifted so that bit b holds pixel (w * 64 + b + s).
+        // Bits from outside the row are set to the fill value.
+        uint64_t shifted(const uint64_t *src, long w, long s, uint64_t fill) const {
+            long index = w * 64 + s;
+            long q = (index >= 0) ? index / 64 : -((63 - index) / 64);
+            int r = (int) (index - q * 64);
+            uint64_t lo = ((q >= 0) && (q < (long) words)) ? src[q] : fill;
+            if (r == 0) return lo;
+            uint64_t hi = ((q + 1 >= 0) && (q + 1 < (long) words)) ? src[q + 1] : fill;
+            return (lo >> r) | (hi << (64 - r));
+        }
+
+        // Apply a separable square erosion or dilation, first along rows and then along columns.
+        void morph(unsigned int rad, bool erode) {
+            if ((rad == 0) || (words == 0) || (height == 0)) return;
+            uint64_t fill = erode ? ~(uint64_t) 0 : 0;
+            uint64_t lastMask = (width % 64) ? (((uint64_t) 1 << (width % 64)) - 1) : ~(uint64_t) 0;
+            std::vector<uint64_t> temp(bits.size());
+
+            // Horizontal pass. Padding bits past the width take the fill value while shifting.
+            for (unsigned int j = 0; j < height; j++) {
+                uint64_t *src = row(j);
+                uint64_t *dst = &temp[(size_t) j * words];
+                src[words - 1] = (src[words - 1] & lastMask) | (fill & ~lastMask);
+                for (long w = 0; w < (long) words; w++) {
+                    uint64_t value = src[w];
+                    for (long s = 1; s <= (long) rad; s++) {
+                        uint64_t left = shifted(src, w, -s, fill);
+                        uint64_t right = shifted(src, w, s, fill);
+                        if (erode) value &= left & right;
+                        else value |= left | right;
+                    }
+                    dst[w] = value;
+                }
+                src[words - 1] &= lastMask;
+                dst[words - 1] &= lastMask;
+            }
+
+            // Vertical pass, clamped to the image bounds.
+            for (unsigned int j = 0; j < height; j++) {
+                unsigned int j1 = (j > rad) ? j - rad : 0;
+                unsigned int j2 = (j + rad < height) ? j + rad : height - 1;
+                uint64_t *dst = row(j);
+                for (unsigned int w = 0; w < words; w++) {
+                    uint64_t value = temp[(size_t) j1 * words + w];
+                    for (unsigned int jj = j1 + 1; jj <= j2; jj++) {
+                        if (erode) value &= temp[(size_t) jj * words + w];
+                        else value |= temp[(size_t) jj * words + w];
+                    }
+                    dst[w] = value;
+                }
+            }
+        }
+    };
+}
+
+#endif //PUBGEO_BIT_IMAGE_H
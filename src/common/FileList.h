@@ -0,0 +1,45 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// FileList.h
+//
+
+#ifndef PUBGEO_FILE_LIST_H
+#define PUBGEO_FILE_LIST_H
+
+#include <string.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#ifndef WIN32
+#include <glob.h>
+#endif
+
+namespace pubgeo {
+    // Expand an input argument into a list of files.
+    // A .txt file lists one input per line. Otherwise, expand it as a glob pattern where supported.
+    inline void expandInputs(const char *input, std::vector<std::string> &files) {
+        size_t len = strlen(input);
+        if ((len > 4) && (strcmp(&input[len - 4], ".txt") == 0)) {
+            std::ifstream list(input);
+            std::string line;
+            while (std::getline(list, line)) {
+                while (!line.empty() && ((line.back() == '\r') || (line.back() == ' '))) line.pop_back();
+                if (!line.empty()) files.push_back(line);
+            }
+            return;
+        }
+#ifndef WIN32
+        glob_t matches;
+        if (glob(input, 0, nullptr, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; i++) files.push_back(matches.gl_pathv[i]);
+            globfree(&matches);
+            return;
+        }
+        globfree(&matches);
+#endif
+        files.push_back(input);
+    }
+}
+
+#endif // PUBGEO_FILE_LIST_H
@@ -0,0 +1,110 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// KDTree.h
+//
+
+#ifndef PUBGEO_KD_TREE_H
+#define PUBGEO_KD_TREE_H
+
+#include <algorithm>
+#include <vector>
+
+namespace pubgeo {
+//
+// Static 3D k-d tree for nearest neighbor queries.
+// The tree is implicit: points are reordered in one array so the median of each index range is the node splitting
+// it, and the split axis is kept in a parallel array. Queries walk contiguous memory without child pointers, and
+// small ranges are scanned linearly. Coordinates are floats, so points should be relative to a nearby origin.
+//
+    class KDTree {
+    public:
+        struct Point {
+            float xyz[3];
+            unsigned int id;    // Caller's index for the point
+        };
+
+        // Build the tree, taking ownership of the points.
+        void build(std::vector<Point> &input) {
+            points.swap(input);
+            input.clear();
+            axes.assign(points.size(), 0);
+            buildRange(0, (long) points.size());
+        }
+
+        size_t size() const { return points.size(); }
+
+        // Find the nearest point within maxDistance of the query. Returns false if there is none.
+        bool nearest(const float query[3], float maxDistance, unsigned int &id, float &distanceSquared) const {
+            long best = -1;
+            distanceSquared = maxDistance * maxDistance;
+            searchRange(0, (long) points.size(), query, best, distanceSquared);
+            if (best < 0) return false;
+            id = points[best].id;
+            return true;
+        }
+
+    private:
+        static const long LEAF_SIZE = 8;
+
+        std::vector<Point> points;
+        std::vector<unsigned char> axes;
+
+        void buildRange(long lo, long hi) {
+            if (hi - lo <= LEAF_SIZE) return;
+
+            // Split on the axis with the largest extent.
+            float minXYZ[3] = {points[lo].xyz[0], points[lo].xyz[1], points[lo].xyz[2]};
+            float maxXYZ[3] = {minXYZ[0], minXYZ[1], minXYZ[2]};
+            for (long i = lo + 1; i < hi; i++) {
+                for (int k = 0; k < 3; k++) {
+                    minXYZ[k] = std::min(minXYZ[k], points[i].xyz[k]);
+                    maxXYZ[k] = std::max(maxXYZ[k], points[i].xyz[k]);
+                }
+            }
+            int axis = 0;
+            for (int k = 1; k < 3; k++) {
+                if (maxXYZ[k] - minXYZ[k] > maxXYZ[axis] - minXYZ[axis]) axis = k;
+            }
+
+            long mid = (lo + hi) / 2;
+            std::nth_element(points.begin() + lo, points.begin() + mid, points.begin() + hi,
+                             [axis](const Point &a, const Point &b) { return a.xyz[axis] < b.xyz[axis]; });
+            axes[mid] = (unsigned char) axis;
+            buildRange(lo, mid);
+            buildRange(mid + 1, hi);
+        }
+
+        void check(long i, const float query[3], long &best, float &bestDistanceSquared) const {
+            float dx = points[i].xyz[0] - query[0];
+            float dy = points[i].xyz[1] - query[1];
+            float dz = points[i].xyz[2] - query[2];
+            float d = dx * dx + dy * dy + dz * dz;
+            if (d < bestDistanceSquared) {
+                bestDistanceSquared = d;
+                best = i;
+            }
+        }
+
+        void searchRange(long lo, long hi, const float query[3], long &best, float &bestDistanceSquared) const {
+            if (hi - lo <= LEAF_SIZE) {
+                for (long i = lo; i < hi; i++) check(i, query, best, bestDistanceSquared);
+                return;
+            }
+            long mid = (lo + hi) / 2;
+            check(mid, query, best, bestDistanceSquared);
+
+            // Search the side containing the query first, then the other side only if it could be closer.
+            float diff = query[axes[mid]] - points[mid].xyz[axes[mid]];
+            if (diff < 0) {
+                searchRange(lo, mid, query, best, bestDistanceSquared);
+                if (diff * diff < bestDistanceSquared) searchRange(mid + 1, hi, query, best, bestDistanceSquared);
+            } else {
+                searchRange(mid + 1, hi, query, best, bestDistanceSquared);
+                if (diff * diff < bestDistanceSquared) searchRange(lo, mid, query, best, bestDistanceSquared);
+            }
+        }
+    };
+}
+
+#endif // PUBGEO_KD_TREE_H
@@ -0,0 +1,176 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// MinMaxGrid.h
+//
+
+#ifndef PUBGEO_MIN_MAX_GRID_H
+#define PUBGEO_MIN_MAX_GRID_H
+
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "PointCloud.h"
+
+namespace pubgeo {
+//
+// Sparse grid of minimum and maximum Z values, filled one point at a time.
+// This allows rasterizing a point stream without knowing its bounds in advance.
+// Cells are aligned to multiples of the GSD and stored in square tiles allocated on demand.
+// Each tile quantizes Z to 16 bits with its own offset and step, so a cell takes four bytes, and a spurious return
+// or steep terrain only coarsens the step of the tiles it falls in. Tiles start with the grid's step, centered on
+// their first point. A value outside a tile's range moves its offset by whole steps, or doubles its step once the
+// tile's relief no longer fits in 16 bits. Values are within one step of their tile's final step.
+//
+    class MinMaxGrid {
+
+    public:
+
+        static const int TILE_BITS = 8;
+        static const long TILE_SIZE = 1 << TILE_BITS;
+        static const long MAX_CODE = 65535;     // Codes start at one. Zero marks an empty cell.
+
+        struct Tile {
+            double offset;                      // Z of code zero
+            double step;                        // Meters per code
+            unsigned short low;                 // Smallest and largest codes in use
+            unsigned short high;
+            std::vector<unsigned short> zmin;
+            std::vector<unsigned short> zmax;
+
+            bool empty(long k) const {
+                return zmin[k] == 0;
+            }
+
+            double minValue(long k) const {
+                return offset + zmin[k] * step;
+            }
+
+            double maxValue(long k) const {
+                return offset + zmax[k] * step;
+            }
+        };
+
+        float gsd;
+        double step;         // Initial step of each tile (meters)
+        MinMaxXYZ bounds;    // Bounds of all points added.
+        long xCellMin;
+        long xCellMax;
+        long yCellMin;
+        long yCellMax;
+        unsigned long numPoints;
+        std::map<std::pair<long, long>, Tile> tiles;
+
+        explicit MinMaxGrid(float gsdMeters, double stepMeters = 0.001)
+                : gsd(gsdMeters), step(stepMeters), xCellMin(0), xCellMax(0), yCellMin(0), yCellMax(0),
+                  numPoints(0), lastTile(nullptr), lastKey(0, 0) {
+            bounds = MinMaxXYZ{0, 0, 0, 0, 0, 0};
+        }
+
+        // Add a point to the grid.
+        void add(double x, double y, double z) {
+            long cx = (long) floor(x / gsd + 0.5);
+            long cy = (long) floor(y / gsd + 0.5);
+            if (numPoints == 0) {
+                bounds = MinMaxXYZ{x, x, y, y, z, z};
+                xCellMin = xCellMax = cx;
+                yCellMin = yCellMax = cy;
+            } else {
+                bounds.xMin = std::min(bounds.xMin, x);
+                bounds.xMax = std::max(bounds.xMax, x);
+                bounds.yMin = std::min(bounds.yMin, y);
+                bounds.yMax = std::max(bounds.yMax, y);
+                bounds.zMin = std::min(bounds.zMin, z);
+                bounds.zMax = std::max(bounds.zMax, z);
+                xCellMin = std::min(xCellMin, cx);
+                xCellMax = std::max(xCellMax, cx);
+                yCellMin = std::min(yCellMin, cy);
+                yCellMax = std::max(yCellMax, cy);
+            }
+            numPoints++;
+
+            // Points usually arrive with spatial coherence, so check the last tile first.
+            std::pair<long, long> key(cx >> TILE_BITS, cy >> TILE_BITS);
+            if ((lastTile == nullptr) || (key != lastKey)) {
+                lastTile = &tiles[key];
+                lastKey = key;
+                if (lastTile->zmin.empty()) {
+                    lastTile->zmin.assign(TILE_SIZE * TILE_SIZE, 0);
+                    lastTile->zmax.assign(TILE_SIZE * TILE_SIZE, 0);
+                    lastTile->step = step;
+                    lastTile->offset = centeredOffset(z, step);
+                    lastTile->low = (unsigned short) MAX_CODE;
+                    lastTile->high = 0;
+                }
+            }
+            Tile &tile = *lastTile;
+            double q = floor((z - tile.offset) / tile.step + 0.5);
+            if ((q < 1) || (q > MAX_CODE)) {
+                fitTile(tile, z);
+                q = floor((z - tile.offset) / tile.step + 0.5);
+            }
+            unsigned short code = (unsigned short) q;
+            long k = (cy & (TILE_SIZE - 1)) * TILE_SIZE + (cx & (TILE_SIZE - 1));
+            if ((tile.zmin[k] == 0) || (code < tile.zmin[k])) tile.zmin[k] = code;
+            if (code > tile.zmax[k]) tile.zmax[k] = code;
+            tile.low = std::min(tile.low, code);
+            tile.high = std::max(tile.high, code);
+        }
+
+        bool empty() const {
+            return numPoints == 0;
+        }
+
+        // Release all memory.
+        void clear() {
+            tiles.clear();
+            lastTile = nullptr;
+            numPoints = 0;
+        }
+
+    private:
+
+        Tile *lastTile;
+        std::pair<long, long> lastKey;
+
+        // Get an offset that is a whole number of steps and puts Z in the middle of the 16-bit range.
+        static double centeredOffset(double z, double step) {
+            return (floor(z / step + 0.5) - (MAX_CODE + 1) / 2) * step;
+        }
+
+        // Change a tile's offset, and its step if needed, so its range covers z as well as its current values.
+        // Existing codes are converted to the new offset and step.
+        void fitTile(Tile &tile, double z) {
+            double zLow = z;
+            double zHigh = z;
+            if (tile.low <= tile.high) {
+                zLow = std::min(zLow, tile.offset + tile.low * tile.step);
+                zHigh = std::max(zHigh, tile.offset + tile.high * tile.step);
+            }
+            double newStep = tile.step;
+            while (zHigh - zLow > (MAX_CODE - 4) * newStep) newStep *= 2.0;
+            double newOffset = centeredOffset((zLow + zHigh) / 2.0, newStep);
+            tile.low = (unsigned short) MAX_CODE;
+            tile.high = 0;
+            for (long k = 0; k < TILE_SIZE * TILE_SIZE; k++) {
+                if (tile.zmin[k] == 0) continue;
+                tile.zmin[k] = requantize(tile.minValue(k), newOffset, newStep);
+                tile.zmax[k] = requantize(tile.maxValue(k), newOffset, newStep);
+                tile.low = std::min(tile.low, tile.zmin[k]);
+                tile.high = std::max(tile.high, tile.zmax[k]);
+            }
+            tile.offset = newOffset;
+            tile.step = newStep;
+        }
+
+        static unsigned short requantize(double z, double offset, double step) {
+            double q = floor((z - offset) / step + 0.5);
+            return (unsigned short) std::max(1.0, std::min((double) MAX_CODE, q));
+        }
+    };
+}
+
+#endif //PUBGEO_MIN_MAX_GRID_H
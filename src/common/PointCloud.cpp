@@ -1,7 +1,18 @@
 // Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
 // Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
 
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cctype>
+#include <iomanip>
+#include <pdal/Filter.hpp>
+#include <pdal/Options.hpp>
+#include <pdal/PointTable.hpp>
+#include <pdal/StageFactory.hpp>
+#include <pdal/Streamable.hpp>
 #include "PointCloud.h"
+#include "Profiler.h"
 
 // Pipeline needs to read in point cloud file of any type, and read it in. ideally in meters
 static std::string PDAL_PIPELINE_OPEN_ENGINE = R"({ "pipeline": [ ")";
@@ -11,6 +22,130 @@ std::string buildPipelineStr(const char *fileName) {
     return PDAL_PIPELINE_OPEN_ENGINE + fileName + PDAL_PIPELINE_OPEN_CABOOSE;
 }
 
+// Streamable stage that hands each point to a callback and keeps nothing.
+class PointCallbackFilter : public pdal::Filter, public pdal::Streamable {
+public:
+    explicit PointCallbackFilter(const std::function<void(double, double, double)> &pointCallback)
+            : callback(pointCallback) {}
+
+    std::string getName() const override { return "filters.pubgeocallback"; }
+
+private:
+    const std::function<void(double, double, double)> &callback;
+
+    bool processOne(pdal::PointRef &point) override {
+        callback(point.getFieldAs<double>(pdal::Dimension::Id::X),
+                 point.getFieldAs<double>(pdal::Dimension::Id::Y),
+                 point.getFieldAs<double>(pdal::Dimension::Id::Z));
+        return true;
+    }
+};
+
+// Streamable stage that hands the coordinates of each point to a callback that may change them.
+class PointTransformFilter : public pdal::Filter, public pdal::Streamable {
+public:
+    explicit PointTransformFilter(const std::function<void(double &, double &, double &)> &pointTransform)
+            : transform(pointTransform) {}
+
+    std::string getName() const override { return "filters.pubgeotransform"; }
+
+private:
+    const std::function<void(double &, double &, double &)> &transform;
+
+    bool processOne(pdal::PointRef &point) override {
+        double x = point.getFieldAs<double>(pdal::Dimension::Id::X);
+        double y = point.getFieldAs<double>(pdal::Dimension::Id::Y);
+        double z = point.getFieldAs<double>(pdal::Dimension::Id::Z);
+        transform(x, y, z);
+        point.setField(pdal::Dimension::Id::X, x);
+        point.setField(pdal::Dimension::Id::Y, y);
+        point.setField(pdal::Dimension::Id::Z, z);
+        return true;
+    }
+};
+
+// Create a reader for a file, inferring the driver from its extension.
+static pdal::Stage *createReader(pdal::StageFactory &factory, const char *fileName) {
+    std::string driver = pdal::StageFactory::inferReaderDriver(fileName);
+    pdal::Stage *reader = driver.empty() ? nullptr : factory.createStage(driver);
+    if (reader == nullptr) {
+        std::cerr << "[PUBGEO::PointCloud] No reader found for " << fileName << std::endl;
+        return nullptr;
+    }
+    pdal::Options options;
+    options.add("filename", std::string(fileName));
+    reader->setOptions(options);
+    return reader;
+}
+
+// Byte offsets of fields in the LAS public header block, which are the same in LAS 1.0 through 1.4.
+static const size_t LAS_HEADER_SIZE = 94;   // Header size as an unsigned short
+static const size_t LAS_OFFSETS = 155;      // X, Y, and Z offsets as doubles
+static const size_t LAS_BOUNDS = 179;       // Max X, Min X, Max Y, Min Y, Max Z, and Min Z as doubles
+static const size_t LAS_MIN_HEADER_SIZE = 227;
+
+// Get the lower case extension of a file name.
+static std::string extension(const char *fileName) {
+    const char *dot = strrchr(fileName, '.');
+    std::string ext = dot ? dot + 1 : "";
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext;
+}
+
+// Copy a LAS or LAZ file with a translation applied by shifting the offsets and bounds in its header.
+// Point records store coordinates as integers relative to the header offsets, so they are copied byte for byte,
+// and compressed LAZ records are never decoded. Returns false without writing unless the input is a LAS or LAZ
+// file and the output has the same extension.
+static bool translateLAS(const char *inputFileName, const char *outputFileName, double tx, double ty, double tz) {
+    std::string type = extension(inputFileName);
+    if (((type != "las") && (type != "laz")) || (extension(outputFileName) != type)) return false;
+    FILE *input = fopen(inputFileName, "rb");
+    if (!input) return false;
+    std::vector<char> buffer(1 << 22);
+    size_t numBytes = fread(&buffer[0], 1, buffer.size(), input);
+    unsigned short headerSize = 0;
+    if (numBytes >= LAS_MIN_HEADER_SIZE) memcpy(&headerSize, &buffer[LAS_HEADER_SIZE], sizeof(headerSize));
+    if ((headerSize < LAS_MIN_HEADER_SIZE) || (memcmp(&buffer[0], "LASF", 4) != 0)) {
+        fclose(input);
+        return false;
+    }
+    pubgeo::ScopedTimer timer("translateLAS");
+
+    // Shift the offsets and the bounds.
+    double offsets[3];
+    double bounds[6];
+    memcpy(offsets, &buffer[LAS_OFFSETS], sizeof(offsets));
+    memcpy(bounds, &buffer[LAS_BOUNDS], sizeof(bounds));
+    offsets[0] += tx;
+    offsets[1] += ty;
+    offsets[2] += tz;
+    bounds[0] += tx;
+    bounds[1] += tx;
+    bounds[2] += ty;
+    bounds[3] += ty;
+    bounds[4] += tz;
+    bounds[5] += tz;
+    memcpy(&buffer[LAS_OFFSETS], offsets, sizeof(offsets));
+    memcpy(&buffer[LAS_BOUNDS], bounds, sizeof(bounds));
+
+    // Copy everything else unchanged.
+    FILE *output = fopen(outputFileName, "wb");
+    if (!output) {
+        fclose(input);
+        return false;
+    }
+    bool ok = true;
+    while (ok && (numBytes > 0)) {
+        ok = (fwrite(&buffer[0], 1, numBytes, output) == numBytes);
+        numBytes = fread(&buffer[0], 1, buffer.size(), input);
+    }
+    ok = ok && !ferror(input);
+    fclose(input);
+    if (fclose(output) != 0) ok = false;
+    if (!ok) remove(outputFileName);
+    return ok;
+}
+
 namespace pubgeo {
     PointCloud::PointCloud() : executor(nullptr), pv(nullptr), zone(0), xOff(0), yOff(0), zOff(0), numPoints(0) {
         bounds = MinMaxXYZ{0, 0, 0, 0, 0, 0};
@@ -80,14 +215,22 @@ namespace pubgeo {
 
     bool PointCloud::TransformPointCloud(const char *inputFileName, const char *outputFileName,
                                          float translateX = 0, float translateY = 0, float translateZ = 0) {
+        // A translation only changes the header of a LAS or LAZ file, so points need not be read or rewritten.
+        if (translateLAS(inputFileName, outputFileName, translateX, translateY, translateZ)) return true;
+        double matrix[16] = {1, 0, 0, translateX, 0, 1, 0, translateY, 0, 0, 1, translateZ, 0, 0, 0, 1};
+        return TransformPointCloud(inputFileName, outputFileName, matrix);
+    }
+
+    bool PointCloud::TransformPointCloud(const char *inputFileName, const char *outputFileName,
+                                         const double *matrix) {
+        ScopedTimer timer("transformPointCloud");
         std::ostringstream pipeline;
         pipeline << "{\n\t\"pipeline\":[\n\t\t\"" << inputFileName
                  << "\",\n\t\t{\n\t\t\t\"type\":\"filters.transformation\",\n"
-                 << "\t\t\t\"matrix\":\""
-                 << "1 0 0 " << translateX << " "
-                 << "0 1 0 " << translateY << " "
-                 << "0 0 1 " << translateZ << " "
-                 << "0 0 0 1\"\n\t\t},\n\t\t{"
+                 << "\t\t\t\"matrix\":\"";
+        pipeline << std::setprecision(17);
+        for (int i = 0; i < 16; i++) pipeline << matrix[i] << ((i < 15) ? " " : "");
+        pipeline << "\"\n\t\t},\n\t\t{"
                  << "\n\t\t\t\"filename\":\"" << outputFileName << "\"\n\t\t}\n\t]\n}";
         try {
             const std::string pipe = pipeline.str();
@@ -100,6 +243,75 @@ namespace pubgeo {
         return true;
     }
 
+    bool PointCloud::TransformPointCloud(const char *inputFileName, const char *outputFileName,
+                                         const std::function<void(double &, double &, double &)> &transform) {
+        ScopedTimer timer("transformPointCloud");
+        try {
+            pdal::StageFactory factory;
+            pdal::Stage *reader = createReader(factory, inputFileName);
+            if (reader == nullptr) return false;
+            std::string driver = pdal::StageFactory::inferWriterDriver(outputFileName);
+            pdal::Stage *writer = driver.empty() ? nullptr : factory.createStage(driver);
+            if (writer == nullptr) {
+                std::cerr << "[PUBGEO::PointCloud] No writer found for " << outputFileName << std::endl;
+                return false;
+            }
+            pdal::Options options;
+            options.add("filename", std::string(outputFileName));
+            writer->setOptions(options);
+            PointTransformFilter filter(transform);
+            filter.setInput(*reader);
+            writer->setInput(filter);
+            pdal::FixedPointTable table(10000);
+            writer->prepare(table);
+            writer->execute(table);
+            return true;
+        }
+        catch (pdal::pdal_error &pe) {
+            std::cerr << pe.what() << std::endl;
+            return false;
+        }
+    }
+
+    bool PointCloud::ReadBounds(const char *fileName, MinMaxXYZ &fileBounds, int &fileZone) {
+        try {
+            pdal::StageFactory factory;
+            pdal::Stage *reader = createReader(factory, fileName);
+            if (reader == nullptr) return false;
+            pdal::QuickInfo info = reader->preview();
+            if (!info.valid() || (info.m_pointCount < 1)) {
+                std::cerr << "[PUBGEO::PointCloud::ReadBounds] No header information found in file." << std::endl;
+                return false;
+            }
+            fileBounds = {info.m_bounds.minx, info.m_bounds.maxx, info.m_bounds.miny, info.m_bounds.maxy,
+                          info.m_bounds.minz, info.m_bounds.maxz};
+            fileZone = info.m_srs.computeUTMZone(info.m_bounds);
+            return true;
+        }
+        catch (pdal::pdal_error &pe) {
+            std::cerr << pe.what() << std::endl;
+            return false;
+        }
+    }
+
+    bool PointCloud::StreamPoints(const char *fileName, const std::function<void(double, double, double)> &callback) {
+        try {
+            pdal::StageFactory factory;
+            pdal::Stage *reader = createReader(factory, fileName);
+            if (reader == nullptr) return false;
+            PointCallbackFilter filter(callback);
+            filter.setInput(*reader);
+            pdal::FixedPointTable table(10000);
+            filter.prepare(table);
+            filter.execute(table);
+            return true;
+        }
+        catch (pdal::pdal_error &pe) {
+            std::cerr << pe.what() << std::endl;
+            return false;
+        }
+    }
+
     void PointCloud::CleanupPdalPointers() {
         if (pv != nullptr) {
             pv = nullptr;
@@ -9,6 +9,7 @@
 #ifndef PUBGEO_NOT_POINT_SETS_H
 #define PUBGEO_NOT_POINT_SETS_H
 
+#include <functional>
 #include <pdal/PointView.hpp>
 #include <pdal/PipelineExecutor.hpp>
 
@@ -29,9 +30,27 @@ namespace pubgeo {
 
         ~PointCloud();
 
+        // Write a copy of a point cloud file with a translation applied to every point.
+        // LAS and LAZ files written with the same extension are copied with only the header offsets and bounds
+        // shifted, which is exact and takes only I/O time. Other files are rewritten through PDAL.
         static bool TransformPointCloud(const char *inputFileName, const char *outputFileName,
                                         float translateX, float translateY, float translateZ);
 
+        // Write a copy of a point cloud file with a row-major 4x4 transform applied to every point.
+        static bool TransformPointCloud(const char *inputFileName, const char *outputFileName, const double *matrix);
+
+        // Write a copy of a point cloud file with a callback applied to the coordinates of every point.
+        // Points are streamed, so the reader and writer for the file types must support PDAL stream mode.
+        static bool TransformPointCloud(const char *inputFileName, const char *outputFileName,
+                                        const std::function<void(double &, double &, double &)> &transform);
+
+        // Get the bounds and UTM zone of a point cloud file from its header, without reading the points.
+        static bool ReadBounds(const char *fileName, MinMaxXYZ &fileBounds, int &fileZone);
+
+        // Pass each point in a file to a callback, holding only a small buffer of points in memory at a time.
+        // The reader for the file type must support PDAL stream mode (e.g., LAS and BPF).
+        static bool StreamPoints(const char *fileName, const std::function<void(double, double, double)> &callback);
+
         bool Read(const char *fileName);
         bool Read(pdal::PointViewPtr view);
 
@@ -0,0 +1,273 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// Profiler.cpp
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "Profiler.h"
+
+namespace pubgeo {
+    // Constant initialized, so allocations made before main() are safe to count.
+    static std::atomic<bool> enabled(false);
+    static std::atomic<unsigned long long> numAllocations(0);
+    static std::atomic<unsigned long long> numAllocatedBytes(0);
+    static std::atomic<long> maxPeakRssKB(0);     // Peak RSS kept across resets of the process peak
+
+    // A stage in progress on this thread.
+    // An attached stage is running on another thread and only names the parent of stages begun here.
+    typedef struct {
+        size_t index;
+        int depth;
+        bool attached;
+        std::chrono::steady_clock::time_point start;
+        unsigned long long allocations;
+        unsigned long long allocatedBytes;
+        long peakRssKB;
+    } ActiveStage;
+
+    // Stages recorded by all threads.
+    typedef struct {
+        std::mutex mutex;
+        std::vector<Profiler::Stage> stages;
+        std::map<std::string, size_t> index;
+        std::thread::id mainThread;
+    } StageRegistry;
+
+    static StageRegistry &registry() {
+        static StageRegistry stageRegistry;
+        return stageRegistry;
+    }
+
+    static thread_local std::vector<ActiveStage> activeStages;
+
+    // Read a value in kB from /proc/self/status.
+    static long readStatusKB(const char *key) {
+#ifdef __linux__
+        FILE *fp = fopen("/proc/self/status", "r");
+        if (fp == nullptr) return 0;
+        char line[256];
+        long value = 0;
+        size_t len = strlen(key);
+        while (fgets(line, sizeof(line), fp)) {
+            if (strncmp(line, key, len) == 0) {
+                value = atol(&line[len]);
+                break;
+            }
+        }
+        fclose(fp);
+        return value;
+#else
+        return 0;
+#endif
+    }
+
+    // Reset the peak RSS of this process so the next peak belongs to the stage starting now.
+    static void resetPeakRss() {
+#ifdef __linux__
+        FILE *fp = fopen("/proc/self/clear_refs", "w");
+        if (fp == nullptr) return;
+        fputs("5", fp);
+        fclose(fp);
+#endif
+    }
+
+    // Read the process peak RSS since the last reset, and keep the overall peak.
+    static long samplePeakRss() {
+        long peak = readStatusKB("VmHWM:");
+        long previous = maxPeakRssKB.load();
+        while ((peak > previous) && !maxPeakRssKB.compare_exchange_weak(previous, peak)) {}
+        return peak;
+    }
+
+    void Profiler::enable() {
+        registry().mainThread = std::this_thread::get_id();
+        enabled = true;
+    }
+
+    bool Profiler::isEnabled() {
+        return enabled;
+    }
+
+    long Profiler::currentRssKB() {
+        return readStatusKB("VmRSS:");
+    }
+
+    long Profiler::peakRssKB() {
+        samplePeakRss();
+        return maxPeakRssKB;
+    }
+
+    void Profiler::countAllocation(size_t bytes) {
+        numAllocations.fetch_add(1, std::memory_order_relaxed);
+        numAllocatedBytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    unsigned long long Profiler::allocationCount() {
+        return numAllocations.load(std::memory_order_relaxed);
+    }
+
+    unsigned long long Profiler::allocatedBytes() {
+        return numAllocatedBytes.load(std::memory_order_relaxed);
+    }
+
+    void Profiler::begin(const char *name) {
+        if (!enabled) return;
+        StageRegistry &reg = registry();
+
+        // Only the main thread resets the peak, so worker threads never hide each other's peaks.
+        // Fold the peak so far into the enclosing stage before resetting it.
+        bool mainThread = (std::this_thread::get_id() == reg.mainThread);
+        int depth = activeStages.empty() ? 0 : activeStages.back().depth + 1;
+        bool sampleMemory = (depth < MEMORY_DEPTH);
+        long peak = 0;
+        if (sampleMemory) {
+            peak = samplePeakRss();
+            if (!activeStages.empty()) activeStages.back().peakRssKB = std::max(activeStages.back().peakRssKB, peak);
+            if (mainThread) resetPeakRss();
+        }
+
+        ActiveStage stage;
+        {
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            std::string path = activeStages.empty() ? std::string(name) :
+                               reg.stages[activeStages.back().index].path + "/" + name;
+            std::map<std::string, size_t>::iterator it = reg.index.find(path);
+            if (it == reg.index.end()) {
+                Profiler::Stage newStage = {path, depth, 0, 0.0, 0, 0, 0, 0};
+                it = reg.index.insert(std::make_pair(path, reg.stages.size())).first;
+                reg.stages.push_back(newStage);
+            }
+            stage.index = it->second;
+        }
+        stage.depth = depth;
+        stage.attached = false;
+        stage.peakRssKB = (sampleMemory && mainThread) ? currentRssKB() : peak;
+        stage.allocations = allocationCount();
+        stage.allocatedBytes = allocatedBytes();
+        stage.start = std::chrono::steady_clock::now();
+        activeStages.push_back(stage);
+    }
+
+    void Profiler::end() {
+        if (!enabled || activeStages.empty() || activeStages.back().attached) return;
+        ActiveStage stage = activeStages.back();
+        activeStages.pop_back();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stage.start).count();
+        long peak = 0;
+        long rss = 0;
+        if (stage.depth < MEMORY_DEPTH) {
+            peak = std::max(stage.peakRssKB, samplePeakRss());
+            rss = currentRssKB();
+            if (!activeStages.empty()) activeStages.back().peakRssKB = std::max(activeStages.back().peakRssKB, peak);
+        }
+        unsigned long long allocations = allocationCount() - stage.allocations;
+        unsigned long long bytes = allocatedBytes() - stage.allocatedBytes;
+
+        StageRegistry &reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        Profiler::Stage &s = reg.stages[stage.index];
+        s.calls++;
+        s.seconds += seconds;
+        s.peakRssKB = std::max(s.peakRssKB, peak);
+        s.endRssKB = rss;
+        s.allocations += allocations;
+        s.allocatedBytes += bytes;
+    }
+
+    long Profiler::currentStage() {
+        if (!enabled || activeStages.empty()) return -1;
+        return (long) activeStages.back().index;
+    }
+
+    void Profiler::attach(long stage) {
+        if (!enabled || (stage < 0)) return;
+        StageRegistry &reg = registry();
+        ActiveStage parent;
+        {
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            parent.depth = reg.stages[stage].depth;
+        }
+        parent.index = (size_t) stage;
+        parent.attached = true;
+        parent.start = std::chrono::steady_clock::now();
+        parent.allocations = 0;
+        parent.allocatedBytes = 0;
+        parent.peakRssKB = 0;
+        activeStages.push_back(parent);
+    }
+
+    void Profiler::detach() {
+        if (!activeStages.empty() && activeStages.back().attached) activeStages.pop_back();
+    }
+
+    std::vector<Profiler::Stage> Profiler::stages() {
+        StageRegistry &reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        return reg.stages;
+    }
+
+    void Profiler::printSummary() {
+        std::vector<Stage> all = stages();
+        if (all.empty()) return;
+        printf("%-48s %8s %12s %12s %14s\n", "Stage", "Calls", "Seconds", "Peak RSS MB", "Allocations");
+        for (size_t k = 0; k < all.size(); k++) {
+            std::string name = std::string(2 * all[k].depth, ' ') + all[k].path.substr(all[k].path.rfind('/') + 1);
+            if (all[k].depth < MEMORY_DEPTH) {
+                printf("%-48s %8lu %12.3f %12.1f %14llu\n", name.c_str(), all[k].calls, all[k].seconds,
+                       all[k].peakRssKB / 1024.0, all[k].allocations);
+            } else {
+                printf("%-48s %8lu %12.3f %12s %14llu\n", name.c_str(), all[k].calls, all[k].seconds, "-",
+                       all[k].allocations);
+            }
+        }
+    }
+
+    // Escape a string for JSON.
+    static std::string escapeJSON(const std::string &text) {
+        std::string escaped;
+        for (size_t k = 0; k < text.size(); k++) {
+            char c = text[k];
+            if ((c == '"') || (c == '\\')) escaped += '\\';
+            if ((unsigned char) c < 0x20) continue;
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    bool Profiler::writeJSON(const char *fileName) {
+        std::vector<Stage> all = stages();
+        std::ofstream json(fileName);
+        if (!json) return false;
+        char line[1024];
+        json << "{\n";
+        sprintf(line, "  \"peakRssKB\": %ld,\n", peakRssKB());
+        json << line;
+        sprintf(line, "  \"allocations\": %llu,\n", allocationCount());
+        json << line;
+        sprintf(line, "  \"allocatedBytes\": %llu,\n", allocatedBytes());
+        json << line;
+        json << "  \"stages\": [\n";
+        for (size_t k = 0; k < all.size(); k++) {
+            json << "    {\"path\": \"" << escapeJSON(all[k].path) << "\", ";
+            sprintf(line, "\"depth\": %d, \"calls\": %lu, \"seconds\": %.6f, \"peakRssKB\": %ld, \"endRssKB\": %ld, "
+                          "\"allocations\": %llu, \"allocatedBytes\": %llu}%s\n", all[k].depth, all[k].calls,
+                    all[k].seconds, all[k].peakRssKB, all[k].endRssKB, all[k].allocations, all[k].allocatedBytes,
+                    (k + 1 < all.size()) ? "," : "");
+            json << line;
+        }
+        json << "  ]\n";
+        json << "}\n";
+        json.close();
+        return !json.fail();
+    }
+}
@@ -0,0 +1,98 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// Profiler.h
+//
+
+#ifndef PUBGEO_PROFILER_H
+#define PUBGEO_PROFILER_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace pubgeo {
+//
+// Hierarchical stage timing and memory instrumentation.
+// Stages are timed with ScopedTimer and named by their path within enclosing stages (e.g., "classify/groupObjects").
+// Repeated calls of the same path are accumulated. Nothing is recorded until enable() is called.
+// Allocations are only counted in programs that link AllocationCounter.cpp.
+// Peak RSS is per stage on Linux. With worker threads, it includes any stages running at the same time.
+// Memory is only sampled at the boundaries of top-level stages (depth less than MEMORY_DEPTH), since reading it takes
+// system calls. Deeper stages report zero RSS, and should still be coarse enough that timing them costs little.
+// Stages begun by parallelFor workers are nested under the stage that called parallelFor.
+//
+    class Profiler {
+    public:
+        static const int MEMORY_DEPTH = 2;
+
+        typedef struct {
+            std::string path;
+            int depth;
+            unsigned long calls;
+            double seconds;
+            long peakRssKB;                     // Peak resident set size during the stage
+            long endRssKB;                      // Resident set size when the stage last ended
+            unsigned long long allocations;     // Heap allocations during the stage, by all threads
+            unsigned long long allocatedBytes;
+        } Stage;
+
+        static void enable();
+
+        static bool isEnabled();
+
+        static void begin(const char *name);
+
+        static void end();
+
+        // Get the innermost stage running on this thread, or -1 if there is none.
+        static long currentStage();
+
+        // Nest stages begun on this thread under a stage running on another thread, until detach() is called.
+        static void attach(long stage);
+
+        static void detach();
+
+        // Get a copy of all stages recorded so far, in the order they first started.
+        static std::vector<Stage> stages();
+
+        // Print a table of all stages.
+        static void printSummary();
+
+        // Write all stages as a JSON report.
+        static bool writeJSON(const char *fileName);
+
+        // Current and peak resident set size of this process; zero where not supported.
+        static long currentRssKB();
+
+        static long peakRssKB();
+
+        // Allocation counters, updated by AllocationCounter.cpp.
+        static void countAllocation(size_t bytes);
+
+        static unsigned long long allocationCount();
+
+        static unsigned long long allocatedBytes();
+    };
+
+//
+// Time the enclosing scope as a stage.
+//
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(const char *name) {
+            Profiler::begin(name);
+        }
+
+        ~ScopedTimer() {
+            Profiler::end();
+        }
+
+    private:
+        ScopedTimer(const ScopedTimer &) = delete;
+
+        ScopedTimer &operator=(const ScopedTimer &) = delete;
+    };
+}
+
+#endif //PUBGEO_PROFILER_H
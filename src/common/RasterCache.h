@@ -0,0 +1,82 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// RasterCache.h
+//
+
+#ifndef PUBGEO_RASTER_CACHE_H
+#define PUBGEO_RASTER_CACHE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "orthoimage.h"
+
+namespace pubgeo {
+//
+// On-disk cache of intermediate rasters in the native raw image format.
+// Each entry is named by a hash of a description of everything it depends on, such as the hash of the input file
+// contents and the parameters used to produce it. Changing any of those produces a new name, so entries are never
+// stale; old entries are simply no longer used.
+//
+    class RasterCache {
+    public:
+        std::string directory;    // Caching is disabled if this is empty.
+
+        bool enabled() const {
+            return !directory.empty();
+        }
+
+        // Hash the contents of a file. Returns false if the file cannot be read.
+        static bool hashFile(const char *fileName, unsigned long long &hash) {
+            FILE *fptr = fopen(fileName, "rb");
+            if (!fptr) return false;
+            hash = 14695981039346656037ULL;
+            std::vector<unsigned long long> buffer(1 << 17);
+            size_t numBytes;
+            while ((numBytes = fread(&buffer[0], 1, buffer.size() * sizeof(unsigned long long), fptr)) > 0) {
+                // Mix eight bytes at a time, zero padding the last word.
+                size_t numWords = (numBytes + 7) / 8;
+                if (numBytes % 8) memset((char *) &buffer[0] + numBytes, 0, numWords * 8 - numBytes);
+                for (size_t k = 0; k < numWords; k++) hash = (hash ^ buffer[k]) * 1099511628211ULL;
+                hash = (hash ^ numBytes) * 1099511628211ULL;
+            }
+            bool ok = !ferror(fptr);
+            fclose(fptr);
+            return ok;
+        }
+
+        // Hash a string with 64 bit FNV-1a.
+        static unsigned long long hashString(const std::string &text) {
+            unsigned long long hash = 14695981039346656037ULL;
+            for (size_t k = 0; k < text.size(); k++) hash = (hash ^ (unsigned char) text[k]) * 1099511628211ULL;
+            return hash;
+        }
+
+        // Get the file name of one product for a description.
+        std::string fileName(const std::string &description, const char *product) const {
+            char name[64];
+            sprintf(name, "%016llx_", hashString(description));
+            std::string path = directory;
+            if ((path.back() != '/') && (path.back() != '\\')) path += "/";
+            return path + name + product + ".raw";
+        }
+
+        template<class TYPE>
+        bool load(const std::string &description, const char *product, OrthoImage<TYPE> &image) const {
+            if (!enabled()) return false;
+            return image.readRaw(fileName(description, product).c_str());
+        }
+
+        template<class TYPE>
+        bool store(const std::string &description, const char *product, OrthoImage<TYPE> &image) const {
+            if (!enabled()) return false;
+            std::string name = fileName(description, product);
+            bool ok = image.writeRaw(name.c_str());
+            if (!ok) printf("Warning: Failed to write cache file %s\n", name.c_str());
+            return ok;
+        }
+    };
+}
+
+#endif //PUBGEO_RASTER_CACHE_H
@@ -0,0 +1,84 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// WorkQueue.h
+//
+
+#ifndef PUBGEO_WORK_QUEUE_H
+#define PUBGEO_WORK_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Profiler.h"
+
+namespace pubgeo {
+    // Get the number of threads to use, with zero meaning all available cores.
+    inline unsigned int resolveThreadCount(unsigned int numThreads) {
+        if (numThreads > 0) return numThreads;
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Run job(index, thread) for every index in [0, count) on a pool of threads.
+    // Each thread takes the next unclaimed index, so long and short jobs balance out.
+    // Stages profiled in jobs are nested under the stage running on the calling thread.
+    inline void parallelFor(long count, unsigned int numThreads, const std::function<void(long, unsigned int)> &job) {
+        numThreads = (unsigned int) std::min((long) resolveThreadCount(numThreads), std::max(count, 1L));
+        if (numThreads <= 1) {
+            for (long i = 0; i < count; i++) job(i, 0);
+            return;
+        }
+        std::atomic<long> next(0);
+        std::vector<std::thread> workers;
+        long parent = Profiler::currentStage();
+        for (unsigned int t = 0; t < numThreads; t++) {
+            workers.emplace_back([&next, &job, count, t, parent]() {
+                Profiler::attach(parent);
+                for (long i = next++; i < count; i = next++) job(i, t);
+                Profiler::detach();
+            });
+        }
+        for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+    }
+
+//
+// Memory budget shared by concurrent jobs.
+// A job larger than the whole budget still runs, but only once nothing else holds any of it.
+//
+    class MemoryBudget {
+    public:
+        // A budget of zero bytes is unlimited.
+        explicit MemoryBudget(unsigned long long budgetBytes) : budget(budgetBytes), used(0) {}
+
+        // Block until the requested bytes fit in the budget. Returns the amount actually reserved.
+        unsigned long long acquire(unsigned long long bytes) {
+            if (budget == 0) return 0;
+            bytes = std::min(bytes, budget);
+            std::unique_lock<std::mutex> lock(mutex);
+            available.wait(lock, [this, bytes]() { return used + bytes <= budget; });
+            used += bytes;
+            return bytes;
+        }
+
+        void release(unsigned long long bytes) {
+            if (bytes == 0) return;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                used -= bytes;
+            }
+            available.notify_all();
+        }
+
+    private:
+        unsigned long long budget;
+        unsigned long long used;
+        std::mutex mutex;
+        std::condition_variable available;
+    };
+}
+
+#endif //PUBGEO_WORK_QUEUE_H
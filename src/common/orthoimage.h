@@ -14,6 +14,8 @@
 #include <typeinfo>
 #include <cstring>
 #include <algorithm>
+#include <limits>
+#include <string>
 
 #ifdef WIN32
 #include "gdal_priv.h"
@@ -28,12 +30,32 @@
 #include "util.h"
 #include "PointCloud.h"
 #include "Image.h"
+#include "MinMaxGrid.h"
+#include "Profiler.h"
 
 namespace pubgeo {
     typedef enum {
         MIN_VALUE, MAX_VALUE
     } MIN_MAX_TYPE;
 
+    // Header of the native raw image format, followed by the rows of pixels with no padding.
+    // The layout is fixed so a file can be memory mapped directly.
+    typedef struct {
+        char magic[8];          // "PUBGEO01"
+        unsigned int typeSize;  // Bytes per pixel per band
+        unsigned int width;
+        unsigned int height;
+        unsigned int bands;
+        int zone;
+        float gsd;
+        float scale;
+        float offset;
+        double easting;
+        double northing;
+        double reserved;
+    } RawImageHeader;
+    static_assert(sizeof(RawImageHeader) == 64, "RawImageHeader must be 64 bytes");
+
 //
 // Ortho image template class
 //
@@ -58,8 +80,27 @@ namespace pubgeo {
             this->Deallocate();
         }
 
+        // Floating point images store elevations relative to the offset at full precision, with a scale of one.
+        // Integer images quantize elevations to the full range of the type.
+        static bool isFloatingPoint() {
+            return !std::numeric_limits<TYPE>::is_integer;
+        }
+
+        // Set the scale and offset for values from minVal to maxVal, which should leave room to reserve zero for
+        // noData values.
+        void setValueRange(float minVal, float maxVal) {
+            this->offset = minVal;
+            if (isFloatingPoint()) {
+                this->scale = 1.0;
+            } else {
+                float maxImageVal = (float) (pow(2.0, int(sizeof(TYPE) * 8)) - 1);
+                this->scale = (maxVal - minVal) / maxImageVal;
+            }
+        }
+
         // Read any GDAL-supported image.
         bool read(char *fileName) {
+            ScopedTimer timer("read");
             // Open the image.
             GDALAllRegister();
             CPLSetConfigOption("GDAL_DATA", ".\\gdaldata");
@@ -114,20 +155,17 @@ namespace pubgeo {
             double noData = poBand->GetNoDataValue(&ok);
             if (!ok) {
                 // Set noData only for floating point images.
-                if (strcmp(typeid(TYPE).name(), "float") == 0)
+                if (isFloatingPoint())
                     noData = -10000.0;
                 else
                     noData = 0;
             }
 
             // Get scale and offset values.
-            if (strcmp(typeid(TYPE).name(), "float") == 0) {
-                // Do not scale if floating point values.
-                this->scale = 1.0;
-                this->offset = 0.0;
-            } else {
+            // Floating point images are not scaled, but are offset so that no valid value is zero.
+            {
                 float minVal = MAX_FLOAT;
-                float maxVal = MAX_FLOAT;
+                float maxVal = -MAX_FLOAT;
                 for (unsigned int i = 0; i < this->bands; i++) {
                     poBand = poDataset->GetRasterBand(i + 1);
                     if (poBand == NULL) {
@@ -144,9 +182,7 @@ namespace pubgeo {
                 }
                 minVal -= 1;    // Reserve zero for noData value
                 maxVal += 1;
-                float maxImageVal = (float) (pow(2.0, int(sizeof(TYPE) * 8)) - 1);
-                this->offset = minVal;
-                this->scale = (maxVal - minVal) / maxImageVal;
+                setValueRange(minVal, maxVal);
             }
             printf("Offset = %f\n", this->offset);
             printf("Scale = %f\n", this->scale);
@@ -210,7 +246,9 @@ namespace pubgeo {
         }
 
         // Write GEOTIFF image using GDAL.
-        bool write(char *fileName, bool convertToFloat = false, bool egm96 = false) {
+        // Creation options are passed through to the GTiff driver (e.g., "COMPRESS=DEFLATE").
+        bool write(char *fileName, bool convertToFloat = false, bool egm96 = false, char **papszOptions = nullptr) {
+            ScopedTimer timer("write");
             GDALAllRegister();
             const char *pszFormat = "GTiff";
             GDALDriver *poDriver = GetGDALDriverManager()->GetDriverByName(pszFormat);
@@ -220,15 +258,17 @@ namespace pubgeo {
 
             // Get the GDAL data type to match the image data type.
             GDALDataType theBandDataType = (GDALDataType) sizeof(TYPE);
-            if (strcmp(typeid(TYPE).name(), "float") == 0) theBandDataType = GDT_Float32;
+
+            // Floating point images are always converted to add their offset and write voids as noData.
+            if (isFloatingPoint()) convertToFloat = true;
 
             // If converting this image to FLOAT, then update the output format type.
             if (convertToFloat) theBandDataType = GDT_Float32;
 
             // Write geospatial metadata.
-            char **papszOptions = nullptr;
             GDALDataset *poDstDS = poDriver->Create(fileName, this->width, this->height, this->bands, theBandDataType,
                                                     papszOptions);
+            if (poDstDS == NULL) return false;
             double adfGeoTransform[6] = {this->easting, this->gsd, 0, this->northing + this->height * this->gsd, 0,
                                          -1 * this->gsd};
             poDstDS->SetGeoTransform(adfGeoTransform);
@@ -264,7 +304,8 @@ namespace pubgeo {
                             else
                                 raster[k] = (float(this->data[j][k]) * this->scale) + this->offset;
                         }
-                        poBand->RasterIO(GF_Write, 0, j, this->width, 1, raster, this->width, 1, theBandDataType,
+                        poBand->RasterIO(GF_Write, 0, j, this->width, 1, raster + (i - 1), this->width, 1,
+                                         theBandDataType,
                                          sizeof(float) * this->bands,
                                          this->width * this->bands * sizeof(float));
                     }
@@ -275,7 +316,8 @@ namespace pubgeo {
                 for (unsigned int i = 1; i <= this->bands; i++) {
                     GDALRasterBand *poBand = poDstDS->GetRasterBand(i);
                     for (unsigned int j = 0; j < this->height; j++) {
-                        poBand->RasterIO(GF_Write, 0, j, this->width, 1, this->data[j], this->width, 1, theBandDataType,
+                        poBand->RasterIO(GF_Write, 0, j, this->width, 1, this->data[j] + (i - 1), this->width, 1,
+                                         theBandDataType,
                                          sizeof(TYPE) * this->bands,
                                          this->width * this->bands * sizeof(TYPE));
                     }
@@ -285,8 +327,72 @@ namespace pubgeo {
             return true;
         }
 
+        // Write the image in the native raw format.
+        // Write to a temporary file first, so a partial file is never left under the final name.
+        bool writeRaw(const char *fileName) {
+            ScopedTimer timer("writeRaw");
+            RawImageHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "PUBGEO01", 8);
+            header.typeSize = sizeof(TYPE);
+            header.width = this->width;
+            header.height = this->height;
+            header.bands = this->bands;
+            header.zone = this->zone;
+            header.gsd = this->gsd;
+            header.scale = this->scale;
+            header.offset = this->offset;
+            header.easting = this->easting;
+            header.northing = this->northing;
+            std::string tempFileName = std::string(fileName) + ".tmp";
+            FILE *fptr = fopen(tempFileName.c_str(), "wb");
+            if (!fptr) return false;
+            bool ok = (fwrite(&header, sizeof(header), 1, fptr) == 1);
+            for (unsigned int j = 0; ok && (j < this->height); j++) {
+                ok = (fwrite(this->data[j], sizeof(TYPE), this->width * this->bands, fptr) == this->width * this->bands);
+            }
+            ok &= (fclose(fptr) == 0);
+            if (ok) {
+                remove(fileName);
+                ok = (rename(tempFileName.c_str(), fileName) == 0);
+            }
+            if (!ok) remove(tempFileName.c_str());
+            return ok;
+        }
+
+        // Read an image in the native raw format.
+        // Returns false if the file is missing, truncated, or stores a different pixel type.
+        bool readRaw(const char *fileName) {
+            ScopedTimer timer("readRaw");
+            FILE *fptr = fopen(fileName, "rb");
+            if (!fptr) return false;
+            RawImageHeader header;
+            bool ok = (fread(&header, sizeof(header), 1, fptr) == 1);
+            ok = ok && (memcmp(header.magic, "PUBGEO01", 8) == 0) && (header.typeSize == sizeof(TYPE));
+            if (ok) {
+                this->Allocate(header.width, header.height, header.bands);
+                for (unsigned int j = 0; ok && (j < this->height); j++) {
+                    ok = (fread(this->data[j], sizeof(TYPE), this->width * this->bands, fptr) ==
+                          this->width * this->bands);
+                }
+            }
+            fclose(fptr);
+            if (!ok) {
+                this->Deallocate();
+                return false;
+            }
+            this->zone = header.zone;
+            this->gsd = header.gsd;
+            this->scale = header.scale;
+            this->offset = header.offset;
+            this->easting = header.easting;
+            this->northing = header.northing;
+            return true;
+        }
+
         // Read image from point cloud file.
         bool readFromPointCloud(char *fileName, float gsdMeters, MIN_MAX_TYPE mode = MIN_VALUE) {
+            ScopedTimer timer("rasterize");
             // Read a PSET file (e.g., BPF or LAS).
             PointCloud pset;
             bool ok = pset.Read(fileName);
@@ -295,9 +401,7 @@ namespace pubgeo {
             // Calculate scale and offset for conversion to TYPE.
             float minVal = pset.bounds.zMin - 1;    // Reserve zero for noData value
             float maxVal = pset.bounds.zMax + 1;
-            float maxImageVal = (float) (pow(2.0, int(sizeof(TYPE) * 8)) - 1);
-            this->offset = minVal;
-            this->scale = (maxVal - minVal) / maxImageVal;
+            setValueRange(minVal, maxVal);
 
             // Calculate image width and height.
             this->width = (unsigned int) ((pset.bounds.xMax - pset.bounds.xMin) / gsdMeters + 1);
@@ -335,6 +439,7 @@ namespace pubgeo {
 
         // Read image from PDAL PointView.
         bool readFromPointView(pdal::PointViewPtr view, float gsdMeters, MIN_MAX_TYPE mode = MIN_VALUE) {
+            ScopedTimer timer("rasterize");
             // Read a PSET file (e.g., BPF or LAS).
             PointCloud pset;
             bool ok = pset.Read(view);
@@ -343,9 +448,7 @@ namespace pubgeo {
             // Calculate scale and offset for conversion to TYPE.
             float minVal = pset.bounds.zMin - 1;    // Reserve zero for noData value
             float maxVal = pset.bounds.zMax + 1;
-            float maxImageVal = (float) (pow(2.0, int(sizeof(TYPE) * 8)) - 1);
-            this->offset = minVal;
-            this->scale = (maxVal - minVal) / maxImageVal;
+            setValueRange(minVal, maxVal);
 
             // Calculate image width and height.
             this->width = (unsigned int) ((pset.bounds.xMax - pset.bounds.xMin) / gsdMeters + 1);
@@ -387,6 +490,40 @@ namespace pubgeo {
             return true;
         }
 
+        // Read image from a grid of minimum and maximum values accumulated from a point stream.
+        bool readFromGrid(MinMaxGrid &grid, MIN_MAX_TYPE mode, int utmZone) {
+            ScopedTimer timer("rasterize");
+            if (grid.empty()) return false;
+
+            // Calculate scale and offset for conversion to TYPE.
+            float minVal = grid.bounds.zMin - 1;    // Reserve zero for noData value
+            float maxVal = grid.bounds.zMax + 1;
+            setValueRange(minVal, maxVal);
+
+            // Allocate an ortho image covering all grid cells.
+            this->Allocate((unsigned int) (grid.xCellMax - grid.xCellMin + 1),
+                           (unsigned int) (grid.yCellMax - grid.yCellMin + 1));
+            this->easting = grid.xCellMin * (double) grid.gsd;
+            this->northing = grid.yCellMin * (double) grid.gsd;
+            this->zone = utmZone;
+            this->gsd = grid.gsd;
+
+            // Copy cell values into the ortho image, converting each grid tile from its own offset and step.
+            for (auto it = grid.tiles.begin(); it != grid.tiles.end(); ++it) {
+                const MinMaxGrid::Tile &tile = it->second;
+                long x0 = it->first.first * MinMaxGrid::TILE_SIZE - grid.xCellMin;
+                long y0 = it->first.second * MinMaxGrid::TILE_SIZE - grid.yCellMin;
+                for (long k = 0; k < MinMaxGrid::TILE_SIZE * MinMaxGrid::TILE_SIZE; k++) {
+                    if (tile.empty(k)) continue;
+                    double value = (mode == MIN_VALUE) ? tile.minValue(k) : tile.maxValue(k);
+                    long x = x0 + k % MinMaxGrid::TILE_SIZE;
+                    long y = this->height - 1 - (y0 + k / MinMaxGrid::TILE_SIZE);
+                    this->data[y][x] = TYPE((value - this->offset) / this->scale);
+                }
+            }
+            return true;
+        }
+
         // Count voids in an image.
         // Note that voids are always labeled zero in this data structure.
         long countVoids() {
@@ -405,6 +542,7 @@ namespace pubgeo {
         // Note that voids are always labeled zero.
         // MaxLevel by default is the maximum value of int
         void fillVoidsPyramid(bool noSmoothing, unsigned int maxLevel = MAX_INT) {
+            ScopedTimer timer("fillVoidsPyramid");
             // Check for voids.
             long count = countVoids();
             if (count == 0) return;
@@ -490,7 +628,9 @@ namespace pubgeo {
         }
 
         // Apply a median filter to an image.
-        void medianFilter(int rad, unsigned int dzShort) {
+        // Only values differing from the median by more than dzShort, in image units, are replaced.
+        void medianFilter(int rad, float dzShort) {
+            ScopedTimer timer("medianFilter");
             for (unsigned int j = 0; j < this->height; j++) {
                 for (unsigned int i = 0; i < this->width; i++) {
                     // Skip if void.
@@ -503,7 +643,7 @@ namespace pubgeo {
                     unsigned int j2 = MIN(j + rad, this->height - 1);
 
                     // Add valid values to the list.
-                    std::vector<unsigned short> values;
+                    std::vector<TYPE> values;
                     for (unsigned int jj = j1; jj <= j2; jj++) {
                         for (unsigned int ii = i1; ii <= i2; ii++) {
                             if (this->data[jj][ii] != 0) {
@@ -516,7 +656,7 @@ namespace pubgeo {
                     unsigned long num = values.size();
                     if (num > 0) {
                         std::sort(values.begin(), values.end());
-                        unsigned short medianValue = values[num / 2];
+                        TYPE medianValue = values[num / 2];
                         if (fabs(float(medianValue) - float(this->data[j][i])) > dzShort)
                             this->data[j][i] = medianValue;
                     }
@@ -526,6 +666,7 @@ namespace pubgeo {
 
         // Apply a minimum filter to an image.
         void minFilter(int rad) {
+            ScopedTimer timer("minFilter");
             OrthoImage<TYPE> tempImage;
             tempImage.Allocate(this->width, this->height);
             for (unsigned int j = 0; j < this->height; j++) {
@@ -562,7 +703,8 @@ namespace pubgeo {
             }
         }
 
-        void edgeFilter(int dzShort) {
+        void edgeFilter(float dzShort) {
+            ScopedTimer timer("edgeFilter");
             OrthoImage<TYPE> tempImage;
             tempImage.Allocate(this->width, this->height);
             for (unsigned int j = 0; j < this->height; j++) {
@@ -0,0 +1,149 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// PDAL Plugin of S. Almes, S. Hagstrom, D. Chilcott, H. Goldberg, M. Brown,
+// “Open Source Geospatial Tools to Enable Large Scale 3D Scene Modeling,”
+// FOSS4G, 2017.
+
+#include <algorithm>
+
+#include "filter.hpp"
+#include "pipeline.h"
+#include "PointCloud.h"
+#include "WorkQueue.h"
+
+#include <pdal/pdal_macros.hpp>
+
+namespace pdal
+{
+
+static PluginInfo const s_info = PluginInfo(
+    "filters.shr3d", "Shareable High Resolution 3D (Almes et al., 2017)",
+    "http://pdal.io/stages/filters.shr3d.html");
+
+CREATE_SHARED_PLUGIN(1, 0, Shr3dFilter, Filter, s_info)
+
+std::string Shr3dFilter::getName() const
+{
+    return s_info.name;
+}
+
+void Shr3dFilter::addArgs(ProgramArgs& args)
+{
+    args.add("dh", "Horizontal uncertainty", m_dh, 0.5);
+    args.add("dz", "Vertical uncertainty", m_dz, 0.5);
+    args.add("agl", "Minimum building height above ground level", m_agl, 2.0);
+    args.add("area", "Minimum building area", m_area, 50.0);
+    args.add("narrow", "Radius (pixels) of the opening that removes narrow "
+             "objects (0 = none)", m_narrowRadius, 1u);
+    args.add("threads", "Number of threads for labeling points (0 = all cores)",
+             m_threads, 0u);
+    args.add("source", "Point cloud file to classify before labeling; "
+             "required in stream mode", m_source);
+}
+
+static shr3d::Shr3dParameters makeParameters(double dh, double dz, double agl,
+                                             double area,
+                                             unsigned int narrowRadius)
+{
+    shr3d::Shr3dParameters params = shr3d::Shr3dPipeline::defaultParameters();
+    params.dhMeters = dh;
+    params.dzMeters = dz;
+    params.aglMeters = agl;
+    params.minAreaMeters = area;
+    params.narrowRadius = narrowRadius;
+    return params;
+}
+
+// Classification needs every point before the first one can be labeled, so
+// stream mode classifies the source file first. It is streamed once into a
+// grid of minimum and maximum Z values, so no PointView is held in memory.
+void Shr3dFilter::ready(PointTableRef table)
+{
+    m_pipeline.reset();
+    if (m_source.empty())
+        return;
+
+    pubgeo::MinMaxXYZ bounds;
+    int zone = 0;
+    if (!pubgeo::PointCloud::ReadBounds(m_source.c_str(), bounds, zone))
+        throw pdal_error("Error reading " + m_source + "\n");
+    pubgeo::MinMaxGrid grid(static_cast<float>(m_dh));
+    auto addPoint = [&grid](double x, double y, double z) { grid.add(x, y, z); };
+    if (!pubgeo::PointCloud::StreamPoints(m_source.c_str(), addPoint) ||
+        grid.empty())
+        throw pdal_error("Error reading " + m_source + "\n");
+
+    std::shared_ptr<shr3d::Shr3dPipeline> pipeline(
+        new shr3d::Shr3dPipeline(makeParameters(m_dh, m_dz, m_agl, m_area,
+                                                m_narrowRadius)));
+    if (!pipeline->readPointGrid(grid, zone))
+        throw pdal_error("Error creating DSM\n");
+    pipeline->classify();
+    m_pipeline = pipeline;
+}
+
+bool Shr3dFilter::processOne(PointRef& point)
+{
+    if (!m_pipeline)
+        throw pdal_error("filters.shr3d requires the 'source' option in "
+                         "stream mode\n");
+    unsigned char label = m_pipeline->classifyPoint(
+        point.getFieldAs<double>(Dimension::Id::X),
+        point.getFieldAs<double>(Dimension::Id::Y),
+        point.getFieldAs<double>(Dimension::Id::Z));
+    if (label)
+        point.setField(Dimension::Id::Classification, label);
+    return true;
+}
+
+void Shr3dFilter::addDimensions(PointLayoutPtr layout)
+{
+    layout->registerDim(Dimension::Id::Classification);
+}
+
+// Classify the view as rasters, unless the source file has been classified
+// already, then label each point by looking up its cell in the class image
+// and its height above the DTM. Labeling is split into contiguous chunks of
+// points, one per thread.
+PointViewSet Shr3dFilter::run(PointViewPtr view)
+{
+    PointViewSet viewSet;
+    viewSet.insert(view);
+    if (!view->size())
+        return viewSet;
+
+    std::shared_ptr<shr3d::Shr3dPipeline> classified = m_pipeline;
+    if (!classified)
+    {
+        classified.reset(new shr3d::Shr3dPipeline(
+            makeParameters(m_dh, m_dz, m_agl, m_area, m_narrowRadius)));
+        if (!classified->readPointView(view))
+            throw pdal_error("Error creating DSM\n");
+        classified->classify();
+    }
+    const shr3d::Shr3dPipeline& pipeline = *classified;
+
+    pubgeo::ScopedTimer timer("labelPoints");
+    unsigned int numThreads = pubgeo::resolveThreadCount(m_threads);
+    point_count_t chunk = (view->size() + numThreads - 1) / numThreads;
+    long numChunks = static_cast<long>((view->size() + chunk - 1) / chunk);
+    pubgeo::parallelFor(numChunks, numThreads,
+                        [&pipeline, &view, chunk](long k, unsigned int) {
+        point_count_t begin = static_cast<point_count_t>(k) * chunk;
+        point_count_t end = std::min(begin + chunk, view->size());
+        for (PointId i = begin; i < end; ++i)
+        {
+            unsigned char label = pipeline.classifyPoint(
+                view->getFieldAs<double>(Dimension::Id::X, i),
+                view->getFieldAs<double>(Dimension::Id::Y, i),
+                view->getFieldAs<double>(Dimension::Id::Z, i));
+            if (label)
+                view->setField(Dimension::Id::Classification, i, label);
+        }
+    });
+
+    return viewSet;
+}
+
+} // namespace pdal
@@ -0,0 +1,59 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// PDAL Plugin of S. Almes, S. Hagstrom, D. Chilcott, H. Goldberg, M. Brown,
+// “Open Source Geospatial Tools to Enable Large Scale 3D Scene Modeling,”
+// FOSS4G, 2017.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <pdal/Filter.hpp>
+#include <pdal/Streamable.hpp>
+#include <pdal/pdal_export.hpp>
+#include <pdal/util/ProgramArgs.hpp>
+
+namespace shr3d
+{
+template<class ELEV> class BasicShr3dPipeline;
+typedef BasicShr3dPipeline<unsigned short> Shr3dPipeline;
+}
+
+namespace pdal
+{
+
+class PDAL_DLL Shr3dFilter : public Filter, public Streamable
+{
+public:
+    Shr3dFilter()
+    {
+    }
+
+    static void* create();
+    static int32_t destroy(void*);
+    std::string getName() const;
+
+private:
+    virtual void addArgs(ProgramArgs& args);
+    virtual void addDimensions(PointLayoutPtr layout);
+    virtual void ready(PointTableRef table);
+    virtual bool processOne(PointRef& point);
+    virtual PointViewSet run(PointViewPtr view);
+
+    double m_dh;
+    double m_dz;
+    double m_agl;
+    double m_area;
+    unsigned int m_narrowRadius;
+    unsigned int m_threads;
+    std::string m_source;
+    // Classified from the source file before any point is labeled.
+    std::shared_ptr<shr3d::Shr3dPipeline> m_pipeline;
+
+    Shr3dFilter& operator=(const Shr3dFilter&) = delete;
+    Shr3dFilter(const Shr3dFilter&) = delete;
+};
+}
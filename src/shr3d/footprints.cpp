@@ -0,0 +1,433 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// footprints.cpp
+//
+
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <climits>
+#include <algorithm>
+#include <string>
+#include "footprints.h"
+#include "WorkQueue.h"
+
+using namespace shr3d;
+
+// Number of buildings traced in parallel before their features are written.
+#define FOOTPRINT_BATCH_SIZE 1024
+
+// Pixel statistics accumulated for each labeled building.
+typedef struct {
+    long xmin;
+    long xmax;
+    long ymin;
+    long ymax;
+    long count;
+    long heightCount;
+    double heightSum;
+    double heightMin;
+    double heightMax;
+    long roofCount;
+    double roofSum;
+    double roofMax;
+    long groundCount;
+    double groundSum;
+} BuildingStats;
+
+// Boundary edge between a region pixel and a pixel outside it.
+// Edges run clockwise around each pixel as displayed (y down), which is clockwise in map coordinates for outer
+// boundaries and counterclockwise for holes.
+typedef struct {
+    long start;     // Vertex index in the bounding box corner grid
+    int direction;  // 0 = +x, 1 = +y, 2 = -x, 3 = -y
+} BoundaryEdge;
+
+static const int EDGE_DX[4] = {1, 0, -1, 0};
+static const int EDGE_DY[4] = {0, 1, 0, -1};
+
+// Flood fill one 4-connected region within rows [j0, j1).
+static void fillRegion(OrthoImage<unsigned char> &classImage, OrthoImage<unsigned int> &regionImage,
+                       unsigned int i, unsigned int j, unsigned int j0, unsigned int j1, unsigned int label,
+                       std::vector<PixelType> &stack) {
+    regionImage.data[j][i] = label;
+    stack.push_back(PixelType{i, j});
+    while (!stack.empty()) {
+        PixelType pixel = stack.back();
+        stack.pop_back();
+        for (int k = 0; k < 4; k++) {
+            long ii = (long) pixel.i + EDGE_DX[k];
+            long jj = (long) pixel.j + EDGE_DY[k];
+            if ((ii < 0) || (ii >= (long) classImage.width) || (jj < (long) j0) || (jj >= (long) j1)) continue;
+            if (classImage.data[jj][ii] != LAS_BUILDING) continue;
+            if (regionImage.data[jj][ii] != 0) continue;
+            regionImage.data[jj][ii] = label;
+            stack.push_back(PixelType{(unsigned int) ii, (unsigned int) jj});
+        }
+    }
+}
+
+// Find the root of a label, compressing the path as it goes.
+static unsigned int findRoot(std::vector<unsigned int> &parent, unsigned int label) {
+    while (parent[label] != label) {
+        parent[label] = parent[parent[label]];
+        label = parent[label];
+    }
+    return label;
+}
+
+unsigned long BuildingFootprints::labelBuildings(OrthoImage<unsigned char> &classImage,
+                                                 OrthoImage<unsigned int> &regionImage, unsigned int numThreads) {
+    ScopedTimer timer("labelBuildings");
+    unsigned int width = classImage.width;
+    unsigned int height = classImage.height;
+    regionImage.Allocate(width, height);
+    regionImage.easting = classImage.easting;
+    regionImage.northing = classImage.northing;
+    regionImage.zone = classImage.zone;
+    regionImage.gsd = classImage.gsd;
+    if ((width == 0) || (height == 0)) return 0;
+
+    // Label each strip of rows independently.
+    numThreads = pubgeo::resolveThreadCount(numThreads);
+    long numStrips = MIN((long) height, (long) numThreads * 4);
+    std::vector<unsigned int> stripStart(numStrips + 1);
+    for (long s = 0; s <= numStrips; s++) stripStart[s] = (unsigned int) ((long) height * s / numStrips);
+    std::vector<unsigned long> stripCount(numStrips, 0);
+    pubgeo::parallelFor(numStrips, numThreads, [&](long s, unsigned int) {
+        unsigned int label = 0;
+        std::vector<PixelType> stack;
+        for (unsigned int j = stripStart[s]; j < stripStart[s + 1]; j++) {
+            for (unsigned int i = 0; i < width; i++) {
+                if ((classImage.data[j][i] != LAS_BUILDING) || (regionImage.data[j][i] != 0)) continue;
+                fillRegion(classImage, regionImage, i, j, stripStart[s], stripStart[s + 1], ++label, stack);
+            }
+        }
+        stripCount[s] = label;
+    });
+
+    // Offset strip labels so they are unique across strips.
+    std::vector<unsigned long> stripOffset(numStrips + 1, 0);
+    for (long s = 0; s < numStrips; s++) stripOffset[s + 1] = stripOffset[s] + stripCount[s];
+    unsigned long numLabels = stripOffset[numStrips];
+    pubgeo::parallelFor(numStrips, numThreads, [&](long s, unsigned int) {
+        unsigned int offset = (unsigned int) stripOffset[s];
+        for (unsigned int j = stripStart[s]; j < stripStart[s + 1]; j++) {
+            for (unsigned int i = 0; i < width; i++) {
+                if (regionImage.data[j][i] != 0) regionImage.data[j][i] += offset;
+            }
+        }
+    });
+
+    // Stitch regions that touch across the seams between strips.
+    std::vector<unsigned int> parent(numLabels + 1);
+    for (unsigned long k = 0; k <= numLabels; k++) parent[k] = (unsigned int) k;
+    for (long s = 1; s < numStrips; s++) {
+        unsigned int j = stripStart[s];
+        for (unsigned int i = 0; i < width; i++) {
+            unsigned int above = regionImage.data[j - 1][i];
+            unsigned int below = regionImage.data[j][i];
+            if ((above == 0) || (below == 0)) continue;
+            unsigned int a = findRoot(parent, above);
+            unsigned int b = findRoot(parent, below);
+            if (a != b) parent[MAX(a, b)] = MIN(a, b);
+        }
+    }
+
+    // Number the stitched regions in order of their first pixel, which does not depend on the strips.
+    std::vector<unsigned int> finalLabel(numLabels + 1, 0);
+    unsigned long numRegions = 0;
+    for (unsigned long k = 1; k <= numLabels; k++) {
+        unsigned int root = findRoot(parent, (unsigned int) k);
+        if (finalLabel[root] == 0) finalLabel[root] = (unsigned int) ++numRegions;
+        finalLabel[k] = finalLabel[root];
+    }
+    pubgeo::parallelFor(numStrips, numThreads, [&](long s, unsigned int) {
+        for (unsigned int j = stripStart[s]; j < stripStart[s + 1]; j++) {
+            for (unsigned int i = 0; i < width; i++) {
+                regionImage.data[j][i] = finalLabel[regionImage.data[j][i]];
+            }
+        }
+    });
+    return numRegions;
+}
+
+// Trace the pixel boundaries of one region within its bounding box.
+// At a vertex shared by two diagonal pixels, turn to stay with the current pixel, which keeps regions 4-connected.
+// Rings are returned as corner coordinates in the image, keeping only the vertices where the direction changes.
+static void traceRegion(OrthoImage<unsigned int> &regionImage, unsigned int label, const BuildingStats &stats,
+                        std::vector<std::vector<std::pair<long, long> > > &rings) {
+    long boxWidth = stats.xmax - stats.xmin + 1;
+    long boxHeight = stats.ymax - stats.ymin + 1;
+    long numVertices = (boxWidth + 1) * (boxHeight + 1);
+
+    // Collect boundary edges, indexed by their start vertex. A vertex starts at most two edges.
+    std::vector<BoundaryEdge> edges;
+    std::vector<long> firstOut(numVertices, -1);
+    std::vector<long> secondOut(numVertices, -1);
+    for (long y = 0; y < boxHeight; y++) {
+        for (long x = 0; x < boxWidth; x++) {
+            long i = stats.xmin + x;
+            long j = stats.ymin + y;
+            if (regionImage.data[j][i] != label) continue;
+            for (int d = 0; d < 4; d++) {
+                // The side of this pixel crossed by direction d + 3, in the order top, right, bottom, left.
+                long ni = i + EDGE_DX[(d + 3) % 4];
+                long nj = j + EDGE_DY[(d + 3) % 4];
+                bool outside = (ni < 0) || (nj < 0) || (ni >= (long) regionImage.width) ||
+                               (nj >= (long) regionImage.height) || (regionImage.data[nj][ni] != label);
+                if (!outside) continue;
+                static const int START_DX[4] = {0, 1, 1, 0};
+                static const int START_DY[4] = {0, 0, 1, 1};
+                BoundaryEdge edge = {(y + START_DY[d]) * (boxWidth + 1) + (x + START_DX[d]), d};
+                long index = (long) edges.size();
+                if (firstOut[edge.start] < 0) firstOut[edge.start] = index;
+                else secondOut[edge.start] = index;
+                edges.push_back(edge);
+            }
+        }
+    }
+
+    // Link edges into closed rings.
+    std::vector<bool> used(edges.size(), false);
+    for (size_t first = 0; first < edges.size(); first++) {
+        if (used[first]) continue;
+        std::vector<std::pair<long, long> > ring;
+        long current = (long) first;
+        do {
+            used[current] = true;
+            const BoundaryEdge &edge = edges[current];
+            long end = edge.start + EDGE_DY[edge.direction] * (boxWidth + 1) + EDGE_DX[edge.direction];
+            long next = firstOut[end];
+            if ((secondOut[end] >= 0) && (edges[next].direction != (edge.direction + 1) % 4)) next = secondOut[end];
+            if (edges[next].direction != edge.direction) {
+                ring.push_back(std::make_pair(stats.xmin + end % (boxWidth + 1), stats.ymin + end / (boxWidth + 1)));
+            }
+            current = next;
+        } while (current != (long) first);
+        rings.push_back(ring);
+    }
+}
+
+// Keep the points of a polyline farther than the tolerance from the simplified line, from first to last.
+static void douglasPeucker(const FootprintRing &ring, size_t first, size_t last, double tolerance,
+                           std::vector<bool> &keep) {
+    size_t n = ring.size();
+    if ((last + n - first) % n < 2) return;
+    double x0 = ring[first].first;
+    double y0 = ring[first].second;
+    double dx = ring[last % n].first - x0;
+    double dy = ring[last % n].second - y0;
+    double length = sqrt(dx * dx + dy * dy);
+    double maxDistance = -1.0;
+    size_t farthest = first;
+    for (size_t k = first + 1; k < last; k++) {
+        double px = ring[k % n].first - x0;
+        double py = ring[k % n].second - y0;
+        double distance = (length > 0.0) ? fabs(px * dy - py * dx) / length : sqrt(px * px + py * py);
+        if (distance > maxDistance) {
+            maxDistance = distance;
+            farthest = k;
+        }
+    }
+    if (maxDistance <= tolerance) return;
+    keep[farthest % n] = true;
+    douglasPeucker(ring, first, farthest, tolerance, keep);
+    douglasPeucker(ring, farthest, last, tolerance, keep);
+}
+
+// Simplify a closed ring, splitting it at the first point and the point farthest from it.
+static void simplifyRing(FootprintRing &ring, double tolerance) {
+    size_t n = ring.size();
+    if ((tolerance <= 0.0) || (n <= 4)) return;
+    size_t farthest = 0;
+    double maxDistance = -1.0;
+    for (size_t k = 1; k < n; k++) {
+        double dx = ring[k].first - ring[0].first;
+        double dy = ring[k].second - ring[0].second;
+        if (dx * dx + dy * dy > maxDistance) {
+            maxDistance = dx * dx + dy * dy;
+            farthest = k;
+        }
+    }
+    std::vector<bool> keep(n, false);
+    keep[0] = true;
+    keep[farthest] = true;
+    douglasPeucker(ring, 0, farthest, tolerance, keep);
+    douglasPeucker(ring, farthest, n, tolerance, keep);
+    FootprintRing simplified;
+    for (size_t k = 0; k < n; k++) {
+        if (keep[k]) simplified.push_back(ring[k]);
+    }
+    if (simplified.size() >= 3) ring.swap(simplified);
+}
+
+// Signed area of a ring; positive if counterclockwise.
+static double ringArea(const FootprintRing &ring) {
+    double area = 0.0;
+    for (size_t k = 0; k < ring.size(); k++) {
+        const std::pair<double, double> &a = ring[k];
+        const std::pair<double, double> &b = ring[(k + 1) % ring.size()];
+        area += a.first * b.second - b.first * a.second;
+    }
+    return area / 2.0;
+}
+
+// Trace, simplify, and summarize one building.
+static void makeFootprint(OrthoImage<unsigned int> &regionImage, unsigned int label, const BuildingStats &stats,
+                          double simplifyMeters, Footprint &footprint) {
+    double gsd = regionImage.gsd;
+    footprint.id = label;
+    footprint.pixels = stats.count;
+    footprint.area = stats.count * gsd * gsd;
+    footprint.heightMin = (stats.heightCount > 0) ? stats.heightMin : 0.0;
+    footprint.heightMean = (stats.heightCount > 0) ? stats.heightSum / stats.heightCount : 0.0;
+    footprint.heightMax = (stats.heightCount > 0) ? stats.heightMax : 0.0;
+    footprint.roofMean = (stats.roofCount > 0) ? stats.roofSum / stats.roofCount : 0.0;
+    footprint.roofMax = (stats.roofCount > 0) ? stats.roofMax : 0.0;
+    footprint.groundMean = (stats.groundCount > 0) ? stats.groundSum / stats.groundCount : 0.0;
+
+    std::vector<std::vector<std::pair<long, long> > > rings;
+    traceRegion(regionImage, label, stats, rings);
+    for (size_t r = 0; r < rings.size(); r++) {
+        // Convert image corners to map coordinates, matching the geotransform used to write the images.
+        FootprintRing ring;
+        for (size_t k = 0; k < rings[r].size(); k++) {
+            double x = regionImage.easting + rings[r][k].first * gsd;
+            double y = regionImage.northing + ((double) regionImage.height - rings[r][k].second) * gsd;
+            ring.push_back(std::make_pair(x, y));
+        }
+        std::reverse(ring.begin(), ring.end());
+        simplifyRing(ring, simplifyMeters);
+
+        // A 4-connected region has one counterclockwise outer boundary. Any others are holes.
+        if (ringArea(ring) > 0.0) footprint.outer.swap(ring);
+        else footprint.holes.push_back(ring);
+    }
+}
+
+// Append a ring as a closed GeoJSON linear ring.
+static void appendRing(std::string &json, const FootprintRing &ring) {
+    char point[64];
+    json += "[";
+    for (size_t k = 0; k <= ring.size(); k++) {
+        const std::pair<double, double> &p = ring[k % ring.size()];
+        sprintf(point, "%s[%.3f,%.3f]", (k > 0) ? "," : "", p.first, p.second);
+        json += point;
+    }
+    json += "]";
+}
+
+// Format a footprint as a GeoJSON feature.
+static std::string formatFeature(const Footprint &footprint) {
+    char properties[512];
+    sprintf(properties, "{\"type\":\"Feature\",\"properties\":{\"id\":%lu,\"pixels\":%ld,\"area\":%.2f,"
+                        "\"heightMin\":%.2f,\"heightMean\":%.2f,\"heightMax\":%.2f,\"roofMean\":%.2f,"
+                        "\"roofMax\":%.2f,\"groundMean\":%.2f},\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[",
+            footprint.id, footprint.pixels, footprint.area, footprint.heightMin, footprint.heightMean,
+            footprint.heightMax, footprint.roofMean, footprint.roofMax, footprint.groundMean);
+    std::string json = properties;
+    appendRing(json, footprint.outer);
+    for (size_t h = 0; h < footprint.holes.size(); h++) {
+        json += ",";
+        appendRing(json, footprint.holes[h]);
+    }
+    json += "]}}";
+    return json;
+}
+
+template<class ELEV>
+bool BuildingFootprints::writeGeoJSON(const char *fileName, OrthoImage<unsigned char> &classImage,
+                                      OrthoImage<ELEV> &dsmImage, OrthoImage<ELEV> &dtmImage,
+                                      double simplifyMeters, unsigned int numThreads,
+                                      const FootprintWindow *window) {
+    ScopedTimer timer("writeFootprints");
+    OrthoImage<unsigned int> regionImage;
+    unsigned long numRegions = labelBuildings(classImage, regionImage, numThreads);
+
+    // Accumulate bounds and height statistics for every building in one sweep.
+    BuildingStats empty = {LONG_MAX, 0, LONG_MAX, 0, 0, 0, 0.0, DBL_MAX, -DBL_MAX, 0, 0.0, -DBL_MAX, 0, 0.0};
+    std::vector<BuildingStats> stats(numRegions + 1, empty);
+    bool heights = (dsmImage.width == classImage.width) && (dsmImage.height == classImage.height) &&
+                   (dtmImage.width == classImage.width) && (dtmImage.height == classImage.height);
+    for (unsigned int j = 0; j < regionImage.height; j++) {
+        for (unsigned int i = 0; i < regionImage.width; i++) {
+            unsigned int label = regionImage.data[j][i];
+            if (label == 0) continue;
+            BuildingStats &s = stats[label];
+            s.xmin = MIN(s.xmin, (long) i);
+            s.xmax = MAX(s.xmax, (long) i);
+            s.ymin = MIN(s.ymin, (long) j);
+            s.ymax = MAX(s.ymax, (long) j);
+            s.count++;
+            if (!heights) continue;
+            ELEV dsm = dsmImage.data[j][i];
+            ELEV dtm = dtmImage.data[j][i];
+            double roof = dsm * dsmImage.scale + dsmImage.offset;
+            double ground = dtm * dtmImage.scale + dtmImage.offset;
+            if (dsm != 0) {
+                s.roofCount++;
+                s.roofSum += roof;
+                s.roofMax = MAX(s.roofMax, roof);
+            }
+            if (dtm != 0) {
+                s.groundCount++;
+                s.groundSum += ground;
+            }
+            if ((dsm != 0) && (dtm != 0)) {
+                double height = roof - ground;
+                s.heightCount++;
+                s.heightSum += height;
+                s.heightMin = MIN(s.heightMin, height);
+                s.heightMax = MAX(s.heightMax, height);
+            }
+        }
+    }
+
+    // Write the collection header. Coordinates are UTM, named by EPSG code.
+    FILE *fptr = fopen(fileName, "w");
+    if (!fptr) return false;
+    int epsg = (regionImage.zone >= 0) ? 32600 + regionImage.zone : 32700 - regionImage.zone;
+    fprintf(fptr, "{\"type\":\"FeatureCollection\",\n");
+    fprintf(fptr, "\"crs\":{\"type\":\"name\",\"properties\":{\"name\":\"urn:ogc:def:crs:EPSG::%d\"}},\n", epsg);
+    fprintf(fptr, "\"features\":[\n");
+
+    // Trace buildings in parallel batches, writing each batch in label order.
+    // Buildings outside the window are skipped.
+    std::vector<std::string> features;
+    unsigned long numWritten = 0;
+    for (unsigned long batchStart = 1; batchStart <= numRegions; batchStart += FOOTPRINT_BATCH_SIZE) {
+        long batchSize = (long) MIN((unsigned long) FOOTPRINT_BATCH_SIZE, numRegions + 1 - batchStart);
+        features.assign(batchSize, std::string());
+        pubgeo::parallelFor(batchSize, numThreads, [&](long k, unsigned int) {
+            unsigned int label = (unsigned int) (batchStart + k);
+            const BuildingStats &s = stats[label];
+            if (window && ((s.xmin < window->xmin) || (s.xmin > window->xmax) || (s.ymin < window->ymin) ||
+                           (s.ymin > window->ymax)))
+                return;
+            Footprint footprint;
+            makeFootprint(regionImage, label, s, simplifyMeters, footprint);
+            features[k] = formatFeature(footprint);
+        });
+        for (long k = 0; k < batchSize; k++) {
+            if (features[k].empty()) continue;
+            fprintf(fptr, "%s%s", (numWritten > 0) ? ",\n" : "", features[k].c_str());
+            numWritten++;
+        }
+    }
+    fprintf(fptr, "%s]}\n", (numWritten > 0) ? "\n" : "");
+    bool ok = !ferror(fptr);
+    ok &= (fclose(fptr) == 0);
+    printf("Wrote %lu building footprints to %s\n", numWritten, fileName);
+    return ok;
+}
+
+// Instantiate for each supported elevation type.
+template bool BuildingFootprints::writeGeoJSON<unsigned short>(const char *, OrthoImage<unsigned char> &,
+                                                               OrthoImage<unsigned short> &,
+                                                               OrthoImage<unsigned short> &, double, unsigned int,
+                                                               const FootprintWindow *);
+template bool BuildingFootprints::writeGeoJSON<float>(const char *, OrthoImage<unsigned char> &,
+                                                      OrthoImage<float> &, OrthoImage<float> &, double,
+                                                      unsigned int, const FootprintWindow *);
@@ -0,0 +1,67 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// footprints.h
+//
+
+#ifndef PUBGEO_SHR3D_FOOTPRINTS_H
+#define PUBGEO_SHR3D_FOOTPRINTS_H
+
+#include <string>
+#include <vector>
+#include "shr3d.h"
+
+namespace shr3d {
+    // A closed ring of map coordinates. The first point is not repeated at the end.
+    typedef std::vector<std::pair<double, double> > FootprintRing;
+
+    // Outline and statistics for one building. Heights are meters above the DTM.
+    typedef struct {
+        unsigned long id;
+        long pixels;
+        double area;
+        double heightMin;
+        double heightMean;
+        double heightMax;
+        double roofMean;                    // Mean DSM elevation
+        double roofMax;
+        double groundMean;                  // Mean DTM elevation
+        FootprintRing outer;                // Counterclockwise
+        std::vector<FootprintRing> holes;   // Clockwise
+    } Footprint;
+
+    // Inclusive range of class image pixels (rows from the top) that the upper left corner of a building's
+    // bounding box must fall in for the building to be written. Tiles use it so each building is written once.
+    typedef struct {
+        long xmin;
+        long ymin;
+        long xmax;
+        long ymax;
+    } FootprintWindow;
+
+//
+// Vector building footprints traced from the LAS_BUILDING regions of a class image.
+// Regions are 4-connected. They are labeled in parallel strips that are stitched at their seams, then each region's
+// pixel boundary is traced, simplified, and written as a GeoJSON feature. Features are written in batches as they
+// are completed, so only one batch of outlines is in memory at a time.
+//
+    class BuildingFootprints {
+    public:
+        // Write footprints to a GeoJSON file in the UTM coordinates of the images.
+        // Outlines are simplified with Douglas-Peucker using the given tolerance; zero keeps every corner.
+        // Elevations may be 16-bit quantized or float32, as in the pipeline.
+        // If a window is given, only buildings whose bounding box starts within it are written.
+        template<class ELEV>
+        static bool writeGeoJSON(const char *fileName, OrthoImage<unsigned char> &classImage,
+                                 OrthoImage<ELEV> &dsmImage, OrthoImage<ELEV> &dtmImage,
+                                 double simplifyMeters, unsigned int numThreads = 0,
+                                 const FootprintWindow *window = NULL);
+
+        // Label 4-connected LAS_BUILDING regions from 1 to the number of regions, which is returned.
+        // Other pixels are labeled zero.
+        static unsigned long labelBuildings(OrthoImage<unsigned char> &classImage,
+                                            OrthoImage<unsigned int> &regionImage, unsigned int numThreads = 0);
+    };
+}
+
+#endif // PUBGEO_SHR3D_FOOTPRINTS_H
@@ -2,26 +2,246 @@
 // Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
 
 #include <cstdio>
-#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
 #include "orthoimage.h"
-#include "shr3d.h"
+#include "pipeline.h"
+#include "tiles.h"
+#include "footprints.h"
+#include "WorkQueue.h"
+#include "FileList.h"
+#include "Profiler.h"
+
+// Rough peak memory per byte of input file, used to bound concurrent files in batch mode.
+#define BATCH_MEMORY_PER_INPUT_BYTE 5
 
 // Print command line arguments.
 void printArguments() {
     printf("Command line arguments: <Input File (LAS|TIF)> <Options>\n");
+    printf("  The input may also be a glob pattern in quotes or a .txt file listing one input per line.\n");
     printf("Required Options:\n");
     printf("  DH=    horizontal uncertainty (meters)\n");
     printf("  DZ=    vertical uncertainty (meters)\n");
     printf("  AGL=   minimum building height above ground level (meters)\n");
     printf("Options:\n");
     printf("  AREA=	 minimum building area (meters)\n");
+    printf("  NARROW=  radius (pixels) of the opening that removes narrow objects; default = 1, 0 = none\n");
     printf("  EGM96  set this flag to write vertical datum = EGM96\n");
+    printf("  THREADS= number of files to process at once; default = 1, 0 = all cores\n");
+    printf("  MEMORY=  memory budget for files processed at once (MB); default = unlimited\n");
+    printf("  AGLS=    sweep: comma separated AGL values (meters), classified from one ground model\n");
+    printf("           (the median filter while reading points still uses AGL=)\n");
+    printf("  AREAS=   sweep: comma separated minimum building areas (meters)\n");
+    printf("  PROFILE= write stage timing and memory use to this JSON file\n");
+    printf("  CACHE=   directory for cached intermediate rasters, so re-runs with new thresholds resume\n");
+    printf("           from the deepest stage that does not depend on them\n");
+    printf("  FOOTPRINTS write building outlines and heights to a GeoJSON file\n");
+    printf("  SIMPLIFY= footprint simplification tolerance (meters); default = one pixel, 0 = none\n");
+    printf("  FLOAT32  classify with float32 elevations for full precision, at twice the memory\n");
+    printf("           (point clouds whose relief would make the 16-bit step coarse use float32 regardless)\n");
+    printf("Tiled Options (point clouds only):\n");
+    printf("  TILE=    classify in tiles of this width (meters) and mosaic the results\n");
+    printf("  BUFFER=  overlap classified around each tile and then cropped (meters); default = 100\n");
+    printf("  OUT=     prefix for tile and mosaic file names; default = shr3d\n");
+    printf("  COG      also write each mosaic as a Cloud Optimized GeoTIFF\n");
+    printf("  FOOTPRINTS write footprints for each tile and one file for the mosaic; buildings wider than\n");
+    printf("           the buffer are cut at its edge\n");
+    printf("  FLOAT32, CACHE=, AGLS= and AREAS= are not supported with TILE=\n");
+    printf("  THREADS= number of tiles to process at once\n");
+    printf("  MEMORY=  memory budget for tiles processed at once (MB); default = unlimited\n");
     printf("Examples:\n");
     printf("  For EO DSM:    shr3d dsm.tif DH=5.0 DZ=1.0 AGL=2 AREA=50.0 EGM96\n");
     printf("  For lidar DSM: shr3d dsm.tif DH=1.0 DZ=1.0 AGL=2.0 AREA=50.0\n");
     printf("  For lidar LAS: shr3d pts.las DH=1.0 DZ=1.0 AGL=2.0 AREA=50.0\n");
+    printf("  For many LAS:  shr3d \"tiles/*.las\" DH=1.0 DZ=1.0 AGL=2.0 AREA=50.0 THREADS=8 MEMORY=32000\n");
+    printf("  For a city:    shr3d \"tiles/*.las\" DH=1.0 DZ=1.0 AGL=2.0 AREA=50.0 TILE=1000 BUFFER=100 OUT=city COG\n");
+}
+
+// Options that apply to every input file.
+typedef struct {
+    bool egm96;
+    bool convert;
+    const char *cacheDirectory;
+    std::vector<double> sweepAGL;      // If either list is given, sweep all combinations of AGL and area.
+    std::vector<double> sweepArea;
+    unsigned int sweepThreads;         // Also used to trace footprints.
+    bool footprints;
+    double simplifyMeters;             // Negative for one pixel.
+    bool float32;                      // Classify with float32 elevations instead of 16-bit quantized values.
+} FileOptions;
+
+// Parse a comma separated list of values.
+void parseList(const char *text, std::vector<double> &values) {
+    while (*text) {
+        char *end;
+        double value = strtod(text, &end);
+        if (end == text) break;
+        values.push_back(value);
+        text = (*end == ',') ? end + 1 : end;
+    }
 }
 
+// Estimate the peak memory needed to process a file from its size.
+unsigned long long estimateMemory(const char *fileName) {
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    if (!file) return 0;
+    return (unsigned long long) file.tellg() * BATCH_MEMORY_PER_INPUT_BYTE;
+}
+
+// Check whether a point cloud spans too much elevation to classify with 16-bit elevations.
+// Only the header is read. GeoTIFF DSMs are classified as they are stored.
+bool pointCloudNeedsFloat32(const char *fileName, const shr3d::Shr3dParameters &params) {
+    size_t len = strlen(fileName);
+    if ((len < 3) || ((strcmp(&fileName[len - 3], "las") != 0) && (strcmp(&fileName[len - 3], "bpf") != 0)))
+        return false;
+    pubgeo::MinMaxXYZ bounds;
+    int zone = 0;
+    if (!pubgeo::PointCloud::ReadBounds(fileName, bounds, zone)) return false;
+    if (!shr3d::needsFloat32(bounds.zMin, bounds.zMax, params.dzMeters)) return false;
+    printf("%s spans %.1f meters of elevation; classifying it with float32 elevations.\n", fileName,
+           bounds.zMax - bounds.zMin);
+    return true;
+}
+
+// Report total elapsed time and, if requested, the time and memory used by each stage.
+void reportTime(std::chrono::steady_clock::time_point start, const char *profileFileName) {
+    if (profileFileName) pubgeo::Profiler::end();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("Total time elapsed = %f seconds\n", seconds);
+    if (profileFileName) {
+        pubgeo::Profiler::printSummary();
+        if (pubgeo::Profiler::writeJSON(profileFileName)) printf("Wrote profile %s\n", profileFileName);
+        else printf("Error: Failed to write %s\n", profileFileName);
+    }
+}
+
+// Classify one input file and write its products, with elevations of type ELEV.
+template<class ELEV>
+bool processFile(const char *fileName, const shr3d::Shr3dParameters &params, const FileOptions &options) {
+    pubgeo::ScopedTimer timer("processFile");
+    char inputFileName[1024];
+    snprintf(inputFileName, sizeof(inputFileName), "%s", fileName);
+
+    // If specified, then convert to GDAL TIFF.
+    // Name the temporary file after the input so files processed at once do not collide.
+    char readFileName[1024];
+    strcpy(readFileName, inputFileName);
+    if (options.convert) {
+        char cmd[4096];
+        sprintf(readFileName, "%s_temp.tif", inputFileName);
+        sprintf(cmd, ".\\gdal\\gdal_translate %s %s\n", inputFileName, readFileName);
+        system(cmd);
+    }
+
+    // Set up the pipeline.
+    shr3d::BasicShr3dPipeline<ELEV> pipeline(params);
+    if (options.cacheDirectory) pipeline.cache.directory = options.cacheDirectory;
+#ifdef DEBUG
+    pipeline.hook = [&inputFileName](shr3d::Shr3dStage stage, shr3d::BasicShr3dPipeline<ELEV> &p) {
+        char debugOutFileName[1024];
+        if (stage == shr3d::STAGE_MIN) {
+            // Write the MIN image as FLOAT.
+            sprintf(debugOutFileName, "%s_MIN.tif", inputFileName);
+            p.dtmImage.write(debugOutFileName, true);
+        } else if (stage == shr3d::STAGE_TREES) {
+            // Write the DSM2 image as FLOAT.
+            sprintf(debugOutFileName, "%s_DSM2.tif", inputFileName);
+            p.voidedImage.write(debugOutFileName, true);
+        }
+    };
+#endif
+
+    // Read DSM as SHORT or FLOAT.
+    // Input can be GeoTIFF or LAS.
+    printf("Reading DSM as %s.\n", shr3d::OrthoImage<ELEV>::isFloatingPoint() ? "FLOAT" : "SHORT");
+    int len = (int) strlen(inputFileName);
+    char *ext = &inputFileName[len - 3];
+    printf("File Type = .%s\n", ext);
+    bool writeDSM = false;
+    if (strcmp(ext, "tif") == 0) {
+        bool ok = pipeline.readDSM(readFileName);
+        if (!ok) return false;
+    } else if ((strcmp(ext, "las") == 0) || (strcmp(ext, "bpf") == 0)) {
+        bool ok = pipeline.readPointCloud(inputFileName);
+        if (!ok) return false;
+        writeDSM = true;
+    } else {
+        printf("Error: Unrecognized file type.");
+        return false;
+    }
+
+    // Classify ground, buildings, and trees.
+    // For a sweep, write class and building images, and any footprints, for each combination of AGL and area.
+    // Combinations are already classified in parallel, so each traces its footprints on one thread.
+    bool egm96 = options.egm96;
+    bool sweep = !options.sweepAGL.empty() || !options.sweepArea.empty();
+    std::atomic<bool> sweepOK(true);
+    if (sweep) {
+        std::vector<double> aglList = options.sweepAGL;
+        std::vector<double> areaList = options.sweepArea;
+        if (aglList.empty()) aglList.push_back(params.aglMeters);
+        if (areaList.empty()) areaList.push_back(params.minAreaMeters);
+        pipeline.classifySweep(aglList, areaList, options.sweepThreads,
+                               [&](double agl, double area, shr3d::OrthoImage<unsigned char> &classImage) {
+                                   char outFileName[1024];
+                                   sprintf(outFileName, "%s_AGL%g_AREA%g_class.tif", inputFileName, agl, area);
+                                   bool ok = classImage.write(outFileName, false, egm96);
+                                   shr3d::OrthoImage<unsigned char> buildingImage;
+                                   shr3d::Shr3dPipeline::getBuildingImage(classImage, buildingImage);
+                                   sprintf(outFileName, "%s_AGL%g_AREA%g_buildings.tif", inputFileName, agl, area);
+                                   ok &= buildingImage.write(outFileName, false, egm96);
+                                   if (options.footprints) {
+                                       sprintf(outFileName, "%s_AGL%g_AREA%g_buildings.geojson", inputFileName,
+                                               agl, area);
+                                       double simplifyMeters = (options.simplifyMeters < 0.0) ? classImage.gsd
+                                                                                              : options.simplifyMeters;
+                                       ok &= shr3d::BuildingFootprints::writeGeoJSON(outFileName, classImage,
+                                                                                     pipeline.dsmImage,
+                                                                                     pipeline.dtmImage,
+                                                                                     simplifyMeters, 1);
+                                   }
+                                   if (!ok) sweepOK = false;
+                               });
+    } else {
+        pipeline.classify();
+    }
+
+    // Write the DSM image as FLOAT.
+    bool ok = sweepOK;
+    if (writeDSM) {
+        char dsmOutFileName[1024];
+        sprintf(dsmOutFileName, "%s_DSM.tif", inputFileName);
+        ok &= pipeline.dsmImage.write(dsmOutFileName, true);
+    }
+
+    // Write the DTM image as FLOAT.
+    char dtmOutFileName[1024];
+    sprintf(dtmOutFileName, "%s_DTM.tif", inputFileName);
+    ok &= pipeline.dtmImage.write(dtmOutFileName, true, egm96);
+    if (sweep) return ok;
+
+    // Write the classification image.
+    char classOutFileName[1024];
+    sprintf(classOutFileName, "%s_class.tif", inputFileName);
+    ok &= pipeline.classImage.write(classOutFileName, false, egm96);
+    shr3d::OrthoImage<unsigned char> buildingImage;
+    pipeline.getBuildingImage(buildingImage);
+    sprintf(classOutFileName, "%s_buildings.tif", inputFileName);
+    ok &= buildingImage.write(classOutFileName, false, egm96);
+
+    // Write building footprints.
+    if (options.footprints) {
+        char footprintFileName[1024];
+        sprintf(footprintFileName, "%s_buildings.geojson", inputFileName);
+        double simplifyMeters = (options.simplifyMeters < 0.0) ? pipeline.classImage.gsd : options.simplifyMeters;
+        ok &= shr3d::BuildingFootprints::writeGeoJSON(footprintFileName, pipeline.classImage, pipeline.dsmImage,
+                                                      pipeline.dtmImage, simplifyMeters, options.sweepThreads);
+    }
+    return ok;
+}
 
 // Main program for bare earth classification.
 int main(int argc, char **argv) {
@@ -36,22 +256,47 @@ int main(int argc, char **argv) {
     }
 
     // Get command line arguments and confirm they are valid.
-    double gsd_meters = 0.0;
     double dh_meters = 0.0;
     double dz_meters = 0.0;
     double agl_meters = 0.0;
     double min_area_meters = 50.0;
+    int narrow_radius = 1;
     bool egm96 = false;
     bool convert = false;
-    char inputFileName[1024];
-    sprintf(inputFileName, argv[1]);
+    unsigned int threads = 1;
+    double memory_mb = 0.0;
+    double tile_meters = 0.0;
+    double buffer_meters = 100.0;
+    bool cog = false;
+    const char *outputPrefix = "shr3d";
+    const char *profileFileName = nullptr;
+    const char *cacheDirectory = nullptr;
+    std::vector<double> sweepAGL;
+    std::vector<double> sweepArea;
+    bool footprints = false;
+    double simplify_meters = -1.0;
+    bool float32 = false;
     for (int i = 2; i < argc; i++) {
         if (strstr(argv[i], "DH=")) { dh_meters = atof(&(argv[i][3])); }
         if (strstr(argv[i], "DZ=")) { dz_meters = atof(&(argv[i][3])); }
         if (strstr(argv[i], "AGL=")) { agl_meters = atof(&(argv[i][4])); }
         if (strstr(argv[i], "AREA=")) { min_area_meters = atof(&(argv[i][5])); }
+        if (strstr(argv[i], "NARROW=")) { narrow_radius = atoi(&(argv[i][7])); }
         if (strstr(argv[i], "EGM96")) { egm96 = true; }
         if (strstr(argv[i], "CONVERT")) { convert = true; }
+        if (strstr(argv[i], "THREADS=")) { threads = (unsigned int) atoi(&(argv[i][8])); }
+        if (strstr(argv[i], "MEMORY=")) { memory_mb = atof(&(argv[i][7])); }
+        if (strstr(argv[i], "TILE=")) { tile_meters = atof(&(argv[i][5])); }
+        if (strstr(argv[i], "BUFFER=")) { buffer_meters = atof(&(argv[i][7])); }
+        if (strstr(argv[i], "OUT=")) { outputPrefix = &(argv[i][4]); }
+        if (strstr(argv[i], "COG")) { cog = true; }
+        if (strstr(argv[i], "PROFILE=")) { profileFileName = &(argv[i][8]); }
+        if (strstr(argv[i], "CACHE=")) { cacheDirectory = &(argv[i][6]); }
+        if (strstr(argv[i], "AGLS=")) { parseList(&(argv[i][5]), sweepAGL); }
+        if (strstr(argv[i], "AREAS=")) { parseList(&(argv[i][6]), sweepArea); }
+        if (strstr(argv[i], "FOOTPRINTS")) { footprints = true; }
+        if (strstr(argv[i], "SIMPLIFY=")) { simplify_meters = atof(&(argv[i][9])); }
+        if (strstr(argv[i], "FLOAT32")) { float32 = true; }
     }
     if ((dh_meters == 0.0) || (dz_meters == 0.0) || (agl_meters == 0.0)) {
         printf("DH_METERS = %f\n", dh_meters);
@@ -61,204 +306,102 @@ int main(int argc, char **argv) {
         printArguments();
         return -1;
     }
-
-    // Initialize the timer.
-    time_t t0;
-    time(&t0);
-
-    // If specified, then convert to GDAL TIFF.
-    char readFileName[1024];
-    strcpy(readFileName, inputFileName);
-    if (convert) {
-        char cmd[4096];
-        sprintf(readFileName, "temp.tif\0");
-        sprintf(cmd, ".\\gdal\\gdal_translate %s temp.tif\n", inputFileName);
-        system(cmd);
-    }
-
-    // Read DSM as SHORT.
-    // Input can be GeoTIFF or LAS.
-    shr3d::OrthoImage<unsigned short> dsmImage;
-    shr3d::OrthoImage<unsigned short> minImage;
-    printf("Reading DSM as SHORT.\n");
-    int len = (int) strlen(inputFileName);
-    char *ext = &inputFileName[len - 3];
-    printf("File Type = .%s\n", ext);
-    if (strcmp(ext, "tif") == 0) {
-        bool ok = dsmImage.read(readFileName);
-        if (!ok) return -1;
-    } else if ((strcmp(ext, "las") == 0) || (strcmp(ext, "bpf") == 0)) {
-        // First get the max Z values for the DSM.
-        bool ok = dsmImage.readFromPointCloud(inputFileName, (float) dh_meters, shr3d::MAX_VALUE);
-        if (!ok) return -1;
-
-        // Median filter, replacing only points differing by more than the AGL threshold.
-        dsmImage.medianFilter(1, (unsigned int) (agl_meters / dsmImage.scale));
-
-        // Fill small voids in the DSM.
-        dsmImage.fillVoidsPyramid(true, 2);
-
-        // Write the DSM image as FLOAT.
-        char dsmOutFileName[1024];
-        sprintf(dsmOutFileName, "%s_DSM.tif\0", inputFileName);
-        dsmImage.write(dsmOutFileName, true);
-
-        // Now get the minimum Z values for the DTM.
-        ok = minImage.readFromPointCloud(inputFileName, (float) dh_meters, shr3d::MIN_VALUE);
-        if (!ok) return -1;
-
-        // Median filter, replacing only points differing by more than the AGL threshold.
-        minImage.medianFilter(1, (unsigned int) (agl_meters / minImage.scale));
-
-        // Fill small voids in the DSM.
-        minImage.fillVoidsPyramid(true, 2);
-#ifdef DEBUG
-        // Write the MIN image as FLOAT.
-        char minOutFileName[1024];
-        sprintf(minOutFileName, "%s_MIN.tif\0", inputFileName);
-        minImage.write(minOutFileName, true);
-#endif
-        // Find many of the trees by comparing MIN and MAX. Set their values to void.
-        for (unsigned int j = 0; j < dsmImage.height; j++) {
-            for (unsigned int i = 0; i < dsmImage.width; i++) {
-                float minValue = (float) minImage.data[j][i];
-
-                // This check is to avoid penalizing spurious returns under very tall buildings.
-                // CAUTION: This is a hack to address an observed lidar sensor issue and may not generalize well.
-                if (((float) dsmImage.data[j][i] - minValue) < (40.0 / minImage.scale)) {
-                    // If this is in the trees, then set to void.
-                    bool found = false;
-                    double threshold = dz_meters / dsmImage.scale;
-                    unsigned int i1 = MAX(0, i - 1);
-                    unsigned int i2 = MIN(i + 1, dsmImage.width - 1);
-                    unsigned int j1 = MAX(0, j - 1);
-                    unsigned int j2 = MIN(j + 1, dsmImage.height - 1);
-                    for (unsigned int jj = j1; jj <= j2; jj++) {
-                        for (unsigned int ii = i1; ii <= i2; ii++) {
-                            float diff = (float) dsmImage.data[jj][ii] - minValue;
-                            if (diff < threshold) found = true;
-                        }
-                    }
-                    if (!found) dsmImage.data[j][i] = 0;
-                }
-            }
-        }
-
-        // Write the DSM2 image as FLOAT.
-#ifdef DEBUG
-        char dsm2OutFileName[1024];
-        sprintf(dsm2OutFileName, "%s_DSM2.tif\0", inputFileName);
-        dsmImage.write(dsm2OutFileName, true);
-#endif
-    } else {
-        printf("Error: Unrecognized file type.");
+    std::vector<std::string> inputFileNames;
+    pubgeo::expandInputs(argv[1], inputFileNames);
+    if (inputFileNames.empty()) {
+        printf("Error: No input files found for %s.\n", argv[1]);
         return -1;
     }
 
-    // Convert horizontal and vertical uncertainty values to bin units.
-    int dh_bins = MAX(1, (int) floor(dh_meters / dsmImage.gsd));
-    printf("DZ_METERS = %f\n", dz_meters);
-    printf("DH_METERS = %f\n", dh_meters);
-    printf("DH_BINS = %d\n", dh_bins);
-    unsigned int dz_short = (unsigned int) (dz_meters / dsmImage.scale);
-    printf("DZ_SHORT = %d\n", dz_short);
-    printf("AGL_METERS = %f\n", agl_meters);
-    unsigned int agl_short = (unsigned int) (agl_meters / dsmImage.scale);
-    printf("AGL_SHORT = %d\n", agl_short);
-    printf("AREA_METERS = %f\n", min_area_meters);
-
-    // Generate label image.
-    shr3d::OrthoImage<unsigned long> labelImage;
-    labelImage.Allocate(dsmImage.width, dsmImage.height);
-    labelImage.easting = dsmImage.easting;
-    labelImage.northing = dsmImage.northing;
-    labelImage.zone = dsmImage.zone;
-    labelImage.gsd = dsmImage.gsd;
-
-    // Allocate a DTM image as SHORT and copy in the DSM values.
-    shr3d::OrthoImage<unsigned short> dtmImage;
-    dtmImage.Allocate(dsmImage.width, dsmImage.height);
-    dtmImage.easting = dsmImage.easting;
-    dtmImage.northing = dsmImage.northing;
-    dtmImage.zone = dsmImage.zone;
-    dtmImage.gsd = dsmImage.gsd;
-    dtmImage.scale = dsmImage.scale;
-    dtmImage.offset = dsmImage.offset;
-    dtmImage.bands = dsmImage.bands;
-    for (unsigned int j = 0; j < dsmImage.height; j++) {
-        for (unsigned int i = 0; i < dsmImage.width; i++) {
-            dtmImage.data[j][i] = minImage.data[j][i];
-        }
+    // Initialize the timer and, if requested, the profiler.
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    if (profileFileName) {
+        pubgeo::Profiler::enable();
+        pubgeo::Profiler::begin("shr3d");
     }
 
-    // Classify ground points.
-    shr3d::Shr3dder::classifyGround(labelImage, dsmImage, dtmImage, dh_bins, dz_short);
-
-    // For DSM voids, also set DTM value to void.
-    printf("Setting DTM values to VOID where DSM is VOID...\n");
-    for (unsigned int j = 0; j < dsmImage.height; j++) {
-        for (unsigned int i = 0; i < dsmImage.width; i++) {
-            if (dsmImage.data[j][i] == 0) dtmImage.data[j][i] = 0;
+    // Set up the pipeline parameters shared by all files.
+    shr3d::Shr3dParameters params = shr3d::Shr3dPipeline::defaultParameters();
+    params.dhMeters = dh_meters;
+    params.dzMeters = dz_meters;
+    params.aglMeters = agl_meters;
+    params.minAreaMeters = min_area_meters;
+    params.narrowRadius = (unsigned int) MAX(0, narrow_radius);
+
+    // In tiled mode, classify the extent of all inputs one tile at a time.
+    if (tile_meters > 0.0) {
+        if (float32 || cacheDirectory || !sweepAGL.empty() || !sweepArea.empty()) {
+            printf("Error: FLOAT32, CACHE=, AGLS= and AREAS= are not supported with TILE=.\n");
+            return -1;
         }
-    }
-
-    // Median filter, replacing only points differing by more than the DZ threshold.
-    dtmImage.medianFilter(1, (unsigned int) (dz_meters / dsmImage.scale));
-
-    // Refine the object label image and export building outlines.
-    shr3d::Shr3dder::classifyNonGround(dsmImage, dtmImage, labelImage, dz_short, agl_short, (float) min_area_meters);
-
-    // Fill small voids in the DTM after all processing is complete.
-    dtmImage.fillVoidsPyramid(true, 2);
-
-    // Write the DTM image as FLOAT.
-    char dtmOutFileName[1024];
-    sprintf(dtmOutFileName, "%s_DTM.tif\0", inputFileName);
-    dtmImage.write(dtmOutFileName, true, egm96);
-
-    // Produce a classification raster image with LAS standard point classes.
-    shr3d::OrthoImage<unsigned char> classImage;
-    classImage.Allocate(labelImage.width, labelImage.height);
-    classImage.easting = dsmImage.easting;
-    classImage.northing = dsmImage.northing;
-    classImage.zone = dsmImage.zone;
-    classImage.gsd = dsmImage.gsd;
-    for (unsigned int j = 0; j < classImage.height; j++) {
-        for (unsigned int i = 0; i < classImage.width; i++) {
-            // Set default as unlabeled.
-            classImage.data[j][i] = LAS_UNCLASSIFIED;
-
-            // Label trees.
-            if ((dsmImage.data[j][i] == 0) ||
-                (fabs((float) dsmImage.data[j][i] - (float) dtmImage.data[j][i]) > agl_short))
-                classImage.data[j][i] = LAS_TREE;
-
-            // Label buildings.
-            if (labelImage.data[j][i] == 1) classImage.data[j][i] = LAS_BUILDING;
-
-            // Label ground.
-            if (fabs((float) dsmImage.data[j][i] - (float) dtmImage.data[j][i]) < dz_short)
-                classImage.data[j][i] = LAS_GROUND;
+        shr3d::Shr3dTileParameters tileParams;
+        tileParams.tileMeters = tile_meters;
+        tileParams.bufferMeters = buffer_meters;
+        tileParams.numThreads = threads;
+        tileParams.memoryMB = memory_mb;
+        tileParams.egm96 = egm96;
+        tileParams.cog = cog;
+        tileParams.footprints = footprints;
+        tileParams.simplifyMeters = simplify_meters;
+        shr3d::Shr3dTiler tiler(params, tileParams);
+        for (size_t k = 0; k < inputFileNames.size(); k++) {
+            if (!tiler.addInput(inputFileNames[k].c_str())) {
+                printf("Error: Unable to read point cloud header from %s.\n", inputFileNames[k].c_str());
+                return -1;
+            }
         }
+        bool ok = tiler.run(outputPrefix);
+        reportTime(t0, profileFileName);
+        return ok ? 0 : -1;
     }
 
-    // Fill missing labels inside building regions.
-    shr3d::Shr3dder::fillInsideBuildings(classImage);
-
-    // Write the classification image.
-    char classOutFileName[1024];
-    sprintf(classOutFileName, "%s_class.tif\0", inputFileName);
-    classImage.write(classOutFileName, false, egm96);
-    for (unsigned int j = 0; j < classImage.height; j++) {
-        for (unsigned int i = 0; i < classImage.width; i++) {
-            if (classImage.data[j][i] != LAS_BUILDING) classImage.data[j][i] = 0;
+    // Process all files with a pool of workers.
+    // Each file reserves its estimated memory from the budget before it starts.
+    // Parameter sweeps use the workers for their combinations when there is only one file.
+    long numFiles = (long) inputFileNames.size();
+    FileOptions options;
+    options.egm96 = egm96;
+    options.convert = convert;
+    options.cacheDirectory = cacheDirectory;
+    options.sweepAGL = sweepAGL;
+    options.sweepArea = sweepArea;
+    options.sweepThreads = (numFiles == 1) ? threads : 1;
+    options.footprints = footprints;
+    options.simplifyMeters = simplify_meters;
+    options.float32 = float32;
+    std::vector<char> status(numFiles, 0);
+    std::vector<double> seconds(numFiles, 0.0);
+    pubgeo::MemoryBudget budget((unsigned long long) (memory_mb * 1024.0 * 1024.0));
+    pubgeo::parallelFor(numFiles, threads, [&](long k, unsigned int) {
+        const char *fileName = inputFileNames[k].c_str();
+        unsigned long long reserved = budget.acquire(estimateMemory(fileName));
+        auto start = std::chrono::steady_clock::now();
+        bool ok = false;
+        try {
+            bool float32 = options.float32 || pointCloudNeedsFloat32(fileName, params);
+            ok = float32 ? processFile<float>(fileName, params, options)
+                         : processFile<unsigned short>(fileName, params, options);
+        } catch (std::exception &e) {
+            printf("Error processing %s: %s\n", fileName, e.what());
+        } catch (char const *err) {
+            printf("Error processing %s: %s\n", fileName, err);
+        }
+        seconds[k] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        status[k] = ok ? 1 : 0;
+        budget.release(reserved);
+    });
+
+    // Report the status of each file.
+    long numFailed = 0;
+    if (numFiles > 1) printf("Batch status:\n");
+    for (long k = 0; k < numFiles; k++) {
+        if (!status[k]) numFailed++;
+        if (numFiles > 1) {
+            printf("  %-6s %8.1f s  %s\n", status[k] ? "OK" : "FAILED", seconds[k], inputFileNames[k].c_str());
         }
     }
-    sprintf(classOutFileName, "%s_buildings.tif\0", inputFileName);
-    classImage.write(classOutFileName, false, egm96);
+    if (numFiles > 1) printf("Processed %ld files, %ld failed.\n", numFiles, numFailed);
 
-    // Report total elapsed time.
-    time_t t1;
-    time(&t1);
-    printf("Total time elapsed = %f seconds\n", double(t1 - t0));
+    reportTime(t0, profileFileName);
+    return (numFailed == 0) ? 0 : -1;
 }
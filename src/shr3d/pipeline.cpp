@@ -0,0 +1,385 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// pipeline.cpp
+//
+
+#include <stdio.h>
+#include <math.h>
+#include "pipeline.h"
+#include "WorkQueue.h"
+
+using namespace shr3d;
+
+// Change this when a change to the algorithm changes cached rasters.
+#define SHR3D_CACHE_VERSION 1
+
+// Largest 16-bit elevation step, as a fraction of DZ, before float32 elevations are preferred.
+#define SHR3D_MAX_STEP_FRACTION 0.02
+
+// Allocate an image with the same size and geospatial metadata as another.
+template<class TYPE, class SOURCE>
+static void allocateLike(OrthoImage<TYPE> &image, OrthoImage<SOURCE> &source) {
+    image.Allocate(source.width, source.height);
+    image.easting = source.easting;
+    image.northing = source.northing;
+    image.zone = source.zone;
+    image.gsd = source.gsd;
+}
+
+// Copy an image, including its scale and offset.
+template<class TYPE>
+static void copyImage(OrthoImage<TYPE> &image, OrthoImage<TYPE> &source) {
+    allocateLike(image, source);
+    image.scale = source.scale;
+    image.offset = source.offset;
+    for (unsigned int j = 0; j < source.height; j++) {
+        memcpy(image.data[j], source.data[j], source.width * sizeof(TYPE));
+    }
+}
+
+// Convert a threshold in meters to image units.
+// Thresholds for quantized images are truncated to whole units, as they always have been.
+template<class ELEV>
+static float imageUnits(double meters, OrthoImage<ELEV> &image) {
+    double units = meters / image.scale;
+    return OrthoImage<ELEV>::isFloatingPoint() ? (float) units : (float) (unsigned int) units;
+}
+
+// Produce a classification raster image with LAS standard point classes.
+template<class ELEV>
+static void buildClassImage(OrthoImage<ELEV> &dsmImage, OrthoImage<ELEV> &dtmImage,
+                            OrthoImage<unsigned long> &labelImage, float dzShort, float aglShort,
+                            OrthoImage<unsigned char> &classImage) {
+    allocateLike(classImage, dsmImage);
+    for (unsigned int j = 0; j < classImage.height; j++) {
+        for (unsigned int i = 0; i < classImage.width; i++) {
+            // Set default as unlabeled.
+            classImage.data[j][i] = LAS_UNCLASSIFIED;
+
+            // Label trees.
+            if ((dsmImage.data[j][i] == 0) ||
+                (fabs((float) dsmImage.data[j][i] - (float) dtmImage.data[j][i]) > aglShort))
+                classImage.data[j][i] = LAS_TREE;
+
+            // Label buildings.
+            if (labelImage.data[j][i] == 1) classImage.data[j][i] = LAS_BUILDING;
+
+            // Label ground.
+            if (fabs((float) dsmImage.data[j][i] - (float) dtmImage.data[j][i]) < dzShort)
+                classImage.data[j][i] = LAS_GROUND;
+        }
+    }
+
+    // Fill missing labels inside building regions.
+    Shr3dder::fillInsideBuildings(classImage);
+}
+
+template<class ELEV>
+BasicShr3dPipeline<ELEV>::BasicShr3dPipeline(const Shr3dParameters &parameters)
+        : params(parameters), groundReady(false) {
+}
+
+template<class ELEV>
+Shr3dParameters BasicShr3dPipeline<ELEV>::defaultParameters() {
+    Shr3dParameters parameters;
+    parameters.dhMeters = 0.5;
+    parameters.dzMeters = 0.5;
+    parameters.aglMeters = 2.0;
+    parameters.minAreaMeters = 50.0;
+    parameters.narrowRadius = 1;
+    return parameters;
+}
+
+template<class ELEV>
+void BasicShr3dPipeline<ELEV>::runHook(Shr3dStage stage) {
+    if (hook) hook(stage, *this);
+}
+
+// Describe the input file for cache entries by its contents. Returns an empty string if not caching.
+// Float32 rasters are cached separately from quantized ones.
+template<class ELEV>
+static std::string describeInput(const RasterCache &cache, const char *fileName) {
+    unsigned long long hash = 0;
+    if (!cache.enabled() || !RasterCache::hashFile(fileName, hash)) return std::string();
+    char description[256];
+    sprintf(description, "shr3d-v%d;input=%016llx%s", SHR3D_CACHE_VERSION, hash,
+            OrthoImage<ELEV>::isFloatingPoint() ? ";float32" : "");
+    return description;
+}
+
+template<class ELEV>
+bool BasicShr3dPipeline<ELEV>::loadGround() {
+    if (groundDescription.empty()) return false;
+    groundReady = cache.load(groundDescription, "DSM", dsmImage) &&
+                   cache.load(groundDescription, "voided", voidedImage) &&
+                   cache.load(groundDescription, "DTM", dtmImage) &&
+                   cache.load(groundDescription, "label", labelImage);
+    if (groundReady) printf("Resuming from cached ground classification.\n");
+    return groundReady;
+}
+
+template<class ELEV>
+void BasicShr3dPipeline<ELEV>::storeGround() {
+    if (groundDescription.empty()) return;
+    cache.store(groundDescription, "DSM", dsmImage);
+    cache.store(groundDescription, "voided", voidedImage);
+    cache.store(groundDescription, "DTM", dtmImage);
+    cache.store(groundDescription, "label", labelImage);
+}
+
+template<class ELEV>
+bool BasicShr3dPipeline<ELEV>::readDSM(char *fileName) {
+    // The ground stage depends on the DSM, DH, and DZ.
+    groundReady = false;
+    groundDescription.clear();
+    std::string input = describeInput<ELEV>(cache, fileName);
+    if (!input.empty()) {
+        char description[512];
+        sprintf(description, "%s;dsm;dh=%.9g;dz=%.9g", input.c_str(), params.dhMeters, params.dzMeters);
+        groundDescription = description;
+        if (loadGround()) return true;
+    }
+
+    bool ok = dsmImage.read(fileName);
+    if (!ok) return false;
+    runHook(STAGE_DSM);
+
+    // Without a minimum Z image, start the DTM from the DSM values.
+    copyImage(voidedImage, dsmImage);
+    copyImage(dtmImage, dsmImage);
+    return true;
+}
+
+template<class ELEV>
+bool BasicShr3dPipeline<ELEV>::readPointCloud(char *fileName) {
+    // Rasters depend on the points and DH. The median filter also uses AGL, and tree voiding and ground use DZ.
+    groundReady = false;
+    groundDescription.clear();
+    std::string rasterDescription;
+    std::string input = describeInput<ELEV>(cache, fileName);
+    if (!input.empty()) {
+        char description[512];
+        sprintf(description, "%s;points;dh=%.9g", input.c_str(), params.dhMeters);
+        rasterDescription = description;
+        sprintf(description, "%s;points;dh=%.9g;dz=%.9g;agl=%.9g", input.c_str(), params.dhMeters,
+                params.dzMeters, params.aglMeters);
+        groundDescription = description;
+        if (loadGround()) return true;
+    }
+
+    bool cached = !rasterDescription.empty() && cache.load(rasterDescription, "MAX", dsmImage) &&
+                  cache.load(rasterDescription, "MIN", dtmImage);
+    if (cached) {
+        printf("Resuming from cached point cloud rasters.\n");
+    } else {
+        // First get the max Z values for the DSM.
+        bool ok = dsmImage.readFromPointCloud(fileName, (float) params.dhMeters, MAX_VALUE);
+        if (!ok) return false;
+
+        // Now get the minimum Z values for the DTM.
+        ok = dtmImage.readFromPointCloud(fileName, (float) params.dhMeters, MIN_VALUE);
+        if (!ok) return false;
+        if (!rasterDescription.empty()) {
+            cache.store(rasterDescription, "MAX", dsmImage);
+            cache.store(rasterDescription, "MIN", dtmImage);
+        }
+    }
+
+    filterPointCloudImages();
+    return true;
+}
+
+template<class ELEV>
+bool BasicShr3dPipeline<ELEV>::readPointView(pdal::PointViewPtr view) {
+    groundReady = false;
+    groundDescription.clear();
+    bool ok = dsmImage.readFromPointView(view, (float) params.dhMeters, MAX_VALUE);
+    if (!ok) return false;
+    ok = dtmImage.readFromPointView(view, (float) params.dhMeters, MIN_VALUE);
+    if (!ok) return false;
+    filterPointCloudImages();
+    return true;
+}
+
+template<class ELEV>
+bool BasicShr3dPipeline<ELEV>::readPointGrid(MinMaxGrid &grid, int zone) {
+    groundReady = false;
+    groundDescription.clear();
+    bool ok = dsmImage.readFromGrid(grid, MAX_VALUE, zone);
+    if (!ok) return false;
+    ok = dtmImage.readFromGrid(grid, MIN_VALUE, zone);
+    if (!ok) return false;
+    filterPointCloudImages();
+    return true;
+}
+
+// Filter the DSM and minimum Z images, then remove trees from the DSM used for classification.
+template<class ELEV>
+void BasicShr3dPipeline<ELEV>::filterPointCloudImages() {
+    ScopedTimer timer("filterPointCloudImages");
+    // Median filter, replacing only points differing by more than the AGL threshold.
+    // Then fill small voids.
+    dsmImage.medianFilter(1, imageUnits(params.aglMeters, dsmImage));
+    dsmImage.fillVoidsPyramid(true, 2);
+    runHook(STAGE_DSM);
+    dtmImage.medianFilter(1, imageUnits(params.aglMeters, dtmImage));
+    dtmImage.fillVoidsPyramid(true, 2);
+    runHook(STAGE_MIN);
+
+    // Find many of the trees by comparing MIN and MAX, writing the DSM with trees set to void.
+    // CAUTION: Keeping points 40 meters above MIN is a hack to address an observed lidar sensor issue with
+    // spurious returns under very tall buildings and may not generalize well.
+    Shr3dder::voidTrees(dsmImage, dtmImage, voidedImage, params.dzMeters / dsmImage.scale, 40.0 / dtmImage.scale);
+    runHook(STAGE_TREES);
+}
+
+template<class ELEV>
+void BasicShr3dPipeline<ELEV>::classifyGround() {
+    // Convert horizontal and vertical uncertainty values to bin units.
+    int dhBins = MAX(1, (int) floor(params.dhMeters / voidedImage.gsd));
+    printf("DZ_METERS = %f\n", params.dzMeters);
+    printf("DH_METERS = %f\n", params.dhMeters);
+    printf("DH_BINS = %d\n", dhBins);
+    float dzShort = imageUnits(params.dzMeters, voidedImage);
+    printf("DZ_SHORT = %g\n", dzShort);
+
+    // Classify ground points, unless the ground stage is already complete or was loaded from the cache.
+    if (!groundReady) {
+        // Generate label image.
+        allocateLike(labelImage, voidedImage);
+
+        // The DTM starts from the minimum Z values and shares the DSM geometry.
+        dtmImage.easting = voidedImage.easting;
+        dtmImage.northing = voidedImage.northing;
+        dtmImage.zone = voidedImage.zone;
+        dtmImage.gsd = voidedImage.gsd;
+        dtmImage.scale = voidedImage.scale;
+        dtmImage.offset = voidedImage.offset;
+
+        // Classify ground points.
+        Shr3dder::classifyGround(labelImage, voidedImage, dtmImage, dhBins, dzShort);
+
+        // For DSM voids, also set DTM value to void.
+        printf("Setting DTM values to VOID where DSM is VOID...\n");
+        for (unsigned int j = 0; j < voidedImage.height; j++) {
+            for (unsigned int i = 0; i < voidedImage.width; i++) {
+                if (voidedImage.data[j][i] == 0) dtmImage.data[j][i] = 0;
+            }
+        }
+
+        // Median filter, replacing only points differing by more than the DZ threshold.
+        dtmImage.medianFilter(1, dzShort);
+        runHook(STAGE_GROUND);
+        storeGround();
+        groundReady = true;
+    }
+}
+
+template<class ELEV>
+void BasicShr3dPipeline<ELEV>::classify() {
+    ScopedTimer timer("classify");
+    classifyGround();
+    float dzShort = imageUnits(params.dzMeters, voidedImage);
+    printf("AGL_METERS = %f\n", params.aglMeters);
+    float aglShort = imageUnits(params.aglMeters, voidedImage);
+    printf("AGL_SHORT = %g\n", aglShort);
+    printf("AREA_METERS = %f\n", params.minAreaMeters);
+
+    // Refine the object label image and export building outlines.
+    Shr3dder::classifyNonGround(voidedImage, dtmImage, labelImage, dzShort, aglShort, (float) params.minAreaMeters,
+                                params.narrowRadius);
+    runHook(STAGE_OBJECTS);
+
+    // Fill small voids in the DTM after all processing is complete.
+    dtmImage.fillVoidsPyramid(true, 2);
+    runHook(STAGE_DTM);
+
+    // Produce a classification raster image with LAS standard point classes.
+    buildClassImage(voidedImage, dtmImage, labelImage, dzShort, aglShort, classImage);
+    runHook(STAGE_CLASS);
+}
+
+template<class ELEV>
+void BasicShr3dPipeline<ELEV>::classifySweep(const std::vector<double> &aglMeters,
+                                             const std::vector<double> &minAreaMeters, unsigned int numThreads,
+                                             const SweepCallback &callback) {
+    ScopedTimer timer("classifySweep");
+    classifyGround();
+    float dzShort = imageUnits(params.dzMeters, voidedImage);
+
+    // Non-ground classification reads the DTM before its voids are filled, and the class image reads it after.
+    // Fill a copy once for all combinations.
+    OrthoImage<ELEV> filledImage;
+    copyImage(filledImage, dtmImage);
+    filledImage.fillVoidsPyramid(true, 2);
+
+    // Each combination copies the ground labels. The DSM and both DTMs are shared and only read.
+    long numCombinations = (long) (aglMeters.size() * minAreaMeters.size());
+    pubgeo::parallelFor(numCombinations, numThreads, [&](long k, unsigned int) {
+        double agl = aglMeters[k / minAreaMeters.size()];
+        double area = minAreaMeters[k % minAreaMeters.size()];
+        float aglShort = imageUnits(agl, voidedImage);
+        printf("Classifying with AGL_METERS = %f, AREA_METERS = %f\n", agl, area);
+        OrthoImage<unsigned long> labels;
+        copyImage(labels, labelImage);
+        Shr3dder::classifyNonGround(voidedImage, dtmImage, labels, dzShort, aglShort, (float) area,
+                                    params.narrowRadius);
+        OrthoImage<unsigned char> classes;
+        buildClassImage(voidedImage, filledImage, labels, dzShort, aglShort, classes);
+        callback(agl, area, classes);
+    });
+
+    // Leave the final DTM in dtmImage, as after classify().
+    copyImage(dtmImage, filledImage);
+}
+
+template<class ELEV>
+unsigned char BasicShr3dPipeline<ELEV>::classifyPoint(double x, double y, double z) const {
+    long col = long((x - classImage.easting) / classImage.gsd + 0.5);
+    long row = (long) classImage.height - 1 - long((y - classImage.northing) / classImage.gsd + 0.5);
+    if ((col < 0) || (col >= (long) classImage.width)) return 0;
+    if ((row < 0) || (row >= (long) classImage.height)) return 0;
+
+    // Points within DZ of the DTM are ground, regardless of the pixel class, as in the class image.
+    // Points farther below it are low noise and stay unclassified.
+    unsigned char pixelClass = classImage.data[row][col];
+    ELEV dtmValue = dtmImage.data[row][col];
+    double agl = params.aglMeters;
+    if (dtmValue != 0) {
+        agl = z - (dtmValue * dtmImage.scale + dtmImage.offset);
+        if (fabs(agl) < params.dzMeters) return LAS_POINT_GROUND;
+        if (agl < 0) return LAS_POINT_UNCLASSIFIED;
+    }
+
+    // Points above ground take the class of their pixel.
+    if (pixelClass == LAS_BUILDING) return LAS_POINT_BUILDING;
+    if ((pixelClass == LAS_TREE) || (agl >= params.aglMeters)) return LAS_POINT_TREE;
+    return LAS_POINT_UNCLASSIFIED;
+}
+
+template<class ELEV>
+void BasicShr3dPipeline<ELEV>::getBuildingImage(OrthoImage<unsigned char> &buildingImage) {
+    getBuildingImage(classImage, buildingImage);
+}
+
+template<class ELEV>
+void BasicShr3dPipeline<ELEV>::getBuildingImage(OrthoImage<unsigned char> &classImage,
+                                                OrthoImage<unsigned char> &buildingImage) {
+    allocateLike(buildingImage, classImage);
+    for (unsigned int j = 0; j < classImage.height; j++) {
+        for (unsigned int i = 0; i < classImage.width; i++) {
+            if (classImage.data[j][i] == LAS_BUILDING) buildingImage.data[j][i] = LAS_BUILDING;
+        }
+    }
+}
+
+// Quantized rasters reserve one unit below and above the elevation range, as readFromGrid does.
+bool shr3d::needsFloat32(double zMin, double zMax, double dzMeters) {
+    double step = (zMax - zMin + 2.0) / 65535.0;
+    return step > dzMeters * SHR3D_MAX_STEP_FRACTION;
+}
+
+// Instantiate the pipeline for each supported elevation type.
+template class shr3d::BasicShr3dPipeline<unsigned short>;
+template class shr3d::BasicShr3dPipeline<float>;
@@ -0,0 +1,127 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// pipeline.h
+//
+
+#ifndef PUBGEO_SHR3D_PIPELINE_H
+#define PUBGEO_SHR3D_PIPELINE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "orthoimage.h"
+#include "RasterCache.h"
+#include "shr3d.h"
+
+namespace shr3d {
+    // Stages reported to the pipeline hook, in the order they complete.
+    typedef enum {
+        STAGE_DSM,          // DSM read, median filtered, and small voids filled.
+        STAGE_MIN,          // Minimum Z image read into dtmImage and filtered.
+        STAGE_TREES,        // Trees set to void in voidedImage.
+        STAGE_GROUND,       // Ground classified and DTM median filtered.
+        STAGE_OBJECTS,      // Non-ground objects labeled.
+        STAGE_DTM,          // Final DTM voids filled.
+        STAGE_CLASS         // Classification image complete.
+    } Shr3dStage;
+
+    typedef struct {
+        double dhMeters;            // Horizontal uncertainty (meters)
+        double dzMeters;            // Vertical uncertainty (meters)
+        double aglMeters;           // Minimum building height above ground level (meters)
+        double minAreaMeters;       // Minimum building area (meters^2)
+        unsigned int narrowRadius;  // Radius (pixels) of the opening that removes narrow objects
+    } Shr3dParameters;
+
+//
+// In-memory SHR3D classification pipeline shared by the command line tool and the PDAL plugin.
+// Read a DSM or point cloud, then classify. All products stay in memory for the caller to use or write.
+// Elevations are quantized to 16 bits by default. The float32 pipeline keeps full precision on scenes with large
+// relief or outliers and reads and writes float GeoTIFFs without requantizing, at twice the memory.
+//
+    template<class ELEV>
+    class BasicShr3dPipeline {
+    public:
+        typedef std::function<void(Shr3dStage stage, BasicShr3dPipeline &pipeline)> StageHook;
+        typedef std::function<void(double aglMeters, double minAreaMeters,
+                                   OrthoImage<unsigned char> &classImage)> SweepCallback;
+
+        Shr3dParameters params;
+        StageHook hook;     // Optional; called as each stage completes. Not called for stages loaded from the cache.
+        RasterCache cache;  // Optional; set its directory to cache intermediate rasters for files between runs.
+
+        OrthoImage<ELEV> dsmImage;                 // DSM product, before trees are removed.
+        OrthoImage<ELEV> voidedImage;              // DSM with trees set to void, used for classification.
+        OrthoImage<ELEV> dtmImage;                 // Minimum Z image until classified, then the DTM.
+        OrthoImage<unsigned long> labelImage;      // Building labels; one for buildings, LABEL_GROUND otherwise.
+        OrthoImage<unsigned char> classImage;      // LAS classification for each pixel.
+
+        explicit BasicShr3dPipeline(const Shr3dParameters &parameters);
+
+        static Shr3dParameters defaultParameters();
+
+        // Read a GeoTIFF DSM. Trees are not removed since there is no minimum Z image.
+        // With a cache, resume from the ground classification if it has been cached for the same DH and DZ.
+        bool readDSM(char *fileName);
+
+        // Read a point cloud file (e.g., LAS or BPF) into DSM and minimum Z images, then remove trees.
+        // With a cache, resume from the ground classification if it has been cached for the same DH, DZ, and AGL.
+        // Otherwise reuse the DSM and minimum Z rasters if they have been cached for the same DH.
+        bool readPointCloud(char *fileName);
+
+        // Read a PDAL PointView into DSM and minimum Z images, then remove trees.
+        bool readPointView(pdal::PointViewPtr view);
+
+        // Read minimum and maximum Z values accumulated from a point stream, then remove trees.
+        bool readPointGrid(MinMaxGrid &grid, int zone);
+
+        // Classify ground and buildings, producing the DTM, label, and class images.
+        void classify();
+
+        // Classify ground only. Afterward, dtmImage is the DTM before its final void fill and labelImage marks
+        // pixels that are not ground.
+        void classifyGround();
+
+        // Classify ground once, then classify buildings for every combination of AGL and area in parallel.
+        // Each class image is passed to the callback, which may be called from several threads at once.
+        // The ingest stage has already used params.aglMeters for its median filter, so only the non-ground
+        // classification uses the swept AGL values. Afterward, dtmImage is the final DTM.
+        void classifySweep(const std::vector<double> &aglMeters, const std::vector<double> &minAreaMeters,
+                           unsigned int numThreads, const SweepCallback &callback);
+
+        // Get a binary mask of building pixels.
+        void getBuildingImage(OrthoImage<unsigned char> &buildingImage);
+
+        static void getBuildingImage(OrthoImage<unsigned char> &classImage, OrthoImage<unsigned char> &buildingImage);
+
+        // Get the ASPRS class of a point from the class image and its height above the DTM.
+        // Returns zero if the point is outside the images. Safe to call from multiple threads after classify().
+        unsigned char classifyPoint(double x, double y, double z) const;
+
+    private:
+        std::string groundDescription;  // Cache description of the ground stage, if caching
+        bool groundReady;               // Ground stage is complete or was loaded from the cache
+
+        void filterPointCloudImages();
+
+        bool loadGround();
+
+        void storeGround();
+
+        void runHook(Shr3dStage stage);
+
+        BasicShr3dPipeline(const BasicShr3dPipeline &) = delete;
+
+        BasicShr3dPipeline &operator=(const BasicShr3dPipeline &) = delete;
+    };
+
+    typedef BasicShr3dPipeline<unsigned short> Shr3dPipeline;
+    typedef BasicShr3dPipeline<float> Shr3dFloatPipeline;
+
+    // Check whether 16-bit elevations spanning zMin to zMax would have a step coarser than a small fraction of DZ.
+    // A raster with that much relief, often from one spurious return, is better classified in float32.
+    bool needsFloat32(double zMin, double zMax, double dzMeters);
+}
+
+#endif // PUBGEO_SHR3D_PIPELINE_H
@@ -23,11 +23,8 @@
 // “Open Source Geospatial Tools to Enable Large Scale 3D Scene Modeling,”
 // FOSS4G, 2017.
 
-#include <algorithm>
-
-#include "orthoimage.h"
+#include "pipeline.h"
 #include "plugin.hpp"
-#include "shr3d.h"
 
 #include <pdal/pdal_macros.hpp>
 
@@ -47,121 +44,114 @@ std::string Shr3dWriter::getName() const
 
 void Shr3dWriter::addArgs(ProgramArgs& args)
 {
-    args.add("filename", "Output filename", m_filename).setPositional();
+    args.add("filename", "Output DTM filename", m_filename).setPositional();
+    args.add("dsm", "Output DSM filename", m_dsmFilename);
+    args.add("class", "Output classification filename", m_classFilename);
+    args.add("buildings", "Output building mask filename", m_buildingsFilename);
+    args.add("gdalopts", "GTiff creation options (e.g., COMPRESS=DEFLATE)",
+             m_options);
     args.add("dh", "Horizontal uncertainty", m_dh, 0.5);
     args.add("dz", "Vertical uncertainty", m_dz, 0.5);
     args.add("agl", "Minimum building height above ground level", m_agl, 2.0);
     args.add("area", "Minimum building area", m_area, 50.0);
+    args.add("narrow", "Radius (pixels) of the opening that removes narrow "
+             "objects (0 = none)", m_narrowRadius, 1u);
     args.add("egm96", "Set vertical datum to EGM96", m_egm96, false);
 }
 
-void Shr3dWriter::write(const PointViewPtr view)
+static shr3d::Shr3dParameters makeParameters(double dh, double dz, double agl,
+                                             double area,
+                                             unsigned int narrowRadius)
 {
-    shr3d::OrthoImage<unsigned short> dsmImage;
-    if (!dsmImage.readFromPointView(view, m_dh, shr3d::MAX_VALUE))
-        throw pdal_error("Error createing DSM\n");
-    dsmImage.medianFilter(1, static_cast<unsigned int>(m_agl / dsmImage.scale));
-    dsmImage.fillVoidsPyramid(true, 2);
-
-    shr3d::OrthoImage<unsigned short> minImage;
-    if (!minImage.readFromPointView(view, m_dh, shr3d::MIN_VALUE))
-        throw pdal_error("Error creating minimum Z image\n");
-    minImage.medianFilter(1, static_cast<unsigned int>(m_agl / minImage.scale));
-    minImage.fillVoidsPyramid(true, 2);
-
-    for (unsigned int j = 0; j < dsmImage.height; ++j)
-    {
-        for (unsigned int i = 0; i < dsmImage.width; ++i)
-        {
-            float minValue = static_cast<float>(minImage.data[j][i]);
-
-            // This check is to avoid penalizing spurious returns under very
-            // tall buildings. CAUTION: This is a hack to address an observed
-            // lidar sensor issue and may not generalize well.
-            if ((static_cast<float>(dsmImage.data[j][i]) - minValue) <
-                (40.0 / minImage.scale))
-            {
-                // If this is in the trees, then set to void.
-                bool found = false;
-                double threshold = m_dz / dsmImage.scale;
-                unsigned int i1 = std::max(0u, i - 1u);
-                unsigned int i2 = std::min(i + 1u, dsmImage.width - 1u);
-                unsigned int j1 = std::max(0u, j - 1u);
-                unsigned int j2 = std::min(j + 1u, dsmImage.height - 1u);
-                for (unsigned int jj = j1; jj <= j2; ++jj)
-                {
-                    for (unsigned int ii = i1; ii <= i2; ++ii)
-                    {
-                        float diff = static_cast<float>(dsmImage.data[jj][ii]) -
-                                     minValue;
-                        if (diff < threshold)
-                            found = true;
-                    }
-                }
-                if (!found)
-                    dsmImage.data[j][i] = 0;
-            }
-        }
-    }
+    shr3d::Shr3dParameters params = shr3d::Shr3dPipeline::defaultParameters();
+    params.dhMeters = dh;
+    params.dzMeters = dz;
+    params.aglMeters = agl;
+    params.minAreaMeters = area;
+    params.narrowRadius = narrowRadius;
+    return params;
+}
 
-    // Convert horizontal and vertical uncertainty values to bin units.
-    int dh_bins = std::max(1, static_cast<int>(floor(m_dh / dsmImage.gsd)));
-    unsigned int dz_short = static_cast<unsigned int>(m_dz / dsmImage.scale);
-    unsigned int agl_short = static_cast<unsigned int>(m_agl / dsmImage.scale);
-
-    // Generate label image.
-    shr3d::OrthoImage<unsigned long> labelImage;
-    labelImage.Allocate(dsmImage.width, dsmImage.height);
-    labelImage.easting = dsmImage.easting;
-    labelImage.northing = dsmImage.northing;
-    labelImage.zone = dsmImage.zone;
-    labelImage.gsd = dsmImage.gsd;
-
-    // Allocate a DTM image as SHORT and copy in the DSM values.
-    shr3d::OrthoImage<unsigned short> dtmImage;
-    dtmImage.Allocate(dsmImage.width, dsmImage.height);
-    dtmImage.easting = dsmImage.easting;
-    dtmImage.northing = dsmImage.northing;
-    dtmImage.zone = dsmImage.zone;
-    dtmImage.gsd = dsmImage.gsd;
-    dtmImage.scale = dsmImage.scale;
-    dtmImage.offset = dsmImage.offset;
-    dtmImage.bands = dsmImage.bands;
-    for (unsigned int j = 0; j < dsmImage.height; ++j)
-    {
-        for (unsigned int i = 0; i < dsmImage.width; ++i)
-        {
-            dtmImage.data[j][i] = minImage.data[j][i];
-        }
-    }
+void Shr3dWriter::ready(PointTableRef table)
+{
+    m_grid.reset(new pubgeo::MinMaxGrid(static_cast<float>(m_dh)));
+}
 
-    // Classify ground points.
-    shr3d::Shr3dder::classifyGround(labelImage, dsmImage, dtmImage, dh_bins,
-                                    dz_short);
+void Shr3dWriter::spatialReferenceChanged(const SpatialReference& srs)
+{
+    m_srs = srs;
+}
 
-    // For DSM voids, also set DTM value to void.
-    for (unsigned int j = 0; j < dsmImage.height; ++j)
-    {
-        for (unsigned int i = 0; i < dsmImage.width; ++i)
-        {
-            if (dsmImage.data[j][i] == 0)
-                dtmImage.data[j][i] = 0;
-        }
-    }
+// In stream mode, accumulate minimum and maximum Z values for each cell so
+// that no PointView needs to be held in memory.
+bool Shr3dWriter::processOne(PointRef& point)
+{
+    m_grid->add(point.getFieldAs<double>(Dimension::Id::X),
+                point.getFieldAs<double>(Dimension::Id::Y),
+                point.getFieldAs<double>(Dimension::Id::Z));
+    return true;
+}
+
+void Shr3dWriter::write(const PointViewPtr view)
+{
+    shr3d::Shr3dPipeline pipeline(makeParameters(m_dh, m_dz, m_agl, m_area,
+                                                 m_narrowRadius));
+    if (!pipeline.readPointView(view))
+        throw pdal_error("Error creating DSM\n");
+    pipeline.classify();
+    writeProducts(pipeline);
+}
 
-    // Median filter, replacing only points differing by more than the DZ
-    // threshold.
-    dtmImage.medianFilter(1, static_cast<unsigned int>(m_dz / dsmImage.scale));
+void Shr3dWriter::done(PointTableRef table)
+{
+    // Only the stream mode fills the grid.
+    if (!m_grid || m_grid->empty())
+        return;
+
+    const pubgeo::MinMaxXYZ& b = m_grid->bounds;
+    BOX3D box(b.xMin, b.yMin, b.zMin, b.xMax, b.yMax, b.zMax);
+    int zone = m_srs.computeUTMZone(box);
+
+    shr3d::Shr3dPipeline pipeline(makeParameters(m_dh, m_dz, m_agl, m_area,
+                                                 m_narrowRadius));
+    if (!pipeline.readPointGrid(*m_grid, zone))
+        throw pdal_error("Error creating DSM\n");
+    m_grid.reset();
+    pipeline.classify();
+    writeProducts(pipeline);
+}
 
-    // Refine the object label image and export building outlines.
-    shr3d::Shr3dder::classifyNonGround(dsmImage, dtmImage, labelImage, dz_short,
-                                       agl_short, static_cast<float>(m_area));
+// Write each requested product with the same creation options.
+void Shr3dWriter::writeProducts(shr3d::Shr3dPipeline& pipeline)
+{
+    char** options = nullptr;
+    for (const std::string& option : m_options)
+        options = CSLAddString(options, option.c_str());
 
-    // Fill small voids in the DTM after all processing is complete.
-    dtmImage.fillVoidsPyramid(true, 2);
+    bool ok = true;
+    if (m_dsmFilename.size())
+        ok &= pipeline.dsmImage.write(const_cast<char*>(m_dsmFilename.c_str()),
+                                      true, m_egm96, options);
 
     // Write the DTM image as FLOAT.
-    dtmImage.write(const_cast<char*>(m_filename.c_str()), true, m_egm96);
+    ok &= pipeline.dtmImage.write(const_cast<char*>(m_filename.c_str()), true,
+                                  m_egm96, options);
+
+    if (m_classFilename.size())
+        ok &= pipeline.classImage.write(
+            const_cast<char*>(m_classFilename.c_str()), false, m_egm96,
+            options);
+    if (m_buildingsFilename.size())
+    {
+        shr3d::OrthoImage<unsigned char> buildingImage;
+        pipeline.getBuildingImage(buildingImage);
+        ok &= buildingImage.write(
+            const_cast<char*>(m_buildingsFilename.c_str()), false, m_egm96,
+            options);
+    }
+    CSLDestroy(options);
+    if (!ok)
+        throw pdal_error("Error writing shr3d output rasters\n");
 }
 
 } // namespace pdal
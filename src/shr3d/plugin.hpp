@@ -26,16 +26,27 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include <pdal/Streamable.hpp>
 #include <pdal/Writer.hpp>
 #include <pdal/pdal_export.hpp>
 #include <pdal/util/ProgramArgs.hpp>
 
+#include "MinMaxGrid.h"
+
+namespace shr3d
+{
+template<class ELEV> class BasicShr3dPipeline;
+typedef BasicShr3dPipeline<unsigned short> Shr3dPipeline;
+}
+
 namespace pdal
 {
 
-class PDAL_DLL Shr3dWriter : public Writer
+class PDAL_DLL Shr3dWriter : public Writer, public Streamable
 {
 public:
     Shr3dWriter()
@@ -48,14 +59,27 @@ public:
 
 private:
     virtual void addArgs(ProgramArgs& args);
+    virtual void ready(PointTableRef table);
+    virtual void spatialReferenceChanged(const SpatialReference& srs);
+    virtual bool processOne(PointRef& point);
     virtual void write(const PointViewPtr view);
+    virtual void done(PointTableRef table);
+
+    void writeProducts(shr3d::Shr3dPipeline& pipeline);
 
     std::string m_filename;
+    std::string m_dsmFilename;
+    std::string m_classFilename;
+    std::string m_buildingsFilename;
+    std::vector<std::string> m_options;
     double m_dh;
     double m_dz;
     double m_agl;
     double m_area;
+    unsigned int m_narrowRadius;
     bool m_egm96;
+    std::unique_ptr<pubgeo::MinMaxGrid> m_grid;
+    SpatialReference m_srs;
 
     Shr3dWriter& operator=(const Shr3dWriter&) = delete;
     Shr3dWriter(const Shr3dWriter&) = delete;
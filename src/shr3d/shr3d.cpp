@@ -14,8 +14,10 @@
 using namespace shr3d;
 
 // Extend object boundaries to capture points missed around the edges.
-void extendObjectBoundaries(OrthoImage<unsigned short> &dsmImage, OrthoImage<unsigned long> &labelImage,
-                            int edgeResolution, unsigned int minDistanceShortValue) {
+template<class ELEV>
+void extendObjectBoundaries(OrthoImage<ELEV> &dsmImage, OrthoImage<unsigned long> &labelImage,
+                            int edgeResolution, float minDistanceShortValue) {
+    ScopedTimer timer("extendObjectBoundaries");
     // Loop enough to capture the edge resolution.
     for (unsigned int k = 0; k < edgeResolution; k++) {
         // First, label any close neighbor LABEL_TEMP.
@@ -70,8 +72,10 @@ void extendObjectBoundaries(OrthoImage<unsigned short> &dsmImage, OrthoImage<uns
 }
 
 // Label boundaries of objects above ground level.
-void labelObjectBoundaries(OrthoImage<unsigned short> &dsmImage, OrthoImage<unsigned long> &labelImage,
-                           int edgeResolution, unsigned int minDistanceShortValue) {
+template<class ELEV>
+void labelObjectBoundaries(OrthoImage<ELEV> &dsmImage, OrthoImage<unsigned long> &labelImage,
+                           int edgeResolution, float minDistanceShortValue) {
+    ScopedTimer timer("labelObjectBoundaries");
     // Initialize the labels to LABEL_GROUND.
     for (unsigned int j = 0; j < labelImage.height; j++) {
         for (unsigned int i = 0; i < labelImage.width; i++) {
@@ -108,8 +112,9 @@ void labelObjectBoundaries(OrthoImage<unsigned short> &dsmImage, OrthoImage<unsi
 }
 
 // Fill inside the object countour labels if points are above the nearby ground level.
-void fillObjectBounds(OrthoImage<unsigned long> &labelImage, OrthoImage<unsigned short> &dsmImage, ObjectType &obj,
-                      int edgeResolution, unsigned int dzShort) {
+template<class ELEV>
+void fillObjectBounds(OrthoImage<unsigned long> &labelImage, OrthoImage<ELEV> &dsmImage, ObjectType &obj,
+                      int edgeResolution, float dzShort) {
     unsigned int label = obj.label;
 
     // Loop on rows, filling in labels.
@@ -140,7 +145,7 @@ void fillObjectBounds(OrthoImage<unsigned long> &labelImage, OrthoImage<unsigned
 
         // Get max ground level height for this row.
         // If the DSM image value is void, then the ground level value is zero, so that's ok.
-        unsigned short groundLevel;
+        ELEV groundLevel;
         if (startIndex == 0)
             groundLevel = dsmImage.data[j][stopIndex + 1];
         else if (stopIndex == labelImage.width - 1)
@@ -185,7 +190,7 @@ void fillObjectBounds(OrthoImage<unsigned long> &labelImage, OrthoImage<unsigned
 		if ((startIndex == 0) && (stopIndex == labelImage.height-1)) continue;
 
         // Get max ground level height for this row.
-        unsigned short groundLevel;
+        ELEV groundLevel;
         if (startIndex == 0)
             groundLevel = dsmImage.data[stopIndex + 1][i];
         else if (stopIndex == labelImage.height - 1)
@@ -246,8 +251,9 @@ void fillObjectBounds(OrthoImage<unsigned long> &labelImage, OrthoImage<unsigned
 }
 
 // Add neighboring pixels to an object.
+template<class ELEV>
 bool addNeighbors(std::vector<PixelType> &neighbors, OrthoImage<unsigned long> &labelImage,
-                  OrthoImage<unsigned short> &dsmImage, ObjectType &obj, unsigned int dzShort) {
+                  OrthoImage<ELEV> &dsmImage, ObjectType &obj, float dzShort) {
     // Get neighbors for all pixels in the list.
     std::vector<PixelType> newNeighbors;
     for (size_t k = 0; k < neighbors.size(); k++) {
@@ -288,8 +294,10 @@ bool addNeighbors(std::vector<PixelType> &neighbors, OrthoImage<unsigned long> &
 }
 
 // Group connected labeled pixels into objects.
-void groupObjects(OrthoImage<unsigned long> &labelImage, OrthoImage<unsigned short> &dsmImage,
-                  std::vector<ObjectType> &objects, long maxCount, unsigned int dzShort) {
+template<class ELEV>
+void groupObjects(OrthoImage<unsigned long> &labelImage, OrthoImage<ELEV> &dsmImage,
+                  std::vector<ObjectType> &objects, long maxCount, float dzShort) {
+    ScopedTimer timer("groupObjects");
     // Sweep from top left to bottom right, assigning object labels.
     long maxGroupSize = 0;
     unsigned int label = 1;
@@ -356,8 +364,10 @@ void finishLabelImage(OrthoImage<unsigned long> &labelImage) {
 }
 
 // Classify ground points, fill the voids, and generate a bare earth terrain model. 
-void Shr3dder::classifyGround(OrthoImage<unsigned long> &labelImage, OrthoImage<unsigned short> &dsmImage,
-                              OrthoImage<unsigned short> &dtmImage, int dhBins, unsigned int dzShort) {
+template<class ELEV>
+void Shr3dder::classifyGround(OrthoImage<unsigned long> &labelImage, OrthoImage<ELEV> &dsmImage,
+                              OrthoImage<ELEV> &dtmImage, int dhBins, float dzShort) {
+    ScopedTimer timer("classifyGround");
     // Fill voids.
     printf("Filling voids...\n");
     dtmImage.fillVoidsPyramid(true);
@@ -389,9 +399,13 @@ void Shr3dder::classifyGround(OrthoImage<unsigned long> &labelImage, OrthoImage<
         printf("Number of objects = %ld\n", objects.size());
 
         // Generate object groups and void fill them in the DEM image.
+        // Time the loop as one stage, since there can be many small objects.
         printf("Labeling and removing objects...\n");
-        for (long i = 0; i < objects.size(); i++) {
-            fillObjectBounds(labelImage, dtmImage, objects[i], dhBins, dzShort);
+        {
+            ScopedTimer timer("fillObjectBounds");
+            for (long i = 0; i < objects.size(); i++) {
+                fillObjectBounds(labelImage, dtmImage, objects[i], dhBins, dzShort);
+            }
         }
 
         // Update the label image values for easy viewing.
@@ -471,9 +485,11 @@ void Shr3dder::classifyGround(OrthoImage<unsigned long> &labelImage, OrthoImage<
 }
 
 // Classify non-ground points.
-void Shr3dder::classifyNonGround(OrthoImage<unsigned short> &dsmImage, OrthoImage<unsigned short> &dtmImage,
-                                 OrthoImage<unsigned long> &labelImage, unsigned int dzShort, unsigned int aglShort,
-                                 float minAreaMeters) {
+template<class ELEV>
+void Shr3dder::classifyNonGround(OrthoImage<ELEV> &dsmImage, OrthoImage<ELEV> &dtmImage,
+                                 OrthoImage<unsigned long> &labelImage, float dzShort, float aglShort,
+                                 float minAreaMeters, unsigned int narrowRadius) {
+    ScopedTimer timer("classifyNonGround");
     // Compute minimum number of points based on threshold given for area.
     // Note that ISPRS challenges indicate that performance is dramatically better for structures larger than 50m area.
     int minPointCount = int(minAreaMeters / (dsmImage.gsd * dsmImage.gsd));
@@ -492,236 +508,284 @@ void Shr3dder::classifyNonGround(OrthoImage<unsigned short> &dsmImage, OrthoImag
     }
 
     // Group the labeled objects based on height similarity.
+    // Accept or reject each object independently based on boundary values and flatness.
+    // Surviving objects are reset to one in the same pass.
     {
         std::vector<ObjectType> objects;
         groupObjects(labelImage, dsmImage, objects, LONG_MAX, dzShort / 2);
+        unsigned long numLabels = objects.empty() ? 0 : objects.back().label + 1;
+        std::vector<RegionType> regions;
+        computeRegionProperties(labelImage, dsmImage, dtmImage, numLabels, regions);
 
-        // Accept or reject each object independently based on boundary values and flatness.
-        int numRejected = 0;
+        // Reject if boundary gradients with neighbors labeled ground are too small.
+        std::vector<unsigned long> lookup(numLabels, 1);
         for (unsigned int k = 0; k < objects.size(); k++) {
-            bool reject = false;
-
-            // Reject if boundary gradients with neighbors labeled ground are too small.
-            float meanGradient = 0.0;
-            int count = 0;
-            for (int j = objects[k].ymin; j <= objects[k].ymax; j++) {
-                for (unsigned int i = objects[k].xmin; i <= objects[k].xmax; i++) {
-                    if (labelImage.data[j][i] == objects[k].label) {
-                        for (int jj = -1; jj <= 1; jj++) {
-                            unsigned int j2 = MAX(0, MIN(dsmImage.height - 1, j + jj));
-                            for (int ii = -1; ii <= 1; ii++) {
-                                unsigned int i2 = MAX(0, MIN(dsmImage.width - 1, i + ii));
-                                //if (labelImage.data[j2][i2] != objects[k].label)
-                                if (labelImage.data[j2][i2] == LABEL_GROUND) {
-                                    unsigned int j3 = MAX(0, MIN(dsmImage.height - 1, j + jj * 2));
-                                    unsigned int i3 = MAX(0, MIN(dsmImage.width - 1, i + ii * 2));
-
-                                    // These assume I'm higher than my neighbors.
-                                    float myGradient = MAX(0, ((float) dsmImage.data[j][i] -
-                                                               (float) dsmImage.data[j2][i2]));
-                                    float neighborGradient = MAX(0, ((float) dsmImage.data[j2][i2] -
-                                                                     (float) dsmImage.data[j3][i3]));
-                                    meanGradient += MAX(0, (myGradient - neighborGradient));
-                                    count++;
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-            meanGradient /= count;
-            if ((meanGradient < dzShort / 2.0) && (meanGradient != 0.0)) reject = true;
-
-            // If rejected, then label each point.
-            if (reject) {
-                numRejected++;
-                for (unsigned int j = objects[k].ymin; j <= objects[k].ymax; j++) {
-                    for (unsigned int i = objects[k].xmin; i <= objects[k].xmax; i++) {
-                        if (labelImage.data[j][i] == objects[k].label) {
-                            labelImage.data[j][i] = LABEL_GROUND;
-                        }
-                    }
-                }
-            }
+            RegionType &region = regions[objects[k].label];
+            if (region.boundaryCount == 0) continue;
+            float meanGradient = (float) (region.boundaryGradient / region.boundaryCount);
+            if ((meanGradient < dzShort / 2.0) && (meanGradient != 0.0)) lookup[objects[k].label] = LABEL_GROUND;
         }
+        relabelRegions(labelImage, lookup);
     }
 
     // Erode and then dilate labels to remove narrow objects.
+    // This is done on a packed binary mask, so only one read and one write of the label image are needed.
     {
-        OrthoImage<unsigned long> tempImage;
-        tempImage.Allocate(labelImage.width, labelImage.height);
+        BitImage mask;
+        mask.Allocate(labelImage.width, labelImage.height);
         for (unsigned int j = 0; j < labelImage.height; j++) {
+            uint64_t *row = mask.row(j);
             for (unsigned int i = 0; i < labelImage.width; i++) {
-                tempImage.data[j][i] = labelImage.data[j][i];
-            }
-        }
-        for (int j = 0; j < labelImage.height; j++) {
-            for (int i = 0; i < labelImage.width; i++) {
-                if (labelImage.data[j][i] != LABEL_GROUND) {
-                    // Define neighbor bounds;
-                    int i1 = MAX(0, i - 1);
-                    int i2 = MIN(i + 1, labelImage.width - 1);
-                    int j1 = MAX(0, j - 1);
-                    int j2 = MIN(j + 1, labelImage.height - 1);
-
-                    // Unlabel any point with an unlabeled neighbor.
-                    for (int jj = j1; jj <= j2; jj++) {
-                        for (int ii = i1; ii <= i2; ii++) {
-                            if (labelImage.data[jj][ii] == LABEL_GROUND) {
-                                tempImage.data[j][i] = LABEL_GROUND;
-                            }
-                        }
-                    }
-                }
+                if (labelImage.data[j][i] != LABEL_GROUND) row[i / 64] |= (uint64_t) 1 << (i % 64);
             }
         }
-        for (int j = 0; j < labelImage.height; j++) {
-            for (int i = 0; i < labelImage.width; i++) {
-                if (labelImage.data[j][i] != LABEL_GROUND) {
-                    // Define neighbor bounds;
-                    int i1 = MAX(0, i - 1);
-                    int i2 = MIN(i + 1, labelImage.width - 1);
-                    int j1 = MAX(0, j - 1);
-                    int j2 = MIN(j + 1, labelImage.height - 1);
-
-                    // Unlabel any point with no labeled neighbors after erosion.
-                    bool found = false;
-                    for (int jj = j1; jj <= j2; jj++) {
-                        for (int ii = i1; ii <= i2; ii++) {
-                            if (tempImage.data[jj][ii] != LABEL_GROUND) found = true;
-                        }
-                    }
-                    if (!found) labelImage.data[j][i] = LABEL_GROUND;
-                }
+        mask.erode(narrowRadius);
+        mask.dilate(narrowRadius);
+        for (unsigned int j = 0; j < labelImage.height; j++) {
+            uint64_t *row = mask.row(j);
+            for (unsigned int i = 0; i < labelImage.width; i++) {
+                if (((row[i / 64] >> (i % 64)) & 1) == 0) labelImage.data[j][i] = LABEL_GROUND;
             }
         }
     }
 
-    // Reset all non-ground labels to one.
-    for (unsigned int j = 0; j < labelImage.height; j++) {
-        for (unsigned int i = 0; i < labelImage.width; i++) {
-            if (labelImage.data[j][i] != LABEL_GROUND) labelImage.data[j][i] = 1;
-        }
-    }
-
     // Group labeled points to remove small objects.
     // Do not split groups based on height or point count.
     {
         printf("Grouping to remove small objects...\n");
         std::vector<ObjectType> objects;
         groupObjects(labelImage, dsmImage, objects, LONG_MAX, INT_MAX);
+        unsigned long numLabels = objects.empty() ? 0 : objects.back().label + 1;
+        std::vector<unsigned long> lookup(numLabels, 1);
         int numRejected = 0;
         for (unsigned int k = 0; k < objects.size(); k++) {
-            bool reject = false;
-
             // Reject if too small.
-            if (objects[k].count < minPointCount) reject = true;
-
-            // If rejected, then label each point.
-            if (reject) {
+            if (objects[k].count < minPointCount) {
+                lookup[objects[k].label] = LABEL_GROUND;
                 numRejected++;
-                for (unsigned int j = objects[k].ymin; j <= objects[k].ymax; j++) {
-                    for (unsigned int i = objects[k].xmin; i <= objects[k].xmax; i++) {
-                        if (labelImage.data[j][i] == objects[k].label) {
-                            labelImage.data[j][i] = LABEL_GROUND;
-                        }
-                    }
-                }
             }
         }
+
+        // Reset all remaining non-ground labels to one.
+        relabelRegions(labelImage, lookup);
         printf("Number of small objects rejected = %d\n", numRejected);
     }
+}
+
+// Accumulate per-label region properties in a single sweep over the label image.
+// Labels at or above numLabels, including LABEL_GROUND, are not accumulated.
+// Boundary gradients are summed over neighbors labeled LABEL_GROUND, assuming the region is higher than its
+// neighbors.
+template<class ELEV>
+void Shr3dder::computeRegionProperties(OrthoImage<unsigned long> &labelImage, OrthoImage<ELEV> &dsmImage,
+                                       OrthoImage<ELEV> &dtmImage, unsigned long numLabels,
+                                       std::vector<RegionType> &regions) {
+    ScopedTimer timer("computeRegionProperties");
+    RegionType empty = {LONG_MAX, 0, LONG_MAX, 0, 0, 0, 0.0, FLT_MAX, 0, 0.0, 0.0};
+    regions.assign(numLabels, empty);
+    int height = (int) labelImage.height;
+    int width = (int) labelImage.width;
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            unsigned long label = labelImage.data[j][i];
+            if (label >= numLabels) continue;
+            RegionType &region = regions[label];
+
+            // Update area, bounds, and height statistics.
+            ELEV z = dsmImage.data[j][i];
+            region.count++;
+            region.xmin = MIN(region.xmin, i);
+            region.xmax = MAX(region.xmax, i);
+            region.ymin = MIN(region.ymin, j);
+            region.ymax = MAX(region.ymax, j);
+            region.zmin = MIN(region.zmin, (float) z);
+            region.zmax = MAX(region.zmax, (float) z);
+            region.zsum += z;
+            region.aglsum += (float) z - (float) dtmImage.data[j][i];
+
+            // Update boundary gradients with neighbors labeled ground.
+            for (int jj = -1; jj <= 1; jj++) {
+                int j2 = MAX(0, MIN(height - 1, j + jj));
+                int j3 = MAX(0, MIN(height - 1, j + jj * 2));
+                for (int ii = -1; ii <= 1; ii++) {
+                    int i2 = MAX(0, MIN(width - 1, i + ii));
+                    if (labelImage.data[j2][i2] != LABEL_GROUND) continue;
+                    int i3 = MAX(0, MIN(width - 1, i + ii * 2));
+                    float myGradient = MAX(0, ((float) z - (float) dsmImage.data[j2][i2]));
+                    float neighborGradient = MAX(0, ((float) dsmImage.data[j2][i2] - (float) dsmImage.data[j3][i3]));
+                    region.boundaryGradient += MAX(0, (myGradient - neighborGradient));
+                    region.boundaryCount++;
+                }
+            }
+        }
+    }
+}
 
-    // Reset all non-ground labels to one.
+// Map every label below the size of the lookup table to its new value in one pass.
+void Shr3dder::relabelRegions(OrthoImage<unsigned long> &labelImage, std::vector<unsigned long> &lookup) {
+    unsigned long numLabels = lookup.size();
     for (unsigned int j = 0; j < labelImage.height; j++) {
         for (unsigned int i = 0; i < labelImage.width; i++) {
-            if (labelImage.data[j][i] != LABEL_GROUND) labelImage.data[j][i] = 1;
+            unsigned long label = labelImage.data[j][i];
+            if (label < numLabels) labelImage.data[j][i] = lookup[label];
         }
     }
 }
 
-// Add neighboring pixels to a void group.
-bool
-addClassNeighbors(std::vector<PixelType> &neighbors, OrthoImage<unsigned char> &classImage,
-                  OrthoImage<unsigned char> &labeled, unsigned int label) {
-    // Get neighbors for all pixels in the list.
-    std::vector<PixelType> newNeighbors;
-    for (size_t k = 0; k < neighbors.size(); k++) {
-        unsigned int i = neighbors[k].i;
-        unsigned int j = neighbors[k].j;
-        for (unsigned int jj = MAX(0, j - 1); jj <= MIN(j + 1, classImage.height - 1); jj++) {
-            for (unsigned int ii = MAX(0, i - 1); ii <= MIN(i + 1, classImage.width - 1); ii++) {
-                // If already labeled, then skip.
-                if (labeled.data[jj][ii] == 1) continue;
+// Convert a threshold on a difference of shorts to an integer bound, so that (diff < threshold) is unchanged.
+static int integerThreshold(double threshold) {
+    return (int) MAX(-(1 << 20), MIN(1 << 20, ceil(threshold)));
+}
 
-                // If not the same label, then skip.
-                if (classImage.data[jj][ii] != label) continue;
+// Thresholds on differences of pixel values. Differences of shorts are exact in integers; floats compare directly.
+static inline int differenceThreshold(double threshold, unsigned short) {
+    return integerThreshold(threshold);
+}
 
-                // Update the label.
-                labeled.data[jj][ii] = 1;
+static inline float differenceThreshold(double threshold, float) {
+    return (float) threshold;
+}
 
-                // Add to the new list.
-                PixelType pixel = {ii, jj};
-                newNeighbors.push_back(pixel);
-            }
-        }
+// Minimum of each pixel and its left and right neighbors, with edges replicated through a padded row.
+template<class ELEV>
+static void rowMin3(const ELEV *row, unsigned int width, ELEV *padded, ELEV *out) {
+    memcpy(&padded[1], row, width * sizeof(ELEV));
+    padded[0] = row[0];
+    padded[width + 1] = row[width - 1];
+    for (size_t i = 0; i < width; i++) {
+        ELEV a = padded[i];
+        ELEV b = padded[i + 1];
+        ELEV c = padded[i + 2];
+        ELEV ab = (a < b) ? a : b;
+        out[i] = (ab < c) ? ab : c;
     }
+}
 
-    // Update the neighbors list.
-    if (newNeighbors.size() > 0) {
-        for (int k = 0; k < newNeighbors.size(); k++) {
-            neighbors.push_back(newNeighbors[k]);
-        }
-//		neighbors = newNeighbors;
-        return true;
-    } else return false;
+// Write the DSM with trees set to void into voidedImage.
+// A pixel is void if none of the DSM values in its 3x3 neighborhood are within dzShort of its minimum Z value.
+// That is the same as the 3x3 minimum of the DSM being too high, so the test is a separable minimum over
+// padded rows followed by compares, with no branches in the inner loops. Pixels more than tallShort
+// above their minimum Z are always kept to avoid penalizing spurious returns under very tall buildings.
+template<class ELEV>
+void Shr3dder::voidTrees(OrthoImage<ELEV> &dsmImage, OrthoImage<ELEV> &minImage,
+                         OrthoImage<ELEV> &voidedImage, double dzShort, double tallShort) {
+    ScopedTimer timer("voidTrees");
+    unsigned int width = dsmImage.width;
+    unsigned int height = dsmImage.height;
+    voidedImage.Allocate(width, height);
+    voidedImage.easting = dsmImage.easting;
+    voidedImage.northing = dsmImage.northing;
+    voidedImage.zone = dsmImage.zone;
+    voidedImage.gsd = dsmImage.gsd;
+    voidedImage.scale = dsmImage.scale;
+    voidedImage.offset = dsmImage.offset;
+    if ((width == 0) || (height == 0)) return;
+
+    typedef decltype(differenceThreshold(0.0, ELEV())) Difference;
+    Difference dz = differenceThreshold(dzShort, ELEV());
+    Difference tall = differenceThreshold(tallShort, ELEV());
+
+    // Keep horizontal minimums for three rows, replicating the first and last rows at the edges.
+    std::vector<ELEV> padded(width + 2);
+    std::vector<ELEV> rows(3 * (size_t) width);
+    ELEV *above = &rows[0];
+    ELEV *center = &rows[width];
+    ELEV *below = &rows[2 * (size_t) width];
+    rowMin3(dsmImage.data[0], width, &padded[0], center);
+    memcpy(above, center, width * sizeof(ELEV));
+    if (height > 1) rowMin3(dsmImage.data[1], width, &padded[0], below);
+    else memcpy(below, center, width * sizeof(ELEV));
+    for (unsigned int j = 0; j < height; j++) {
+        const ELEV *dsm = dsmImage.data[j];
+        const ELEV *minZ = minImage.data[j];
+        ELEV *out = voidedImage.data[j];
+        for (unsigned int i = 0; i < width; i++) {
+            ELEV a = (above[i] < center[i]) ? above[i] : center[i];
+            Difference neighborhoodMin = (a < below[i]) ? a : below[i];
+            Difference m = minZ[i];
+            int keep = ((dsm[i] - m) >= tall) | ((neighborhoodMin - m) < dz);
+            out[i] = (ELEV) (dsm[i] * keep);
+        }
+
+        // Shift the rows up and read the next one.
+        ELEV *next = above;
+        above = center;
+        center = below;
+        below = next;
+        if (j + 2 < height) rowMin3(dsmImage.data[j + 2], width, &padded[0], below);
+        else memcpy(below, center, width * sizeof(ELEV));
+    }
 }
 
 // Fill in any pixels labeled tree that fall entirely within a labeled building group.
+// Tree regions are 8-connected. Each region is flood filled once with an explicit stack, recording whether any
+// neighbor is something other than a building. A second pass relabels the enclosed regions.
 void Shr3dder::fillInsideBuildings(OrthoImage<unsigned char> &classImage) {
-    int numFilled = 0;
-    OrthoImage<unsigned char> labeled;
-    labeled.Allocate(classImage.width, classImage.height);
+    ScopedTimer timer("fillInsideBuildings");
+    long numFilled = 0;
+    OrthoImage<unsigned int> regionImage;
+    regionImage.Allocate(classImage.width, classImage.height);
+    std::vector<bool> inside;
+    inside.push_back(false);    // Region zero is reserved for unlabeled pixels.
+    std::vector<PixelType> stack;
     for (unsigned int j = 0; j < classImage.height; j++) {
         for (unsigned int i = 0; i < classImage.width; i++) {
-            bool consider = ((labeled.data[j][i] == 0) && (classImage.data[j][i] == LAS_TREE));
-            if (!consider) continue;
+            if ((regionImage.data[j][i] != 0) || (classImage.data[j][i] != LAS_TREE)) continue;
 
-            // Get all pixels in this contiguous group.
-            std::vector<PixelType> neighbors;
+            // Label all pixels in this contiguous group.
+            unsigned int label = (unsigned int) inside.size();
+            bool enclosed = true;
+            regionImage.data[j][i] = label;
             PixelType pixel = {i, j};
-            neighbors.push_back(pixel);
-            bool keepSearching = true;
-            unsigned int label = (unsigned int) classImage.data[j][i];
-            labeled.data[j][i] = 1;
-            while (keepSearching) {
-                keepSearching = addClassNeighbors(neighbors, classImage, labeled, label);
-            }
-
-            // Check all pixels for neighboring labels.
-            bool inside = true;
-            for (int k = 0; k < neighbors.size(); k++) {
-                long i1 = neighbors[k].i;
-                long j1 = neighbors[k].j;
-                for (long jj = MAX(0, j1 - 1); jj <= MIN(j1 + 1, classImage.height - 1); jj++) {
-                    for (long ii = MAX(0, i1 - 1); ii <= MIN(i1 + 1, classImage.width - 1); ii++) {
-                        if ((labeled.data[jj][ii] == 0) && (classImage.data[jj][ii] != LAS_BUILDING)) {
-                            inside = false;
+            stack.push_back(pixel);
+            while (!stack.empty()) {
+                PixelType p = stack.back();
+                stack.pop_back();
+                unsigned int j1 = (p.j > 0) ? p.j - 1 : 0;
+                unsigned int j2 = MIN(p.j + 1, classImage.height - 1);
+                unsigned int i1 = (p.i > 0) ? p.i - 1 : 0;
+                unsigned int i2 = MIN(p.i + 1, classImage.width - 1);
+                for (unsigned int jj = j1; jj <= j2; jj++) {
+                    for (unsigned int ii = i1; ii <= i2; ii++) {
+                        unsigned char value = classImage.data[jj][ii];
+                        if (value == LAS_TREE) {
+                            if (regionImage.data[jj][ii] != 0) continue;
+                            regionImage.data[jj][ii] = label;
+                            PixelType next = {ii, jj};
+                            stack.push_back(next);
+                        } else if (value != LAS_BUILDING) {
+                            enclosed = false;
                         }
                     }
                 }
             }
+            inside.push_back(enclosed);
+        }
+    }
 
-            // If the region is completely inside a building region, then fill it.
-            if (inside) {
-                for (int k = 0; k < neighbors.size(); k++) {
-                    numFilled++;
-                    classImage.data[neighbors[k].j][neighbors[k].i] = LAS_BUILDING;
-                }
+    // If a region is completely inside a building region, then fill it.
+    for (unsigned int j = 0; j < classImage.height; j++) {
+        for (unsigned int i = 0; i < classImage.width; i++) {
+            if (inside[regionImage.data[j][i]]) {
+                classImage.data[j][i] = LAS_BUILDING;
+                numFilled++;
             }
-
         }
     }
-    printf("Removed %d tree pixels inside building label groups.\n", numFilled);
+    printf("Removed %ld tree pixels inside building label groups.\n", numFilled);
 }
 
+// Instantiate the stages for each supported elevation type.
+#define INSTANTIATE_SHR3DDER(ELEV) \
+    template void Shr3dder::classifyGround<ELEV>(OrthoImage<unsigned long> &, OrthoImage<ELEV> &, \
+                                                 OrthoImage<ELEV> &, int, float); \
+    template void Shr3dder::classifyNonGround<ELEV>(OrthoImage<ELEV> &, OrthoImage<ELEV> &, \
+                                                    OrthoImage<unsigned long> &, float, float, float, unsigned int); \
+    template void Shr3dder::computeRegionProperties<ELEV>(OrthoImage<unsigned long> &, OrthoImage<ELEV> &, \
+                                                          OrthoImage<ELEV> &, unsigned long, \
+                                                          std::vector<RegionType> &); \
+    template void Shr3dder::voidTrees<ELEV>(OrthoImage<ELEV> &, OrthoImage<ELEV> &, OrthoImage<ELEV> &, double, \
+                                            double);
+
+INSTANTIATE_SHR3DDER(unsigned short)
+INSTANTIATE_SHR3DDER(float)
@@ -9,7 +9,9 @@
 
 #include <cstdio>
 #include <cstring>
+#include <vector>
 #include "orthoimage.h"
+#include "BitImage.h"
 
 #define LABEL_OBJECT    1
 #define LABEL_GROUND    UINT_MAX
@@ -41,6 +43,12 @@
 #define LAS_BUILDING        (6*40)
 // For now, multiply these by 40 so we can view the images easily.
 
+// ASPRS classes assigned to points, without the display scaling above.
+#define LAS_POINT_UNCLASSIFIED  1
+#define LAS_POINT_GROUND        2
+#define LAS_POINT_TREE          5
+#define LAS_POINT_BUILDING      6
+
 namespace shr3d {
     using namespace pubgeo;
 
@@ -58,19 +66,54 @@ namespace shr3d {
         long int count;
     } ObjectType;
 
+    // Properties accumulated for each labeled region in a single sweep of the label image.
+    // Heights are in DSM image units; AGL is the DSM height above the DTM.
+    typedef struct {
+        long int xmin;
+        long int xmax;
+        long int ymin;
+        long int ymax;
+        long int count;
+        long int boundaryCount;
+        double boundaryGradient;
+        float zmin;
+        float zmax;
+        double zsum;
+        double aglsum;
+    } RegionType;
+
+//
+// SHR3D classification stages.
+// Elevation images are either 16-bit quantized (unsigned short) or float32, and thresholds are in image units,
+// i.e., meters divided by the image scale. The stages are instantiated for both types in shr3d.cpp.
+//
     class Shr3dder {
     public:
         // Function declarations.
-        static void classifyGround(OrthoImage<unsigned long> &labelImage, OrthoImage<unsigned short> &dsmImage,
-                                   OrthoImage<unsigned short> &dtmImage, int dhBins, unsigned int dzShort);
+        template<class ELEV>
+        static void classifyGround(OrthoImage<unsigned long> &labelImage, OrthoImage<ELEV> &dsmImage,
+                                   OrthoImage<ELEV> &dtmImage, int dhBins, float dzShort);
 
-        static void classifyNonGround(OrthoImage<unsigned short> &dsmImage, OrthoImage<unsigned short> &dtmImage,
-                                      OrthoImage<unsigned long> &labelImage, unsigned int dzShort,
-                                      unsigned int aglShort,
-                                      float minAreaMeters);
+        template<class ELEV>
+        static void classifyNonGround(OrthoImage<ELEV> &dsmImage, OrthoImage<ELEV> &dtmImage,
+                                      OrthoImage<unsigned long> &labelImage, float dzShort,
+                                      float aglShort,
+                                      float minAreaMeters, unsigned int narrowRadius = 1);
 
         static void fillInsideBuildings(OrthoImage<unsigned char> &classImage);
+
+        template<class ELEV>
+        static void computeRegionProperties(OrthoImage<unsigned long> &labelImage,
+                                            OrthoImage<ELEV> &dsmImage,
+                                            OrthoImage<ELEV> &dtmImage, unsigned long numLabels,
+                                            std::vector<RegionType> &regions);
+
+        static void relabelRegions(OrthoImage<unsigned long> &labelImage, std::vector<unsigned long> &lookup);
+
+        template<class ELEV>
+        static void voidTrees(OrthoImage<ELEV> &dsmImage, OrthoImage<ELEV> &minImage,
+                              OrthoImage<ELEV> &voidedImage, double dzShort, double tallShort);
     };
 }
 
-#endif // PUBGEO_SHR3D_H
\ No newline at end of file
+#endif // PUBGEO_SHR3D_H
\ No newline at end of file
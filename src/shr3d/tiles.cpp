@@ -0,0 +1,486 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// tiles.cpp
+//
+
+#include <stdio.h>
+#include <math.h>
+#include <fstream>
+#include <unordered_map>
+#include "tiles.h"
+#include "footprints.h"
+#include "WorkQueue.h"
+
+using namespace shr3d;
+
+// Products written for each tile, in the order of their mosaics.
+static const char *TILE_PRODUCTS[] = {"DSM", "DTM", "class", "buildings"};
+static const bool TILE_PRODUCT_IS_FLOAT[] = {true, true, false, false};
+static const int NUM_TILE_PRODUCTS = 4;
+
+// Points buffered for one tile while streaming an input, before they are appended to its spill file.
+static const size_t SPILL_BUFFER_POINTS = 16384;
+
+// Rough peak memory per pixel of a buffered tile, used to bound concurrent tiles.
+static const unsigned long long TILE_MEMORY_PER_PIXEL = 32;
+
+// Each footprint feature is written on one line starting with this text, followed by its ID.
+static const char *FEATURE_PREFIX = "{\"type\":\"Feature\",\"properties\":{\"id\":";
+
+// Get the file name of one product for one tile.
+static std::string tileFileName(const std::string &outputPrefix, long column, long row, const char *product,
+                                const char *extension = "tif") {
+    char suffix[256];
+    sprintf(suffix, "_%ld_%ld_%s.%s", column, row, product, extension);
+    return outputPrefix + suffix;
+}
+
+// Get the file name of the points spilled to one tile from one input.
+static std::string spillFileName(const std::string &outputPrefix, long column, long row, size_t input) {
+    char suffix[256];
+    sprintf(suffix, "_%ld_%ld_%lu.spill", column, row, (unsigned long) input);
+    return outputPrefix + suffix;
+}
+
+// Create an empty spill file, discarding any left by an earlier run with the same output prefix.
+static bool createSpill(const std::string &fileName) {
+    FILE *fp = fopen(fileName.c_str(), "wb");
+    if (fp == NULL) return false;
+    return (fclose(fp) == 0);
+}
+
+// Append buffered X, Y, Z values to a spill file and clear the buffer.
+static bool appendSpill(const std::string &fileName, std::vector<double> &xyz) {
+    if (xyz.empty()) return true;
+    FILE *fp = fopen(fileName.c_str(), "ab");
+    if (fp == NULL) return false;
+    size_t count = fwrite(xyz.data(), sizeof(double), xyz.size(), fp);
+    bool ok = (fclose(fp) == 0) && (count == xyz.size());
+    xyz.clear();
+    return ok;
+}
+
+// Add the points in a spill file to a grid, then delete the file.
+static bool readSpill(const std::string &fileName, MinMaxGrid &grid) {
+    FILE *fp = fopen(fileName.c_str(), "rb");
+    if (fp == NULL) return false;
+    std::vector<double> xyz(3 * SPILL_BUFFER_POINTS);
+    size_t count;
+    while ((count = fread(xyz.data(), 3 * sizeof(double), SPILL_BUFFER_POINTS, fp)) > 0) {
+        for (size_t i = 0; i < count; i++) grid.add(xyz[3 * i], xyz[3 * i + 1], xyz[3 * i + 2]);
+    }
+    bool ok = (ferror(fp) == 0);
+    fclose(fp);
+    remove(fileName.c_str());
+    return ok;
+}
+
+// Copy the part of an image covering a square of grid cells, leaving the rest void.
+// The source image must be aligned to the same grid of cells, as images read from a MinMaxGrid are.
+template<class TYPE>
+static void cropImage(OrthoImage<TYPE> &source, long xCell, long yCell, long size, OrthoImage<TYPE> &tile) {
+    tile.Allocate((unsigned int) size, (unsigned int) size);
+    tile.easting = xCell * (double) source.gsd;
+    tile.northing = yCell * (double) source.gsd;
+    tile.zone = source.zone;
+    tile.gsd = source.gsd;
+    tile.scale = source.scale;
+    tile.offset = source.offset;
+    long xSource = lround(source.easting / source.gsd);
+    long ySource = lround(source.northing / source.gsd);
+    for (long j = 0; j < size; j++) {
+        long sj = (long) source.height - 1 - (yCell + size - 1 - j - ySource);
+        if ((sj < 0) || (sj >= (long) source.height)) continue;
+        for (long i = 0; i < size; i++) {
+            long si = xCell + i - xSource;
+            if ((si < 0) || (si >= (long) source.width)) continue;
+            tile.data[j][i] = source.data[sj][si];
+        }
+    }
+}
+
+// Escape text for an XML attribute or element.
+static std::string escapeXML(const char *text) {
+    std::string escaped;
+    for (const char *c = text; *c; c++) {
+        if (*c == '&') escaped += "&amp;";
+        else if (*c == '<') escaped += "&lt;";
+        else if (*c == '>') escaped += "&gt;";
+        else if (*c == '"') escaped += "&quot;";
+        else escaped += *c;
+    }
+    return escaped;
+}
+
+// Get the file name without its directory.
+static std::string baseName(const std::string &fileName) {
+    size_t slash = fileName.find_last_of("/\\");
+    return (slash == std::string::npos) ? fileName : fileName.substr(slash + 1);
+}
+
+// Copy a mosaic to a Cloud Optimized GeoTIFF.
+// GDAL versions before 3.1 have no COG driver, so write a tiled GeoTIFF instead.
+static bool writeCloudOptimized(const std::string &vrtFileName, const std::string &outFileName) {
+    GDALAllRegister();
+    GDALDataset *poSrcDS = (GDALDataset *) GDALOpen(vrtFileName.c_str(), GA_ReadOnly);
+    if (poSrcDS == NULL) return false;
+    char **papszOptions = NULL;
+    papszOptions = CSLSetNameValue(papszOptions, "COMPRESS", "DEFLATE");
+    papszOptions = CSLSetNameValue(papszOptions, "BIGTIFF", "IF_SAFER");
+    GDALDriver *poDriver = GetGDALDriverManager()->GetDriverByName("COG");
+    if (poDriver == NULL) {
+        poDriver = GetGDALDriverManager()->GetDriverByName("GTiff");
+        papszOptions = CSLSetNameValue(papszOptions, "TILED", "YES");
+    }
+    GDALDataset *poDstDS = NULL;
+    if (poDriver != NULL) poDstDS = poDriver->CreateCopy(outFileName.c_str(), poSrcDS, false, papszOptions, NULL, NULL);
+    CSLDestroy(papszOptions);
+    GDALClose((GDALDatasetH) poSrcDS);
+    if (poDstDS == NULL) return false;
+    GDALClose((GDALDatasetH) poDstDS);
+    return true;
+}
+
+Shr3dTiler::Shr3dTiler(const Shr3dParameters &parameters, const Shr3dTileParameters &tileParameters)
+        : params(parameters), tileParams(tileParameters), zone(0), tileCells(0), bufferCells(0), xCellOrigin(0),
+          yCellOrigin(0), numColumns(0), numRows(0) {
+    bounds = MinMaxXYZ{0, 0, 0, 0, 0, 0};
+
+    // Tiles are aligned to the same cells as the MinMaxGrid used to read them.
+    gsd = (float) params.dhMeters;
+}
+
+bool Shr3dTiler::addInput(const char *fileName) {
+    InputFile input;
+    input.fileName = fileName;
+    int inputZone = 0;
+    bool ok = PointCloud::ReadBounds(fileName, input.bounds, inputZone);
+    if (!ok) return false;
+    if (inputs.empty()) {
+        bounds = input.bounds;
+        zone = inputZone;
+    } else {
+        if (inputZone != zone) printf("Warning: %s is in UTM zone %d, not %d.\n", fileName, inputZone, zone);
+        bounds.xMin = std::min(bounds.xMin, input.bounds.xMin);
+        bounds.xMax = std::max(bounds.xMax, input.bounds.xMax);
+        bounds.yMin = std::min(bounds.yMin, input.bounds.yMin);
+        bounds.yMax = std::max(bounds.yMax, input.bounds.yMax);
+        bounds.zMin = std::min(bounds.zMin, input.bounds.zMin);
+        bounds.zMax = std::max(bounds.zMax, input.bounds.zMax);
+    }
+    inputs.push_back(input);
+    return true;
+}
+
+bool Shr3dTiler::run(const char *outputPrefix) {
+    if (inputs.empty()) {
+        printf("Error: No inputs to tile.\n");
+        return false;
+    }
+
+    // Define the grid of tiles over the extent of all inputs.
+    tileCells = std::max(1L, (long) floor(tileParams.tileMeters / gsd + 0.5));
+    bufferCells = std::max(0L, (long) ceil(tileParams.bufferMeters / gsd));
+    xCellOrigin = (long) floor(bounds.xMin / gsd + 0.5);
+    yCellOrigin = (long) floor(bounds.yMin / gsd + 0.5);
+    numColumns = ((long) floor(bounds.xMax / gsd + 0.5) - xCellOrigin) / tileCells + 1;
+    numRows = ((long) floor(bounds.yMax / gsd + 0.5) - yCellOrigin) / tileCells + 1;
+    printf("Tiling %lu inputs into %ld x %ld tiles of %ld pixels with %ld pixel buffers.\n",
+           (unsigned long) inputs.size(), numColumns, numRows, tileCells, bufferCells);
+    std::vector<Tile> tiles;
+    for (long row = 0; row < numRows; row++) {
+        for (long column = 0; column < numColumns; column++) {
+            tiles.push_back(Tile{column, row, false, false, std::vector<size_t>()});
+        }
+    }
+
+    // Stream each input once, spilling its points to the tiles they fall in.
+    std::string prefix(outputPrefix);
+    std::vector<char> spilled(inputs.size(), 0);
+    pubgeo::parallelFor((long) inputs.size(), tileParams.numThreads, [&](long k, unsigned int) {
+        try {
+            spilled[k] = spillInput(inputs[k], (size_t) k, prefix);
+        } catch (std::exception &e) {
+            printf("Error reading %s: %s\n", inputs[k].fileName.c_str(), e.what());
+        } catch (char const *err) {
+            printf("Error reading %s: %s\n", inputs[k].fileName.c_str(), err);
+        }
+    });
+    bool spillOk = true;
+    for (size_t k = 0; k < inputs.size(); k++) {
+        if (!spilled[k]) {
+            printf("Error: Failed to read %s\n", inputs[k].fileName.c_str());
+            spillOk = false;
+        }
+        for (size_t t = 0; t < inputs[k].tiles.size(); t++) tiles[inputs[k].tiles[t]].inputs.push_back(k);
+    }
+    if (!spillOk) {
+        for (size_t t = 0; t < tiles.size(); t++) {
+            for (size_t k = 0; k < tiles[t].inputs.size(); k++)
+                remove(spillFileName(prefix, tiles[t].column, tiles[t].row, tiles[t].inputs[k]).c_str());
+        }
+        return false;
+    }
+
+    // Classify tiles in parallel from their spilled points.
+    // Each tile with points reserves its estimated memory from the budget before it starts.
+    long bufferedCells = tileCells + 2 * bufferCells;
+    unsigned long long tileMemory = (unsigned long long) (bufferedCells * bufferedCells) * TILE_MEMORY_PER_PIXEL;
+    pubgeo::MemoryBudget budget((unsigned long long) (tileParams.memoryMB * 1024.0 * 1024.0));
+    pubgeo::parallelFor((long) tiles.size(), tileParams.numThreads, [&](long k, unsigned int) {
+        unsigned long long reserved = tiles[k].inputs.empty() ? 0 : budget.acquire(tileMemory);
+        try {
+            tiles[k].ok = processTile(tiles[k], prefix);
+        } catch (std::exception &e) {
+            printf("Error processing tile %ld, %ld: %s\n", tiles[k].column, tiles[k].row, e.what());
+        } catch (char const *err) {
+            printf("Error processing tile %ld, %ld: %s\n", tiles[k].column, tiles[k].row, err);
+        }
+        budget.release(reserved);
+    });
+
+    // Report any tiles that failed.
+    long numWritten = 0;
+    long numFailed = 0;
+    for (size_t k = 0; k < tiles.size(); k++) {
+        if (!tiles[k].ok) {
+            numFailed++;
+            printf("  FAILED tile %ld, %ld\n", tiles[k].column, tiles[k].row);
+        } else if (!tiles[k].empty) {
+            numWritten++;
+        }
+    }
+    printf("Wrote %ld tiles, %ld failed.\n", numWritten, numFailed);
+    if (numWritten == 0) return false;
+
+    // Mosaic each product.
+    ScopedTimer timer("mosaic");
+    bool ok = (numFailed == 0);
+    for (int p = 0; p < NUM_TILE_PRODUCTS; p++) {
+        ok &= writeMosaic(prefix, TILE_PRODUCTS[p], TILE_PRODUCT_IS_FLOAT[p], tiles);
+    }
+    if (tileParams.footprints) ok &= writeFootprintMosaic(prefix, tiles);
+    return ok;
+}
+
+// Stream one input and append each point to the spill file of every buffered tile it falls in.
+// Buffers are only kept for the tiles this input touches, so memory depends on the extent of one input.
+bool Shr3dTiler::spillInput(InputFile &input, size_t index, const std::string &outputPrefix) {
+    ScopedTimer timer("streamPoints");
+    std::unordered_map<long, std::vector<double> > buffers;
+    bool ok = true;
+    std::function<void(double, double, double)> addPoint = [&](double x, double y, double z) {
+        // A cell is in the buffered tile c when c * tileCells - bufferCells <= cell < (c + 1) * tileCells + bufferCells.
+        long cx = (long) floor(x / gsd + 0.5) - xCellOrigin;
+        long cy = (long) floor(y / gsd + 0.5) - yCellOrigin;
+        long column0 = std::max(0L, (long) floor((double) (cx - bufferCells) / tileCells));
+        long column1 = std::min(numColumns - 1, (long) floor((double) (cx + bufferCells) / tileCells));
+        long row0 = std::max(0L, (long) floor((double) (cy - bufferCells) / tileCells));
+        long row1 = std::min(numRows - 1, (long) floor((double) (cy + bufferCells) / tileCells));
+        for (long row = row0; row <= row1; row++) {
+            for (long column = column0; column <= column1; column++) {
+                long t = row * numColumns + column;
+                std::vector<double> &xyz = buffers[t];
+                if (xyz.capacity() == 0) {
+                    xyz.reserve(3 * SPILL_BUFFER_POINTS);
+                    input.tiles.push_back(t);
+                    ok &= createSpill(spillFileName(outputPrefix, column, row, index));
+                }
+                xyz.push_back(x);
+                xyz.push_back(y);
+                xyz.push_back(z);
+                if (xyz.size() >= 3 * SPILL_BUFFER_POINTS)
+                    ok &= appendSpill(spillFileName(outputPrefix, column, row, index), xyz);
+            }
+        }
+    };
+    ok &= PointCloud::StreamPoints(input.fileName.c_str(), addPoint);
+    for (auto &buffer : buffers) {
+        long column = buffer.first % numColumns;
+        long row = buffer.first / numColumns;
+        ok &= appendSpill(spillFileName(outputPrefix, column, row, index), buffer.second);
+    }
+    return ok;
+}
+
+bool Shr3dTiler::processTile(Tile &tile, const std::string &outputPrefix) {
+    ScopedTimer timer("tile");
+
+    // Read the points spilled to the buffered tile from each input. Every spill file is deleted once read.
+    MinMaxGrid grid((float) gsd);
+    bool spillOk = true;
+    for (size_t k = 0; k < tile.inputs.size(); k++) {
+        ScopedTimer spillTimer("readSpill");
+        spillOk &= readSpill(spillFileName(outputPrefix, tile.column, tile.row, tile.inputs[k]), grid);
+    }
+    if (!spillOk) return false;
+    if (grid.empty()) {
+        tile.empty = true;
+        return true;
+    }
+
+    // Each tile is quantized with its own offset and scale. Classify with 16-bit elevations unless a spurious
+    // return or steep terrain makes this tile's step coarser than a small fraction of DZ, so only such tiles pay
+    // for float32 elevations.
+    if (needsFloat32(grid.bounds.zMin, grid.bounds.zMax, params.dzMeters)) {
+        printf("Tile %ld, %ld spans %.1f meters of elevation; classifying it with float32 elevations.\n",
+               tile.column, tile.row, grid.bounds.zMax - grid.bounds.zMin);
+        return classifyTile<float>(tile, grid, outputPrefix);
+    }
+    return classifyTile<unsigned short>(tile, grid, outputPrefix);
+}
+
+// Classify a buffered tile with elevations of type ELEV, then crop and write its products.
+template<class ELEV>
+bool Shr3dTiler::classifyTile(Tile &tile, MinMaxGrid &grid, const std::string &outputPrefix) {
+    // Get the cells of this tile.
+    long xCell = xCellOrigin + tile.column * tileCells;
+    long yCell = yCellOrigin + tile.row * tileCells;
+
+    // Classify the buffered tile.
+    BasicShr3dPipeline<ELEV> pipeline(params);
+    bool ok = pipeline.readPointGrid(grid, zone);
+    if (!ok) return false;
+    grid.clear();
+    pipeline.classify();
+
+    // Crop the buffer from each product and write it.
+    OrthoImage<ELEV> elevationTile;
+    OrthoImage<unsigned char> byteTile;
+    std::string fileName = tileFileName(outputPrefix, tile.column, tile.row, "DSM");
+    cropImage(pipeline.dsmImage, xCell, yCell, tileCells, elevationTile);
+    ok &= elevationTile.write(const_cast<char *>(fileName.c_str()), true, tileParams.egm96);
+    fileName = tileFileName(outputPrefix, tile.column, tile.row, "DTM");
+    cropImage(pipeline.dtmImage, xCell, yCell, tileCells, elevationTile);
+    ok &= elevationTile.write(const_cast<char *>(fileName.c_str()), true, tileParams.egm96);
+    fileName = tileFileName(outputPrefix, tile.column, tile.row, "class");
+    cropImage(pipeline.classImage, xCell, yCell, tileCells, byteTile);
+    ok &= byteTile.write(const_cast<char *>(fileName.c_str()), false, tileParams.egm96);
+    OrthoImage<unsigned char> buildingImage;
+    pipeline.getBuildingImage(buildingImage);
+    fileName = tileFileName(outputPrefix, tile.column, tile.row, "buildings");
+    cropImage(buildingImage, xCell, yCell, tileCells, byteTile);
+    ok &= byteTile.write(const_cast<char *>(fileName.c_str()), false, tileParams.egm96);
+
+    // Trace footprints from the buffered tile, so buildings crossing its edge are whole if they fit in the buffer.
+    // Only buildings whose bounding box starts within the tile are written, so each is written by one tile.
+    if (tileParams.footprints) {
+        OrthoImage<unsigned char> &classImage = pipeline.classImage;
+        long xSource = lround(classImage.easting / classImage.gsd);
+        long ySource = lround(classImage.northing / classImage.gsd);
+        FootprintWindow window;
+        window.xmin = xCell - xSource;
+        window.xmax = xCell + tileCells - 1 - xSource;
+        window.ymin = (long) classImage.height - 1 - (yCell + tileCells - 1 - ySource);
+        window.ymax = (long) classImage.height - 1 - (yCell - ySource);
+        double simplifyMeters = (tileParams.simplifyMeters < 0.0) ? classImage.gsd : tileParams.simplifyMeters;
+        fileName = tileFileName(outputPrefix, tile.column, tile.row, "buildings", "geojson");
+        ok &= BuildingFootprints::writeGeoJSON(fileName.c_str(), classImage, pipeline.dsmImage, pipeline.dtmImage,
+                                               simplifyMeters, 1, &window);
+    }
+    return ok;
+}
+
+// Write one GeoJSON file with the footprints of all tiles that were written.
+// Features are copied line by line from the tile files and numbered again so IDs are unique.
+bool Shr3dTiler::writeFootprintMosaic(const std::string &outputPrefix, const std::vector<Tile> &tiles) {
+    std::string fileName = outputPrefix + "_buildings.geojson";
+    FILE *fptr = fopen(fileName.c_str(), "w");
+    if (!fptr) return false;
+    int epsg = (zone >= 0) ? 32600 + zone : 32700 - zone;
+    fprintf(fptr, "{\"type\":\"FeatureCollection\",\n");
+    fprintf(fptr, "\"crs\":{\"type\":\"name\",\"properties\":{\"name\":\"urn:ogc:def:crs:EPSG::%d\"}},\n", epsg);
+    fprintf(fptr, "\"features\":[\n");
+    bool ok = true;
+    size_t prefixLength = strlen(FEATURE_PREFIX);
+    unsigned long numWritten = 0;
+    for (size_t k = 0; k < tiles.size(); k++) {
+        if (!tiles[k].ok || tiles[k].empty) continue;
+        std::string tileName = tileFileName(outputPrefix, tiles[k].column, tiles[k].row, "buildings", "geojson");
+        std::ifstream tileFile(tileName.c_str());
+        if (!tileFile) {
+            printf("Error: Failed to read %s\n", tileName.c_str());
+            ok = false;
+            continue;
+        }
+        std::string line;
+        while (std::getline(tileFile, line)) {
+            if (line.compare(0, prefixLength, FEATURE_PREFIX) != 0) continue;
+            if (!line.empty() && (line[line.size() - 1] == ',')) line.erase(line.size() - 1);
+            size_t idEnd = line.find(',', prefixLength);
+            if (idEnd == std::string::npos) continue;
+            numWritten++;
+            fprintf(fptr, "%s%s%lu%s", (numWritten > 1) ? ",\n" : "", FEATURE_PREFIX, numWritten,
+                    line.c_str() + idEnd);
+        }
+    }
+    fprintf(fptr, "%s]}\n", (numWritten > 0) ? "\n" : "");
+    ok &= !ferror(fptr);
+    ok &= (fclose(fptr) == 0);
+    if (ok) printf("Wrote %lu building footprints to %s\n", numWritten, fileName.c_str());
+    return ok;
+}
+
+// Write a VRT mosaic of one product from all tiles that were written.
+// Tiles share one grid and do not overlap, so each is a simple source placed by its column and row.
+bool Shr3dTiler::writeMosaic(const std::string &outputPrefix, const char *product, bool isFloat,
+                             const std::vector<Tile> &tiles) {
+    // Copy the spatial reference from the first tile.
+    std::string srs;
+    for (size_t k = 0; (k < tiles.size()) && srs.empty(); k++) {
+        if (!tiles[k].ok || tiles[k].empty) continue;
+        std::string fileName = tileFileName(outputPrefix, tiles[k].column, tiles[k].row, product);
+        GDALAllRegister();
+        GDALDataset *poDataset = (GDALDataset *) GDALOpen(fileName.c_str(), GA_ReadOnly);
+        if (poDataset == NULL) continue;
+        srs = poDataset->GetProjectionRef();
+        GDALClose((GDALDatasetH) poDataset);
+    }
+
+    std::string vrtFileName = outputPrefix + "_" + product + ".vrt";
+    std::ofstream vrt(vrtFileName.c_str());
+    if (!vrt) return false;
+    long width = numColumns * tileCells;
+    long height = numRows * tileCells;
+    char line[1024];
+    sprintf(line, "<VRTDataset rasterXSize=\"%ld\" rasterYSize=\"%ld\">\n", width, height);
+    vrt << line;
+    vrt << "  <SRS>" << escapeXML(srs.c_str()) << "</SRS>\n";
+    sprintf(line, "  <GeoTransform>%.10f, %.10f, 0, %.10f, 0, %.10f</GeoTransform>\n", xCellOrigin * gsd, gsd,
+            (yCellOrigin + height) * gsd, -gsd);
+    vrt << line;
+    sprintf(line, "  <VRTRasterBand dataType=\"%s\" band=\"1\">\n", isFloat ? "Float32" : "Byte");
+    vrt << line;
+    if (isFloat) vrt << "    <NoDataValue>-10000</NoDataValue>\n";
+    for (size_t k = 0; k < tiles.size(); k++) {
+        if (!tiles[k].ok || tiles[k].empty) continue;
+        std::string fileName = tileFileName(outputPrefix, tiles[k].column, tiles[k].row, product);
+        vrt << "    <SimpleSource>\n";
+        vrt << "      <SourceFilename relativeToVRT=\"1\">" << escapeXML(baseName(fileName).c_str())
+            << "</SourceFilename>\n";
+        vrt << "      <SourceBand>1</SourceBand>\n";
+        sprintf(line, "      <SrcRect xOff=\"0\" yOff=\"0\" xSize=\"%ld\" ySize=\"%ld\"/>\n", tileCells, tileCells);
+        vrt << line;
+        sprintf(line, "      <DstRect xOff=\"%ld\" yOff=\"%ld\" xSize=\"%ld\" ySize=\"%ld\"/>\n",
+                tiles[k].column * tileCells, (numRows - 1 - tiles[k].row) * tileCells, tileCells, tileCells);
+        vrt << line;
+        vrt << "    </SimpleSource>\n";
+    }
+    vrt << "  </VRTRasterBand>\n";
+    vrt << "</VRTDataset>\n";
+    vrt.close();
+    if (!vrt) return false;
+    printf("Wrote mosaic %s\n", vrtFileName.c_str());
+
+    // Optionally copy the mosaic to a single Cloud Optimized GeoTIFF.
+    if (tileParams.cog) {
+        std::string cogFileName = outputPrefix + "_" + product + ".tif";
+        if (!writeCloudOptimized(vrtFileName, cogFileName)) {
+            printf("Error: Failed to write %s\n", cogFileName.c_str());
+            return false;
+        }
+        printf("Wrote mosaic %s\n", cogFileName.c_str());
+    }
+    return true;
+}
@@ -0,0 +1,87 @@
+// Copyright 2017 The Johns Hopkins University Applied Physics Laboratory.
+// Licensed under the MIT License. See LICENSE.txt in the project root for full license information.
+
+// tiles.h
+//
+
+#ifndef PUBGEO_SHR3D_TILES_H
+#define PUBGEO_SHR3D_TILES_H
+
+#include <string>
+#include <vector>
+#include "pipeline.h"
+
+namespace shr3d {
+    typedef struct {
+        double tileMeters;          // Width of each output tile (meters)
+        double bufferMeters;        // Overlap processed around each tile and then cropped (meters)
+        unsigned int numThreads;    // Tiles processed at once; zero for all cores
+        double memoryMB;            // Memory budget for tiles processed at once (MB); zero for unlimited
+        bool egm96;                 // Write vertical datum = EGM96
+        bool cog;                   // Also write each mosaic as a Cloud Optimized GeoTIFF
+        bool footprints;            // Also write building footprints for each tile and for the mosaic
+        double simplifyMeters;      // Footprint simplification tolerance (meters); negative for one pixel
+    } Shr3dTileParameters;
+
+//
+// Tiled SHR3D for extents too large to classify in one raster.
+// The extent of all inputs is split into a grid of tiles. Each tile is classified with a buffer of overlap,
+// cropped back to its own extent, and written as GeoTIFF. Products are then mosaicked with a VRT.
+// Each input is streamed once and its points are spilled to a temporary file for each buffered tile they fall in,
+// so memory use depends on the tile size rather than the extent, and reading does not grow with the tile count.
+// Points are gridded with a 16-bit step per grid tile, and each tile is classified with its own 16-bit offset and
+// scale. A tile whose relief would make that step coarse is classified with float32 elevations instead.
+//
+    class Shr3dTiler {
+    public:
+        Shr3dTiler(const Shr3dParameters &parameters, const Shr3dTileParameters &tileParameters);
+
+        // Add a point cloud file. Only its header is read here.
+        bool addInput(const char *fileName);
+
+        // Classify all tiles and write tile products and mosaics named with the output prefix.
+        bool run(const char *outputPrefix);
+
+    private:
+        typedef struct {
+            std::string fileName;
+            MinMaxXYZ bounds;
+            std::vector<long> tiles;    // Tiles this input spilled points to
+        } InputFile;
+
+        typedef struct {
+            long column;
+            long row;
+            bool ok;
+            bool empty;
+            std::vector<size_t> inputs; // Inputs that spilled points to this tile
+        } Tile;
+
+        Shr3dParameters params;
+        Shr3dTileParameters tileParams;
+        std::vector<InputFile> inputs;
+        MinMaxXYZ bounds;
+        int zone;
+        double gsd;
+        long tileCells;
+        long bufferCells;
+        long xCellOrigin;
+        long yCellOrigin;
+        long numColumns;
+        long numRows;
+
+        bool spillInput(InputFile &input, size_t index, const std::string &outputPrefix);
+
+        bool processTile(Tile &tile, const std::string &outputPrefix);
+
+        template<class ELEV>
+        bool classifyTile(Tile &tile, MinMaxGrid &grid, const std::string &outputPrefix);
+
+        bool writeMosaic(const std::string &outputPrefix, const char *product, bool isFloat,
+                         const std::vector<Tile> &tiles);
+
+        bool writeFootprintMosaic(const std::string &outputPrefix, const std::vector<Tile> &tiles);
+    };
+}
+
+#endif // PUBGEO_SHR3D_TILES_H